@@ -0,0 +1,146 @@
+/**
+* access_log.c formats the access log on a thread of its own, see `access_log.h`.
+*/
+
+#include "access_log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dht.h"
+#include "util.h"
+
+// How long the logging thread sleeps when the ring is empty
+#define ACCESS_LOG_IDLE_NS 10000000L
+
+struct access_log access_log = {
+    .level = ACCESS_LOG_ALL,
+    .sample = 1,
+    .sample_countdown = 1,
+};
+
+// Our ID, copied as the event loop owns `self`
+static dht_id self_id;
+
+static const char* const method_names[HTTP_OTHER + 1] = {
+    [HTTP_GET] = "GET",
+    [HTTP_PUT] = "PUT",
+    [HTTP_DELETE] = "DELETE",
+    [HTTP_POST] = "POST",
+    [HTTP_OTHER] = "OTHER",
+};
+
+
+void access_log_request(const struct request* request, int status) {
+    if (access_log.level == ACCESS_LOG_OFF || (access_log.level == ACCESS_LOG_ERRORS && status < 400)) {
+        return;
+    }
+    if (--access_log.sample_countdown > 0) {
+        return;
+    }
+    access_log.sample_countdown = access_log.sample;
+
+    const size_t tail = atomic_load_explicit(&access_log.tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&access_log.head, memory_order_acquire) == ACCESS_LOG_ENTRIES) {
+        atomic_fetch_add_explicit(&access_log.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct access_record* record = &access_log.records[tail % ACCESS_LOG_ENTRIES];
+    const size_t uri_length = request->uri_length < ACCESS_LOG_URI_SIZE ? request->uri_length : ACCESS_LOG_URI_SIZE;
+    record->payload_length = request->payload_length > 0 ? request->payload_length : 0;
+    record->status = status;
+    record->method = request->method_id;
+    record->uri_length = uri_length;
+    memcpy(record->uri, request->uri, uri_length);
+    atomic_store_explicit(&access_log.tail, tail + 1, memory_order_release);
+}
+
+
+/**
+ * Write the formatted lines in `out` to `stderr`
+ */
+static void drain(char* out, size_t* length) {
+    size_t written = 0;
+    while (written < *length) {
+        const ssize_t n = write(STDERR_FILENO, out + written, *length - written);
+        if (n == -1) {
+            break;  // Nowhere to log to, drop the lines
+        }
+        written += n;
+    }
+    *length = 0;
+}
+
+
+/**
+ * Body of the logging thread: format all records, sleep while there are none
+ */
+static void* access_log_consume(void* arg) {
+    (void) arg;
+    static char out[1 << 16];
+    size_t length = 0;
+    uint64_t reported_drops = 0;
+
+    while (true) {
+        const size_t tail = atomic_load_explicit(&access_log.tail, memory_order_acquire);
+        size_t head = atomic_load_explicit(&access_log.head, memory_order_relaxed);
+
+        for (; head != tail; head += 1) {
+            const struct access_record* record = &access_log.records[head % ACCESS_LOG_ENTRIES];
+            if (sizeof out - length < ACCESS_LOG_URI_SIZE + 128) {
+                drain(out, &length);
+            }
+            length += snprintf(out + length, sizeof out - length, "%hu: %s %.*s %hu (%lu byte payload)%s\n", self_id,
+                               method_names[record->method], (int) record->uri_length, record->uri, record->status,
+                               record->payload_length, record->uri_length == ACCESS_LOG_URI_SIZE ? " [uri truncated]" : "");
+        }
+        atomic_store_explicit(&access_log.head, head, memory_order_release);
+
+        const uint64_t drops = atomic_load_explicit(&access_log.dropped, memory_order_relaxed);
+        if (drops != reported_drops) {
+            length += snprintf(out + length, sizeof out - length, "%hu: Dropped %lu access log records\n", self_id,
+                               drops - reported_drops);
+            reported_drops = drops;
+        }
+
+        if (length > 0) {
+            drain(out, &length);
+        } else {
+            const struct timespec idle = { .tv_nsec = ACCESS_LOG_IDLE_NS };
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+void access_log_start(void) {
+    self_id = self.id;
+    const char* level = getenv("ACCESS_LOG");
+    if (level && strcasecmp(level, "off") == 0) {
+        access_log.level = ACCESS_LOG_OFF;
+        return;
+    } else if (level && strcasecmp(level, "errors") == 0) {
+        access_log.level = ACCESS_LOG_ERRORS;
+    }
+
+    const char* sample = getenv("ACCESS_LOG_SAMPLE");
+    if (sample) {
+        access_log.sample = checked_strtoul(sample, 0, UINT32_MAX, "Failed to parse ACCESS_LOG_SAMPLE");
+        if (access_log.sample == 0) {
+            access_log.sample = 1;
+        }
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, access_log_consume, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
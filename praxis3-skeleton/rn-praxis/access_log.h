@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "http.h"
+
+
+/**
+ * Number of records the ring holds, a power of two
+ */
+#define ACCESS_LOG_ENTRIES 4096
+
+/**
+ * URIs longer than this are truncated in the log
+ */
+#define ACCESS_LOG_URI_SIZE 96
+
+
+/**
+ * Which requests are logged
+ *
+ * `ACCESS_LOG_ERRORS` only logs requests answered with a status of 400 or
+ * above, including 503 while lookups are underway.
+ */
+enum access_log_level {
+    ACCESS_LOG_OFF,
+    ACCESS_LOG_ERRORS,
+    ACCESS_LOG_ALL,
+};
+
+/**
+ * A request as recorded by the event loop, formatted later
+ */
+struct access_record {
+    uint64_t payload_length;
+    uint16_t status;
+    uint8_t method;
+    uint8_t uri_length;
+    char uri[ACCESS_LOG_URI_SIZE];
+};
+
+/**
+ * The state of the access log
+ *
+ * A single-producer, single-consumer ring: the event loop appends at `tail`,
+ * the logging thread formats and advances `head`. Both only grow, indices
+ * into `records` are taken modulo `ACCESS_LOG_ENTRIES`. When the ring is
+ * full, records are dropped rather than waiting for the consumer.
+ *
+ * `sample`, `sample_countdown`: only every `sample`th request passing `level`
+ *                is recorded, starting with the first
+ * `dropped`: records lost to a full ring, read by the logging thread
+ */
+struct access_log {
+    enum access_log_level level;
+    uint32_t sample;
+    uint32_t sample_countdown;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint_fast64_t dropped;
+    struct access_record records[ACCESS_LOG_ENTRIES];
+};
+
+extern struct access_log access_log;
+
+
+/**
+ * Start the thread formatting records to `stderr`
+ *
+ * The level and sampling rate are taken from the environment variables
+ * `ACCESS_LOG` (`off`, `errors` or `all`, the default) and
+ * `ACCESS_LOG_SAMPLE` (1 by default, logging every request).
+ */
+void access_log_start(void);
+
+/**
+ * Record a request answered with the given status
+ *
+ * Never blocks, copying the request's details is all the event loop does.
+ */
+void access_log_request(const struct request* request, int status);
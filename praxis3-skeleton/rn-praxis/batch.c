@@ -0,0 +1,363 @@
+/**
+* batch.c forwards parts of a batch to the responsible peers over persistent, non-blocking connections.
+*/
+
+#include "batch.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "client.h"
+
+#define BATCH_MAX_PARTS 64
+
+
+/**
+ * Records forwarded to a peer within a single `/_batch/local` request
+ *
+ * `indices` maps the position of a record within the forwarded request to
+ * its position within the client's request.
+ */
+struct part {
+    struct batch* batch;
+    uint32_t* indices;
+    size_t n_indices;
+};
+
+
+/**
+ * A persistent connection to another peer
+ *
+ * Requests are pipelined, so responses answer the parts in `parts` in
+ * order. `sock` is only valid while the link is `open`.
+ */
+struct link {
+    bool open;
+    struct peer peer;
+    int sock;
+    struct buffer out;
+    size_t out_sent;
+    struct buffer in;
+    struct part parts[BATCH_MAX_PARTS];
+    size_t n_parts;
+};
+
+
+static struct link links[BATCH_MAX_LINKS];
+
+
+/**
+ * Send a chunk of the batch's chunked response, an empty one terminates it
+ */
+static void send_chunk(struct batch* batch, const char* data, size_t n) {
+    if (batch->sock == -1) {
+        return;
+    }
+
+    char size[32];
+    struct iovec iov[] = {
+        { .iov_base = size, .iov_len = sprintf(size, "%lx\r\n", n) },
+        { .iov_base = (char*) data, .iov_len = n },
+        { .iov_base = "\r\n", .iov_len = 2 },
+    };
+    struct msghdr message = {
+        .msg_iov = iov,
+        .msg_iovlen = sizeof iov / sizeof iov[0],
+    };
+    if (sendmsg(batch->sock, &message, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        batch->sock = -1;
+    }
+}
+
+
+/**
+ * Account for a completed part, terminating the response after the last one
+ */
+static void part_done(struct batch* batch) {
+    batch->n_parts -= 1;
+    if (batch->n_parts > 0) {
+        return;
+    }
+
+    send_chunk(batch, NULL, 0);
+    if (batch->done) {
+        batch->done(batch);
+    }
+    free(batch);
+}
+
+
+struct batch* batch_start(int sock, void (*done)(struct batch* batch), void* context) {
+    const string head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n\r\n";
+    if (send(sock, head, strlen(head), MSG_NOSIGNAL) == -1) {
+        perror("send");
+        sock = -1;
+    }
+
+    struct batch* batch = malloc(sizeof(struct batch));
+    *batch = (struct batch) {
+        .sock = sock,
+        .n_parts = 1,  // The local part
+        .done = done,
+        .context = context,
+    };
+    return batch;
+}
+
+
+void batch_send_results(struct batch* batch, const struct buffer* results) {
+    if (results->length > 0) {
+        send_chunk(batch, results->data, results->length);
+    }
+}
+
+
+void batch_finish_local(struct batch* batch) {
+    part_done(batch);
+}
+
+
+void batch_abandon(struct batch* batch) {
+    batch->sock = -1;
+    batch->done = NULL;
+}
+
+
+/**
+ * Answer all records of a part with the given status
+ */
+static void part_fail(struct part* part, uint16_t status) {
+    struct buffer results = {0};
+    for (size_t i = 0; i < part->n_indices; i += 1) {
+        batch_encode_result(&results, part->indices[i], status, NULL, 0);
+    }
+    batch_send_results(part->batch, &results);
+    free(results.data);
+
+    free(part->indices);
+    part_done(part->batch);
+}
+
+
+/**
+ * Close a link, failing all parts still waiting for a response
+ */
+static void link_close(struct link* link) {
+    close(link->sock);
+    link->open = false;
+    for (size_t i = 0; i < link->n_parts; i += 1) {
+        part_fail(&link->parts[i], 503);
+    }
+    link->n_parts = 0;
+    link->out.length = 0;
+    link->out_sent = 0;
+    link->in.length = 0;
+}
+
+
+/**
+ * Return the link to the given peer, connecting a new one if necessary
+ *
+ * Returns NULL if all links are busy or no connection can be initiated.
+ */
+static struct link* link_get(const struct peer* peer) {
+    struct link* idle = NULL;
+    for (size_t i = 0; i < BATCH_MAX_LINKS; i += 1) {
+        struct link* link = &links[i];
+        if (link->open && link->peer.ip.s_addr == peer->ip.s_addr && link->peer.port == peer->port) {
+            return (link->n_parts < BATCH_MAX_PARTS) ? link : NULL;
+        }
+        if (!idle && (!link->open || link->n_parts == 0)) {
+            idle = link;
+        }
+    }
+    if (!idle) {
+        return NULL;
+    }
+    if (idle->open) {
+        link_close(idle);  // Reuse the slot of a link without pending parts
+    }
+
+    struct sockaddr_in addr;
+    peer_to_sockaddr(peer, &addr);
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) {
+        perror("socket");
+        return NULL;
+    }
+    if (connect(sock, (struct sockaddr*) &addr, sizeof addr) == -1 && errno != EINPROGRESS) {
+        close(sock);
+        return NULL;
+    }
+    const int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+
+    idle->open = true;
+    idle->peer = *peer;
+    idle->sock = sock;
+    return idle;
+}
+
+
+void batch_forward(struct batch* batch, const struct peer* peer, const struct buffer* records,
+                   const uint32_t* indices, size_t n_indices) {
+    struct part part = {
+        .batch = batch,
+        .indices = malloc(n_indices * sizeof(uint32_t)),
+        .n_indices = n_indices,
+    };
+    memcpy(part.indices, indices, n_indices * sizeof(uint32_t));
+    batch->n_parts += 1;
+
+    struct link* link = link_get(peer);
+    if (!link) {
+        part_fail(&part, 503);
+        return;
+    }
+
+    char head[128];
+    const int head_length = sprintf(head, "POST /_batch/local HTTP/1.1\r\nContent-Length: %lu\r\n\r\n", records->length);
+    memcpy(buffer_append(&link->out, head_length), head, head_length);
+    memcpy(buffer_append(&link->out, records->length), records->data, records->length);
+    link->parts[link->n_parts] = part;
+    link->n_parts += 1;
+}
+
+
+size_t batch_pollfds(struct pollfd* fds) {
+    for (size_t i = 0; i < BATCH_MAX_LINKS; i += 1) {
+        fds[i] = (struct pollfd) {
+            .fd = links[i].open ? links[i].sock : -1,
+            .events = POLLIN | ((links[i].out_sent < links[i].out.length) ? POLLOUT : 0),
+        };
+    }
+    return BATCH_MAX_LINKS;
+}
+
+
+/**
+ * Send as much of the link's queued requests as the socket accepts
+ */
+static bool link_send(struct link* link) {
+    while (link->out_sent < link->out.length) {
+        ssize_t sent = send(link->sock, link->out.data + link->out_sent, link->out.length - link->out_sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN;
+        }
+        link->out_sent += sent;
+    }
+    link->out.length = 0;
+    link->out_sent = 0;
+    return true;
+}
+
+
+/**
+ * Translate the results of a forwarded part to the client's indices
+ */
+static void part_complete(struct part* part, const struct client_response* response) {
+    if (response->status != 200) {
+        part_fail(part, 503);
+        return;
+    }
+
+    struct buffer results = {0};
+    const char* pos = response->body;
+    const char* end = response->body + response->body_length;
+    while (end - pos >= BATCH_RESULT_HEADER_SIZE) {
+        uint32_t index;
+        uint32_t value_length;
+        memcpy(&index, pos, sizeof index);
+        memcpy(&value_length, pos + 6, sizeof value_length);
+        index = ntohl(index);
+        value_length = ntohl(value_length);
+        if (index >= part->n_indices || value_length > (size_t) (end - pos) - BATCH_RESULT_HEADER_SIZE) {
+            break;
+        }
+
+        // Only the index differs from what the peer sent
+        char* result = buffer_append(&results, BATCH_RESULT_HEADER_SIZE + value_length);
+        memcpy(result, pos, BATCH_RESULT_HEADER_SIZE + value_length);
+        const uint32_t client_index = htonl(part->indices[index]);
+        memcpy(result, &client_index, sizeof client_index);
+
+        pos += BATCH_RESULT_HEADER_SIZE + value_length;
+    }
+    batch_send_results(part->batch, &results);
+    free(results.data);
+
+    free(part->indices);
+    part_done(part->batch);
+}
+
+
+/**
+ * Receive responses on a link and complete the parts they answer
+ */
+static bool link_receive(struct link* link) {
+    while (true) {
+        if (link->in.capacity - link->in.length < HTTP_MAX_SIZE) {
+            buffer_append(&link->in, HTTP_MAX_SIZE);
+            link->in.length -= HTTP_MAX_SIZE;
+        }
+        ssize_t n = recv(link->sock, link->in.data + link->in.length, link->in.capacity - link->in.length, 0);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        } else if (n == 0) {
+            return false;
+        }
+        link->in.length += n;
+    }
+
+    size_t consumed = 0;
+    struct client_response response;
+    ssize_t parsed;
+    while (link->n_parts > 0
+           && (parsed = client_parse_response(link->in.data + consumed, link->in.length - consumed, &response)) != 0) {
+        if (parsed == -1) {
+            return false;
+        }
+        struct part part = link->parts[0];
+        link->n_parts -= 1;
+        memmove(&link->parts[0], &link->parts[1], link->n_parts * sizeof(struct part));
+        part_complete(&part, &response);
+        consumed += parsed;
+    }
+
+    memmove(link->in.data, link->in.data + consumed, link->in.length - consumed);
+    link->in.length -= consumed;
+    return true;
+}
+
+
+void batch_handle_events(const struct pollfd* fds, size_t n) {
+    for (size_t i = 0; i < n && i < BATCH_MAX_LINKS; i += 1) {
+        struct link* link = &links[i];
+        if (!link->open || fds[i].fd != link->sock) {
+            continue;
+        }
+
+        bool ok = true;
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ok = link_receive(link);
+        }
+        if (ok && (fds[i].revents & POLLOUT)) {
+            ok = link_send(link);
+        }
+        if (!ok) {
+            link_close(link);
+        }
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dht.h"
+#include "util.h"
+
+#define BATCH_MAX_LINKS 16
+
+/**
+ * Wire format of `/_batch` bodies, all integers in network byte order
+ *
+ * Requests consist of records
+ *
+ *   | op (1) | key length (2) | value length (4) | key | value |
+ *
+ * where keys are URIs and only PUTs carry a value. Results refer to the
+ * request record they answer by its position:
+ *
+ *   | index (4) | status (2) | value length (4) | value |
+ *
+ * `status` is the HTTP status a single request would have yielded. Records
+ * whose responsible peer cannot be determined or reached yield 503, records
+ * a peer is not responsible for when answering `/_batch/local` yield 421.
+ */
+#define BATCH_REQUEST_HEADER_SIZE 7
+#define BATCH_RESULT_HEADER_SIZE 10
+
+enum {
+    BATCH_GET,
+    BATCH_PUT,
+    BATCH_DELETE,
+    N_BATCH_OPS,
+};
+
+
+/**
+ * A request record, referencing the memory of the parsed body
+ *
+ * `key` is not null-terminated.
+ */
+struct batch_record {
+    uint8_t op;
+    const char* key;
+    uint16_t key_length;
+    const char* value;
+    uint32_t value_length;
+};
+
+
+/**
+ * A batch request whose results are streamed to the client as chunks
+ *
+ * `sock` is the client's socket, or -1 once the client is gone. `done` is
+ * invoked when the final chunk has been sent.
+ */
+struct batch {
+    int sock;
+    size_t n_parts;
+    void (*done)(struct batch* batch);
+    void* context;
+};
+
+
+/**
+ * Parse the next request record at `data`
+ *
+ * Returns the number of bytes the record occupies, or zero if it is
+ * incomplete or malformed.
+ */
+size_t batch_parse_record(const char* data, size_t n, struct batch_record* record);
+
+/**
+ * Append a request record to `out`
+ */
+void batch_encode_record(struct buffer* out, const struct batch_record* record);
+
+/**
+ * Append a result record to `out`
+ */
+void batch_encode_result(struct buffer* out, uint32_t index, uint16_t status, const char* value, size_t value_length);
+
+/**
+ * Start a batch on the given client socket by sending the response head
+ *
+ * The returned batch is owned by the batch subsystem. Results are sent with
+ * `batch_send_results()`; remote parts with `batch_forward()`. Once all local
+ * results are sent, `batch_finish_local()` must be called.
+ */
+struct batch* batch_start(int sock, void (*done)(struct batch* batch), void* context);
+
+/**
+ * Send encoded result records as one chunk to the batch's client
+ */
+void batch_send_results(struct batch* batch, const struct buffer* results);
+
+/**
+ * Forward request records to the responsible peer via `/_batch/local`
+ *
+ * `records` holds the encoded request records and `indices` the positions
+ * of the records in the client's request. Results are sent to the client as
+ * they arrive, or 503 for all records if the peer cannot be reached.
+ */
+void batch_forward(struct batch* batch, const struct peer* peer, const struct buffer* records,
+                   const uint32_t* indices, size_t n_indices);
+
+/**
+ * Mark the local part of the batch as complete
+ */
+void batch_finish_local(struct batch* batch);
+
+/**
+ * Detach a batch from its client, e.g., after the connection was closed
+ */
+void batch_abandon(struct batch* batch);
+
+/**
+ * Fill in `pollfd`s for the connections to other peers
+ *
+ * Returns the number of entries used, at most `BATCH_MAX_LINKS`.
+ */
+size_t batch_pollfds(struct pollfd* fds);
+
+/**
+ * Handle events on the connections to other peers, as reported by `poll()` in
+ * the entries filled by `batch_pollfds()`
+ */
+void batch_handle_events(const struct pollfd* fds, size_t n);
@@ -0,0 +1,64 @@
+/**
+* batch_codec.c implements the wire format of `/_batch` and `/_load`, shared by the peers and the tools talking to them.
+*/
+
+#include "batch.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+
+size_t batch_parse_record(const char* data, size_t n, struct batch_record* record) {
+    if (n < BATCH_REQUEST_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint16_t key_length;
+    uint32_t value_length;
+    memcpy(&key_length, data + 1, sizeof key_length);
+    memcpy(&value_length, data + 3, sizeof value_length);
+    key_length = ntohs(key_length);
+    value_length = ntohl(value_length);
+
+    if (data[0] >= N_BATCH_OPS || key_length == 0 || value_length > n - BATCH_REQUEST_HEADER_SIZE - key_length
+        || key_length > n - BATCH_REQUEST_HEADER_SIZE) {
+        return 0;
+    }
+
+    *record = (struct batch_record) {
+        .op = data[0],
+        .key = data + BATCH_REQUEST_HEADER_SIZE,
+        .key_length = key_length,
+        .value = data + BATCH_REQUEST_HEADER_SIZE + key_length,
+        .value_length = value_length,
+    };
+    return BATCH_REQUEST_HEADER_SIZE + key_length + value_length;
+}
+
+
+void batch_encode_record(struct buffer* out, const struct batch_record* record) {
+    char* pos = buffer_append(out, BATCH_REQUEST_HEADER_SIZE + record->key_length + record->value_length);
+    const uint16_t key_length = htons(record->key_length);
+    const uint32_t value_length = htonl(record->value_length);
+
+    pos[0] = record->op;
+    memcpy(pos + 1, &key_length, sizeof key_length);
+    memcpy(pos + 3, &value_length, sizeof value_length);
+    memcpy(pos + BATCH_REQUEST_HEADER_SIZE, record->key, record->key_length);
+    memcpy(pos + BATCH_REQUEST_HEADER_SIZE + record->key_length, record->value, record->value_length);
+}
+
+
+void batch_encode_result(struct buffer* out, uint32_t index, uint16_t status, const char* value, size_t value_length) {
+    char* pos = buffer_append(out, BATCH_RESULT_HEADER_SIZE + value_length);
+    const uint32_t index_n = htonl(index);
+    const uint16_t status_n = htons(status);
+    const uint32_t length_n = htonl(value_length);
+
+    memcpy(pos, &index_n, sizeof index_n);
+    memcpy(pos + 4, &status_n, sizeof status_n);
+    memcpy(pos + 6, &length_n, sizeof length_n);
+    if (value_length > 0) {
+        memcpy(pos + BATCH_RESULT_HEADER_SIZE, value, value_length);
+    }
+}
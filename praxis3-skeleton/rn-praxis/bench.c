@@ -0,0 +1,393 @@
+/**
+* bench.c measures the code paths every request runs through: parsing, the store and the DHT's responsibility checks.
+*
+* Call as:
+*
+*  ./build/bench [filter]
+*
+* Only benchmarks whose name contains `filter` are run. Each result is printed
+* as one JSON object per line, e.g.:
+*
+*  {"benchmark": "parse_request/browser", "iterations": 4194304, "ns_per_op": 151.2, "bytes_per_s": 3.1e+09}
+*
+* `bytes_per_s` is omitted for benchmarks without a meaningful input size.
+*/
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "data.h"
+#include "dht.h"
+#include "http.h"
+#include "util.h"
+
+#define BENCH_MIN_NS 200000000UL
+#define BENCH_RUNS 5
+#define BENCH_STORE_KEYS 100000
+#define BENCH_VALUE_SIZE 64
+#define BENCH_MEMBERS 64
+
+
+/**
+ * A benchmark runs its operation `n` times and returns a value depending on
+ * the results, so the compiler cannot drop the work.
+ */
+struct benchmark {
+    const char* name;
+    size_t (*run)(size_t n);
+    size_t bytes;  // Input size per operation, or zero
+};
+
+static volatile size_t sink;
+
+
+static unsigned long now_ns(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return 1000000000UL * spec.tv_sec + spec.tv_nsec;
+}
+
+
+/*
+ * Parser
+ *
+ * Parsing overwrites separators with null-characters, so each iteration
+ * restores the head from the template first. Bodies are never written to.
+ */
+
+static const char request_minimal[] =
+    "GET /static/foo HTTP/1.1\r\n"
+    "\r\n";
+
+static const char request_curl[] =
+    "GET /static/foo HTTP/1.1\r\n"
+    "Host: 127.0.0.1:4711\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char request_browser[] =
+    "GET /static/bar?session=4f2c9a&lang=en HTTP/1.1\r\n"
+    "Host: 127.0.0.1:4711\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "If-None-Match: \"5d8c72a5edda8d6a:0\"\r\n"
+    "Cookie: session=4f2c9a1be07d; theme=dark; consent=1\r\n"
+    "\r\n";
+
+static const char request_put_head[] =
+    "PUT /dynamic/a1b2c3d4 HTTP/1.1\r\n"
+    "Host: 127.0.0.1:4711\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 1024\r\n"
+    "\r\n";
+
+static char buffer[sizeof request_put_head + 1024];
+
+
+static size_t parse(const char* template, size_t head_length, size_t length, size_t n) {
+    struct request request;
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        memcpy(buffer, template, head_length);
+        result += parse_request(buffer, length, &request);
+    }
+    return result;
+}
+
+static size_t bench_parse_minimal(size_t n) {
+    return parse(request_minimal, sizeof request_minimal - 1, sizeof request_minimal - 1, n);
+}
+
+static size_t bench_parse_curl(size_t n) {
+    return parse(request_curl, sizeof request_curl - 1, sizeof request_curl - 1, n);
+}
+
+static size_t bench_parse_browser(size_t n) {
+    return parse(request_browser, sizeof request_browser - 1, sizeof request_browser - 1, n);
+}
+
+static size_t bench_parse_put(size_t n) {
+    return parse(request_put_head, sizeof request_put_head - 1, sizeof buffer, n);
+}
+
+/**
+ * A request whose head misses its final line separator, as after a short read
+ */
+static size_t bench_parse_incomplete(size_t n) {
+    return parse(request_browser, sizeof request_browser - 1, sizeof request_browser - 3, n);
+}
+
+
+static char haystack[HTTP_MAX_SIZE];
+
+/**
+ * Search the end of a head spanning the whole input buffer
+ */
+static size_t bench_memstr(size_t n) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        result += memstr(haystack, sizeof haystack, "\r\n\r\n") - haystack;
+    }
+    return result;
+}
+
+
+/*
+ * Store and hashing
+ */
+
+static char keys[BENCH_STORE_KEYS][32];
+static char missing_keys[BENCH_STORE_KEYS][32];
+static uint32_t order[BENCH_STORE_KEYS];
+static struct store store = {0};
+static char value[BENCH_VALUE_SIZE];
+
+
+static size_t bench_hash(size_t n) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        result += hash(keys[order[i % BENCH_STORE_KEYS]]);
+    }
+    return result;
+}
+
+static size_t bench_store_get_hit(size_t n) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        size_t length;
+        store_get(&store, keys[order[i % BENCH_STORE_KEYS]], &length);
+        result += length;
+    }
+    return result;
+}
+
+static size_t bench_store_get_miss(size_t n) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        size_t length = 0;
+        result += (size_t) store_get(&store, missing_keys[order[i % BENCH_STORE_KEYS]], &length);
+    }
+    return result;
+}
+
+static size_t bench_store_set(size_t n) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        result += store_set(&store, keys[order[i % BENCH_STORE_KEYS]], value, sizeof value) == STORE_REPLACED;
+    }
+    return result;
+}
+
+static size_t bench_content_length(size_t n) {
+    char out[HTTP_CONTENT_LENGTH_SIZE];
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        result += http_content_length(out, i);
+    }
+    return result;
+}
+
+
+/*
+ * DHT responsibility
+ *
+ * The ring state is fed through the regular message processing, so the
+ * checks see the same tables as in a running peer.
+ */
+
+static dht_id ids[BENCH_STORE_KEYS];
+
+
+static size_t responsible(size_t n) {
+    size_t result = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        result += (size_t) dht_responsible(ids[i % BENCH_STORE_KEYS]);
+    }
+    return result;
+}
+
+/**
+ * IDs owned by ourselves or our successor
+ */
+static size_t bench_responsible_neighbors(size_t n) {
+    dht_init(false, false);
+    predecessor = (struct peer) { .id = 0x0000, .ip.s_addr = INADDR_LOOPBACK, .port = 4710 };
+    self = (struct peer) { .id = 0x8000, .ip.s_addr = INADDR_LOOPBACK, .port = 4711 };
+    successor = (struct peer) { .id = 0xffff, .ip.s_addr = INADDR_LOOPBACK, .port = 4712 };
+    return responsible(n);
+}
+
+/**
+ * IDs beyond our neighborhood, answered from a full lookup cache
+ */
+static size_t bench_responsible_cached(size_t n) {
+    dht_init(false, false);
+    predecessor = (struct peer) { .id = 0x0000, .ip.s_addr = INADDR_LOOPBACK, .port = 4710 };
+    self = (struct peer) { .id = 0x0100, .ip.s_addr = INADDR_LOOPBACK, .port = 4711 };
+    successor = (struct peer) { .id = 0x0200, .ip.s_addr = INADDR_LOOPBACK, .port = 4712 };
+
+    // Split the rest of the ring among as many peers as the cache holds
+    const size_t n_peers = 30;
+    for (size_t i = 0; i < n_peers; i += 1) {
+        struct dht_message reply = {
+            .flags = REPLY,
+            .hash = 0x0200 + i * (0xfe00 / n_peers),
+            .peer = {
+                .id = (i + 1 == n_peers) ? 0xffff : 0x0200 + (i + 1) * (0xfe00 / n_peers),
+                .ip.s_addr = INADDR_LOOPBACK,
+                .port = 5000 + i,
+            },
+        };
+        dht_process_message(&reply);
+    }
+    return responsible(n);
+}
+
+/**
+ * IDs beyond our neighborhood, answered from the one-hop membership
+ */
+static size_t bench_responsible_one_hop(size_t n) {
+    predecessor = (struct peer) { .id = 0x0000, .ip.s_addr = INADDR_LOOPBACK, .port = 4710 };
+    self = (struct peer) { .id = 0x0100, .ip.s_addr = INADDR_LOOPBACK, .port = 4711 };
+    successor = (struct peer) { .id = 0x0200, .ip.s_addr = INADDR_LOOPBACK, .port = 4712 };
+    dht_init(false, true);
+
+    uint8_t packet[DHT_PACKET_HEADER_SIZE + BENCH_MEMBERS * (DHT_RECORD_HEADER_SIZE + DHT_MEMBER_VALUE_SIZE)];
+    uint8_t* pos = packet;
+    *pos++ = DHT_PACKET_MAGIC;
+    *pos++ = DHT_PACKET_VERSION;
+    for (size_t i = 0; i < BENCH_MEMBERS; i += 1) {
+        *pos++ = DHT_RECORD_MEMBER;
+        *pos++ = DHT_MEMBER_VALUE_SIZE;
+        const struct peer member = {
+            .id = htons(0x0200 + i * (0xfe00 / BENCH_MEMBERS)),
+            .ip.s_addr = htonl(INADDR_LOOPBACK),
+            .port = htons(5000 + i),
+        };
+        const uint16_t member_heartbeat = htons(1);
+        memcpy(pos, &member, sizeof member);
+        memcpy(pos + sizeof member, &member_heartbeat, sizeof member_heartbeat);
+        pos += DHT_MEMBER_VALUE_SIZE;
+    }
+    dht_process_packet(packet, pos - packet);
+    return responsible(n);
+}
+
+
+static const struct benchmark benchmarks[] = {
+    { "parse_request/minimal", bench_parse_minimal, sizeof request_minimal - 1 },
+    { "parse_request/curl", bench_parse_curl, sizeof request_curl - 1 },
+    { "parse_request/browser", bench_parse_browser, sizeof request_browser - 1 },
+    { "parse_request/put_1k", bench_parse_put, sizeof buffer },
+    { "parse_request/incomplete", bench_parse_incomplete, sizeof request_browser - 3 },
+    { "memstr/8k", bench_memstr, sizeof haystack },
+    { "http_content_length", bench_content_length, 0 },
+    { "hash", bench_hash, 0 },
+    { "store_get/hit", bench_store_get_hit, 0 },
+    { "store_get/miss", bench_store_get_miss, 0 },
+    { "store_set/overwrite", bench_store_set, BENCH_VALUE_SIZE },
+    { "dht_responsible/neighbors", bench_responsible_neighbors, 0 },
+    { "dht_responsible/cached", bench_responsible_cached, 0 },
+    { "dht_responsible/one_hop", bench_responsible_one_hop, 0 },
+};
+
+
+/**
+ * Prepare inputs shared by several benchmarks
+ */
+static void setup(void) {
+    memset(haystack, 'x', sizeof haystack);
+    memcpy(haystack + sizeof haystack - 4, "\r\n\r\n", 4);
+
+    memcpy(buffer, request_put_head, sizeof request_put_head - 1);
+    memset(buffer + sizeof request_put_head - 1, 'v', sizeof buffer - (sizeof request_put_head - 1));
+    memset(value, 'v', sizeof value);
+
+    // Visit the keys in a fixed pseudo-random order, defeating the prefetcher
+    uint32_t state = 42;
+    for (size_t i = 0; i < BENCH_STORE_KEYS; i += 1) {
+        snprintf(keys[i], sizeof keys[i], "/dynamic/key-%06zu", i);
+        snprintf(missing_keys[i], sizeof missing_keys[i], "/dynamic/missing-%06zu", i);
+        store_set(&store, keys[i], value, sizeof value);
+        order[i] = i;
+    }
+    for (size_t i = BENCH_STORE_KEYS - 1; i > 0; i -= 1) {
+        state = state * 1664525 + 1013904223;
+        const size_t j = state % (i + 1);
+        const uint32_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (size_t i = 0; i < BENCH_STORE_KEYS; i += 1) {
+        ids[i] = hash(keys[order[i]]);
+    }
+
+    clock_tick();  // Lookup cache entries stamped at time zero count as unused
+}
+
+
+/**
+ * Run a benchmark, reporting the fastest of `BENCH_RUNS` runs
+ *
+ * The iteration count is doubled until a run takes a noticeable time, then
+ * scaled so each run takes about `BENCH_MIN_NS`.
+ */
+static void run(const struct benchmark* benchmark) {
+    size_t n = 1;
+    unsigned long elapsed;
+    for (;;) {
+        const unsigned long start = now_ns();
+        sink = benchmark->run(n);
+        elapsed = now_ns() - start;
+        if (elapsed >= BENCH_MIN_NS / 100) {
+            break;
+        }
+        n *= 2;
+    }
+    n = (size_t) ((double) n * BENCH_MIN_NS / elapsed) + 1;
+
+    double best = 0;
+    for (int i = 0; i < BENCH_RUNS; i += 1) {
+        const unsigned long start = now_ns();
+        sink = benchmark->run(n);
+        const double ns_per_op = (double) (now_ns() - start) / n;
+        if (i == 0 || ns_per_op < best) {
+            best = ns_per_op;
+        }
+    }
+
+    printf("{\"benchmark\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f", benchmark->name, n, best);
+    if (benchmark->bytes > 0) {
+        printf(", \"bytes_per_s\": %.4g", benchmark->bytes * 1e9 / best);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [filter]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* filter = (argc == 2) ? argv[1] : "";
+
+    setup();
+    for (size_t i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; i += 1) {
+        if (strstr(benchmarks[i].name, filter)) {
+            run(&benchmarks[i]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,244 @@
+/**
+* bulkload.c loads a stream of records into a ring, sending each peer the records it is responsible for in large batches.
+*
+* Call as:
+*
+*  ./build/bulkload contact.ip contact.port [file]
+*
+* Records are read from `file`, or stdin if omitted, as PUT records in the
+* format of `/_batch` (see `batch.h`), in any order.
+*/
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+#include "client.h"
+
+#define BULKLOAD_BATCH_SIZE (1 << 20)
+#define BULKLOAD_READ_SIZE (4 << 20)
+#define BULKLOAD_MAX_ROUNDS 8
+#define BULKLOAD_MAX_IN_FLIGHT 16
+
+
+/**
+ * Records waiting to be sent to a peer
+ *
+ * While the peer inserts a batch, the next one is gathered in `records`. The
+ * batch sent is kept in `in_flight` until the peer answers, so rejected
+ * records can be routed again.
+ */
+struct partition {
+    struct peer peer;
+    struct buffer records;
+    struct buffer in_flight;
+    bool pending;
+};
+
+
+static struct client client;
+static struct partition partitions[CLIENT_MAX_RANGES];
+static size_t n_partitions = 0;
+
+// Records to route again after the ring changed underneath us
+static struct buffer retry = {0};
+
+static size_t n_in_flight = 0;
+
+static unsigned long loaded = 0;
+static unsigned long batches = 0;
+
+
+/**
+ * Wait for the peer to answer the batch in flight, queueing rejected records for retry
+ */
+static void partition_collect(struct partition* partition) {
+    if (!partition->pending) {
+        return;
+    }
+    partition->pending = false;
+    n_in_flight -= 1;
+
+    struct client_response response;
+    if (client_receive(&client, &partition->peer, &response) == -1 || response.status != 200) {
+        // The peer may have left, route all records again
+        memcpy(buffer_append(&retry, partition->in_flight.length), partition->in_flight.data, partition->in_flight.length);
+        partition->in_flight.length = 0;
+        return;
+    }
+    batches += 1;
+
+    // Rejected records are listed in order, so walk the batch once
+    const char* pos = partition->in_flight.data;
+    const char* end = partition->in_flight.data + partition->in_flight.length;
+    uint32_t index = 0;
+    unsigned long rejected = 0;
+    for (size_t offset = 0; offset + BATCH_RESULT_HEADER_SIZE <= response.body_length; offset += BATCH_RESULT_HEADER_SIZE) {
+        uint32_t rejected_index;
+        memcpy(&rejected_index, response.body + offset, sizeof rejected_index);
+        rejected_index = ntohl(rejected_index);
+
+        struct batch_record record;
+        size_t record_length;
+        while ((record_length = batch_parse_record(pos, end - pos, &record)) > 0 && index < rejected_index) {
+            pos += record_length;
+            index += 1;
+        }
+        if (record_length == 0) {
+            break;
+        }
+        memcpy(buffer_append(&retry, record_length), pos, record_length);
+        rejected += 1;
+    }
+
+    size_t n_records = 0;
+    for (pos = partition->in_flight.data; pos < end; n_records += 1) {
+        struct batch_record record;
+        pos += batch_parse_record(pos, end - pos, &record);
+    }
+    loaded += n_records - rejected;
+    partition->in_flight.length = 0;
+}
+
+
+/**
+ * Send a partition's records to its peer, without waiting for the answer
+ */
+static void partition_flush(struct partition* partition) {
+    partition_collect(partition);
+    if (partition->records.length == 0) {
+        return;
+    }
+
+    // Connections of the client are limited, do not keep too many peers busy
+    if (n_in_flight == BULKLOAD_MAX_IN_FLIGHT) {
+        for (size_t i = 0; i < n_partitions; i += 1) {
+            partition_collect(&partitions[i]);
+        }
+    }
+
+    if (client_send(&client, &partition->peer, "POST", "/_load", partition->records.data, partition->records.length) == -1) {
+        memcpy(buffer_append(&retry, partition->records.length), partition->records.data, partition->records.length);
+        partition->records.length = 0;
+        return;
+    }
+
+    const struct buffer sent = partition->records;
+    partition->records = partition->in_flight;
+    partition->in_flight = sent;
+    partition->pending = true;
+    n_in_flight += 1;
+}
+
+
+/**
+ * Return the partition of the given peer, creating it if necessary
+ */
+static struct partition* partition_get(const struct peer* peer) {
+    for (size_t i = 0; i < n_partitions; i += 1) {
+        if (partitions[i].peer.ip.s_addr == peer->ip.s_addr && partitions[i].peer.port == peer->port) {
+            return &partitions[i];
+        }
+    }
+    partitions[n_partitions].peer = *peer;
+    n_partitions += 1;
+    return &partitions[n_partitions - 1];
+}
+
+
+/**
+ * Partition the records in `data`, flushing partitions that grow large
+ *
+ * Returns the number of bytes consumed; an incomplete record at the end is
+ * left for the next call.
+ */
+static size_t partition_records(const char* data, size_t n) {
+    static char key[UINT16_MAX + 1];
+    const char* pos = data;
+    struct batch_record record;
+    size_t record_length;
+    while ((record_length = batch_parse_record(pos, data + n - pos, &record)) > 0) {
+        memcpy(key, record.key, record.key_length);
+        key[record.key_length] = '\0';
+
+        const struct peer* peer = client_route(&client, hash(key));
+        if (!peer || record.op != BATCH_PUT) {
+            memcpy(buffer_append(&retry, record_length), pos, record_length);
+        } else {
+            struct partition* partition = partition_get(peer);
+            memcpy(buffer_append(&partition->records, record_length), pos, record_length);
+            if (partition->records.length >= BULKLOAD_BATCH_SIZE) {
+                partition_flush(partition);
+            }
+        }
+        pos += record_length;
+    }
+    return pos - data;
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s contact.ip contact.port [file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* input = (argc == 4) ? fopen(argv[3], "rb") : stdin;
+    if (!input) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    if (client_init(&client, argv[1], argv[2]) == -1 || client_discover(&client) == -1) {
+        fprintf(stderr, "Failed to learn the ring from %s:%s\n", argv[1], argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    // Stream the input through the partitions
+    char* chunk = malloc(BULKLOAD_READ_SIZE);
+    size_t kept = 0;
+    size_t n;
+    while ((n = fread(chunk + kept, 1, BULKLOAD_READ_SIZE - kept, input)) > 0) {
+        const size_t available = kept + n;
+        const size_t consumed = partition_records(chunk, available);
+        if (consumed == 0 && available == BULKLOAD_READ_SIZE) {
+            fprintf(stderr, "Malformed input or record larger than %d bytes\n", BULKLOAD_READ_SIZE);
+            return EXIT_FAILURE;
+        }
+        memmove(chunk, chunk + consumed, available - consumed);
+        kept = available - consumed;
+    }
+    if (kept > 0) {
+        fprintf(stderr, "Ignoring %lu trailing bytes of an incomplete record\n", kept);
+    }
+    free(chunk);
+
+    // Send the remainders, then route rejected records again until all are placed
+    for (int round = 0; round < BULKLOAD_MAX_ROUNDS; round += 1) {
+        for (size_t i = 0; i < n_partitions; i += 1) {
+            partition_flush(&partitions[i]);
+        }
+        for (size_t i = 0; i < n_partitions; i += 1) {
+            partition_collect(&partitions[i]);
+        }
+        if (retry.length == 0) {
+            break;
+        }
+
+        client_discover(&client);
+        struct buffer pending = retry;
+        retry = (struct buffer) {0};
+        partition_records(pending.data, pending.length);
+        free(pending.data);
+    }
+
+    unsigned long failed = 0;
+    for (const char* pos = retry.data; pos < retry.data + retry.length; failed += 1) {
+        struct batch_record record;
+        pos += batch_parse_record(pos, retry.data + retry.length - pos, &record);
+    }
+    printf("%lu records loaded in %lu batches, %lu failed\n", loaded, batches, failed);
+
+    client_close(&client);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
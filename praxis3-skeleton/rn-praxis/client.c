@@ -0,0 +1,463 @@
+/**
+* client.c implements a client library that caches the ring's topology and sends each request straight to the responsible peer.
+*/
+
+#include "client.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CLIENT_RETRY_DELAY_US 100000
+
+
+/**
+ * Check whether two peers share the same address
+ */
+static bool same_address(const struct peer* a, const struct peer* b) {
+    return a->ip.s_addr == b->ip.s_addr && a->port == b->port;
+}
+
+
+/**
+ * Check whether `id` lies in (`from`, `to`], analog to the peers' logic
+ */
+static bool in_range(dht_id from, dht_id to, dht_id id) {
+    const dht_id distance_from = from - id;
+    const dht_id distance_to = to - id;
+    return (from == to) || (distance_to < distance_from);
+}
+
+
+int client_connect(const struct peer* peer) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = { .s_addr = htonl(peer->ip.s_addr) },
+        .sin_port = htons(peer->port),
+    };
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*) &addr, sizeof addr) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    const int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+    return sock;
+}
+
+
+bool client_peer_from_url(const string url, struct peer* peer) {
+    const string prefix = "http://";
+    if (strncmp(url, prefix, strlen(prefix)) != 0) {
+        return false;
+    }
+
+    const char* host = url + strlen(prefix);
+    const char* colon = strchr(host, ':');
+    if (!colon || colon - host >= INET_ADDRSTRLEN) {
+        return false;
+    }
+
+    char ip[INET_ADDRSTRLEN] = {0};
+    memcpy(ip, host, colon - host);
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) != 1) {
+        return false;
+    }
+
+    *peer = (struct peer) {
+        .id = 0,
+        .ip = { .s_addr = ntohl(addr.s_addr) },
+        .port = strtoul(colon + 1, NULL, 10),
+    };
+    return peer->port != 0;
+}
+
+
+/**
+ * Return a connected socket for the given peer, reusing an open one if possible
+ */
+static int connection_get(struct client* client, const struct peer* peer) {
+    for (size_t i = 0; i < client->n_connections; i += 1) {
+        if (same_address(&client->connections[i].peer, peer)) {
+            return client->connections[i].sock;
+        }
+    }
+
+    int sock = client_connect(peer);
+    if (sock == -1) {
+        return -1;
+    }
+
+    if (client->n_connections == CLIENT_MAX_CONNECTIONS) {
+        // Evict the oldest connection
+        close(client->connections[0].sock);
+        memmove(&client->connections[0], &client->connections[1],
+                (CLIENT_MAX_CONNECTIONS - 1) * sizeof(struct client_connection));
+        client->n_connections -= 1;
+    }
+    client->connections[client->n_connections] = (struct client_connection) {
+        .peer = *peer,
+        .sock = sock,
+    };
+    client->n_connections += 1;
+    return sock;
+}
+
+
+/**
+ * Close the connection to the given peer, e.g., after an error
+ */
+static void connection_drop(struct client* client, const struct peer* peer) {
+    for (size_t i = 0; i < client->n_connections; i += 1) {
+        if (same_address(&client->connections[i].peer, peer)) {
+            close(client->connections[i].sock);
+            client->connections[i] = client->connections[client->n_connections - 1];
+            client->n_connections -= 1;
+            return;
+        }
+    }
+}
+
+
+static bool send_all(int sock, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(sock, data, n, MSG_NOSIGNAL);
+        if (sent == -1) {
+            return false;
+        }
+        data += sent;
+        n -= sent;
+    }
+    return true;
+}
+
+
+ssize_t client_parse_response(char* buffer, size_t n, struct client_response* response) {
+    char* header_end = memstr(buffer, n, "\r\n\r\n");
+    if (!header_end) {
+        return (n == HTTP_MAX_SIZE) ? -1 : 0;
+    }
+
+    if (n < strlen("HTTP/1.1 200") || strncmp(buffer, "HTTP/1.", strlen("HTTP/1.")) != 0) {
+        return -1;
+    }
+    response->status = strtoul(buffer + strlen("HTTP/1.1 "), NULL, 10);
+    response->body_length = 0;
+    response->location = NULL;
+    response->retry_after = 0;
+
+    // Walk the header lines, terminating the values we are interested in
+    char* line = memstr(buffer, header_end + 2 - buffer, "\r\n") + 2;
+    while (line < header_end + 2) {
+        char* line_end = memstr(line, header_end + 2 - line, "\r\n");
+        char* colon = memchr(line, ':', line_end - line);
+        if (colon) {
+            char* value = colon + 1;
+            while (value < line_end && *value == ' ') {
+                value += 1;
+            }
+
+            if (strncasecmp(line, "Content-Length:", colon + 1 - line) == 0) {
+                response->body_length = strtoul(value, NULL, 10);
+            } else if (strncasecmp(line, "Retry-After:", colon + 1 - line) == 0) {
+                response->retry_after = strtoul(value, NULL, 10);
+            } else if (strncasecmp(line, "Location:", colon + 1 - line) == 0) {
+                *line_end = '\0';
+                response->location = value;
+            }
+        }
+        line = line_end + 2;
+    }
+
+    char* body = header_end + 4;
+    if (body + response->body_length > buffer + n) {
+        return 0;
+    }
+    response->body = body;
+    return (body + response->body_length) - buffer;
+}
+
+
+/**
+ * Send a request on the connection to the given peer, returning its socket or -1
+ */
+static int send_request(struct client* client, const struct peer* peer, const string method, const string uri,
+                        const char* payload, size_t payload_length) {
+    char head[HTTP_MAX_SIZE];
+    int head_length = snprintf(head, sizeof head, "%s %s HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+                               method, uri, payload_length);
+    if (head_length < 0 || (size_t) head_length >= sizeof head) {
+        return -1;
+    }
+
+    int sock = connection_get(client, peer);
+    if (sock == -1) {
+        return -1;
+    }
+    if (!send_all(sock, head, head_length) || (payload_length > 0 && !send_all(sock, payload, payload_length))) {
+        connection_drop(client, peer);
+        return -1;
+    }
+    return sock;
+}
+
+
+/**
+ * Receive a response into the client's buffer
+ *
+ * Returns whether a complete response was received. `received` is set to the
+ * number of bytes received, even on failure.
+ */
+static bool receive_response(struct client* client, int sock, struct client_response* response, size_t* received) {
+    *received = 0;
+    ssize_t parsed = 0;
+    while ((parsed = client_parse_response(client->buffer, *received, response)) == 0) {
+        if (*received == client->buffer_size) {
+            client->buffer_size *= 2;
+            client->buffer = realloc(client->buffer, client->buffer_size);
+        }
+        ssize_t n = recv(sock, client->buffer + *received, client->buffer_size - *received, 0);
+        if (n <= 0) {
+            break;
+        }
+        *received += n;
+    }
+
+    if (parsed > 0) {
+        client->requests += 1;
+        return true;
+    }
+    return false;
+}
+
+
+int client_exchange(struct client* client, const struct peer* peer, const string method, const string uri,
+                    const char* payload, size_t payload_length, struct client_response* response) {
+    for (int attempt = 0; attempt < 2; attempt += 1) {
+        int sock = send_request(client, peer, method, uri, payload, payload_length);
+        if (sock == -1) {
+            continue;
+        }
+
+        size_t received;
+        if (receive_response(client, sock, response, &received)) {
+            return 0;
+        }
+        connection_drop(client, peer);
+        if (received > 0) {
+            return -1;  // Broken response, retrying would not help
+        }
+    }
+    return -1;
+}
+
+
+int client_send(struct client* client, const struct peer* peer, const string method, const string uri,
+                const char* payload, size_t payload_length) {
+    return (send_request(client, peer, method, uri, payload, payload_length) == -1) ? -1 : 0;
+}
+
+
+int client_receive(struct client* client, const struct peer* peer, struct client_response* response) {
+    for (size_t i = 0; i < client->n_connections; i += 1) {
+        if (same_address(&client->connections[i].peer, peer)) {
+            size_t received;
+            if (receive_response(client, client->connections[i].sock, response, &received)) {
+                return 0;
+            }
+            connection_drop(client, peer);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Insert or replace the range of the given peer, keeping them sorted by ID
+ */
+static void range_update(struct client* client, dht_id from, const struct peer* peer) {
+    size_t i = 0;
+    while (i < client->n_ranges && client->ranges[i].peer.id < peer->id) {
+        i += 1;
+    }
+
+    if (i < client->n_ranges && client->ranges[i].peer.id == peer->id) {
+        client->ranges[i] = (struct client_range) { .from = from, .peer = *peer };
+        return;
+    }
+    if (client->n_ranges == CLIENT_MAX_RANGES) {
+        return;
+    }
+
+    memmove(&client->ranges[i + 1], &client->ranges[i], (client->n_ranges - i) * sizeof(struct client_range));
+    client->ranges[i] = (struct client_range) { .from = from, .peer = *peer };
+    client->n_ranges += 1;
+}
+
+
+int client_refresh(struct client* client, const struct peer* peer) {
+    struct client_response response;
+    if (client_exchange(client, peer, "GET", "/_ring", NULL, 0, &response) == -1 || response.status != 200) {
+        return -1;
+    }
+
+    const uint8_t* view = (uint8_t*) response.body;
+    if (response.body_length < RING_HEADER_SIZE || memcmp(view, RING_MAGIC, 4) != 0 || view[4] != RING_VERSION) {
+        return -1;
+    }
+
+    uint16_t count;
+    memcpy(&count, view + 6, sizeof count);
+    count = ntohs(count);
+    if (RING_HEADER_SIZE + count * sizeof(struct dht_message) > response.body_length) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i += 1) {
+        struct dht_message entry;
+        memcpy(&entry, view + RING_HEADER_SIZE + i * sizeof(struct dht_message), sizeof entry);
+        entry.peer.id = ntohs(entry.peer.id);
+        entry.peer.ip.s_addr = ntohl(entry.peer.ip.s_addr);
+        entry.peer.port = ntohs(entry.peer.port);
+        range_update(client, ntohs(entry.hash), &entry.peer);
+    }
+
+    client->refreshes += 1;
+    return 0;
+}
+
+
+int client_discover(struct client* client) {
+    if (client->n_ranges == 0 && client_refresh(client, &client->contact) == -1) {
+        return -1;
+    }
+
+    // Each view reveals the successor of the peer, so walk the ring until all
+    // peers have been asked. Ranges are kept sorted, so start over after each
+    // refresh and track the peers asked by ID.
+    static bool asked[1 << 16];
+    memset(asked, 0, sizeof asked);
+    size_t i = 0;
+    while (i < client->n_ranges) {
+        const struct peer peer = client->ranges[i].peer;
+        if (asked[peer.id]) {
+            i += 1;
+            continue;
+        }
+        asked[peer.id] = true;
+        client_refresh(client, &peer);
+        i = 0;
+    }
+
+    // The ring is complete if each range starts where the previous one ends
+    for (size_t j = 0; j < client->n_ranges; j += 1) {
+        const struct client_range* previous = &client->ranges[(j + client->n_ranges - 1) % client->n_ranges];
+        if (client->ranges[j].from != previous->peer.id) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+const struct peer* client_route(const struct client* client, dht_id id) {
+    if (client->n_ranges == 0) {
+        return NULL;
+    }
+
+    // The responsible peer is the first one with an ID not below the requested one
+    size_t low = 0;
+    size_t high = client->n_ranges;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (client->ranges[mid].peer.id < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    const struct client_range* range = &client->ranges[low % client->n_ranges];
+
+    return in_range(range->from, range->peer.id, id) ? &range->peer : NULL;
+}
+
+
+int client_init(struct client* client, const string host, const string port) {
+    memset(client, 0, sizeof(struct client));
+
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo* result_info;
+    if (getaddrinfo(host, port, &hints, &result_info)) {
+        return -1;
+    }
+    const struct sockaddr_in* addr = (struct sockaddr_in*) result_info->ai_addr;
+    client->contact = (struct peer) {
+        .id = 0,
+        .ip = { .s_addr = ntohl(addr->sin_addr.s_addr) },
+        .port = ntohs(addr->sin_port),
+    };
+    freeaddrinfo(result_info);
+
+    client->buffer_size = HTTP_MAX_SIZE;
+    client->buffer = malloc(client->buffer_size);
+
+    client_refresh(client, &client->contact);
+    return 0;
+}
+
+
+void client_close(struct client* client) {
+    for (size_t i = 0; i < client->n_connections; i += 1) {
+        close(client->connections[i].sock);
+    }
+    client->n_connections = 0;
+    free(client->buffer);
+    client->buffer = NULL;
+}
+
+
+int client_request(struct client* client, const string method, const string uri,
+                   const char* payload, size_t payload_length, struct client_response* response) {
+    const struct peer* routed = client_route(client, hash(uri));
+    struct peer target = routed ? *routed : client->contact;
+
+    for (int attempt = 0; attempt < CLIENT_MAX_ATTEMPTS; attempt += 1) {
+        if (client_exchange(client, &target, method, uri, payload, payload_length, response) == -1) {
+            if (!same_address(&target, &client->contact)) {
+                target = client->contact;  // Cached peer may be gone, start over
+                continue;
+            }
+            return -1;
+        }
+
+        if (response->status == 303 && response->location) {
+            client->redirects += 1;
+            if (!client_peer_from_url(response->location, &target)) {
+                return -1;
+            }
+            client_refresh(client, &target);
+        } else if (response->status == 503) {
+            usleep(CLIENT_RETRY_DELAY_US);  // Peer is looking up the responsible one
+        } else {
+            return 0;
+        }
+    }
+    return -1;
+}
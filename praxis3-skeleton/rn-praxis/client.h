@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "dht.h"
+#include "util.h"
+
+#define CLIENT_MAX_RANGES 512
+#define CLIENT_MAX_CONNECTIONS 64
+#define CLIENT_MAX_ATTEMPTS 8
+
+
+/**
+ * A peer's responsibility as learned from a ring view
+ *
+ * `peer` is responsible for the IDs in (`from`, `peer.id`].
+ */
+struct client_range {
+    dht_id from;
+    struct peer peer;
+};
+
+
+/**
+ * A keep-alive connection to a peer, identified by its address only
+ */
+struct client_connection {
+    struct peer peer;
+    int sock;
+};
+
+
+/**
+ * The response to a request
+ *
+ * `body` points into memory owned by the client and stays valid until the
+ * next request. `location` is only set on redirects and points into the same
+ * memory.
+ */
+struct client_response {
+    int status;
+    char* body;
+    size_t body_length;
+    string location;
+    unsigned int retry_after;
+};
+
+
+/**
+ * State of a ring-aware client
+ *
+ * Ranges learned from the peers' `/_ring` views are kept sorted by peer ID,
+ * so requests can be sent straight to the responsible peer. Requests for IDs
+ * no range covers go to `contact`. Each redirect refreshes the ranges from
+ * the peer we are redirected to.
+ */
+struct client {
+    struct peer contact;
+    struct client_range ranges[CLIENT_MAX_RANGES];
+    size_t n_ranges;
+    struct client_connection connections[CLIENT_MAX_CONNECTIONS];
+    size_t n_connections;
+    char* buffer;
+    size_t buffer_size;
+
+    unsigned long requests;
+    unsigned long redirects;
+    unsigned long refreshes;
+};
+
+
+/**
+ * Set up a client that initially contacts the given peer
+ *
+ * Returns 0 on success, or -1 if the address cannot be resolved. The initial
+ * topology is fetched from the contact, failing to do so is not an error.
+ */
+int client_init(struct client* client, const string host, const string port);
+
+/**
+ * Close all connections and release the client's memory
+ */
+void client_close(struct client* client);
+
+/**
+ * Fetch the given peer's ring view and merge it into the cached topology
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int client_refresh(struct client* client, const struct peer* peer);
+
+/**
+ * Learn the whole ring by fetching the view of every peer once
+ *
+ * Returns 0 if the cached ranges cover the whole ring afterwards, -1
+ * otherwise. Meant for tools talking to all peers, such as bulk loaders.
+ */
+int client_discover(struct client* client);
+
+/**
+ * Return the peer responsible for the ID according to the cached topology, or
+ * NULL if no cached range covers it.
+ */
+const struct peer* client_route(const struct client* client, dht_id id);
+
+/**
+ * Send a request for the given URI to the responsible peer
+ *
+ * Redirects are followed and unavailable peers retried, up to
+ * `CLIENT_MAX_ATTEMPTS` attempts in total. `payload` may be NULL for
+ * requests without body. Returns 0 if a final response was received, which
+ * is stored in `response`, and -1 otherwise.
+ */
+int client_request(struct client* client, const string method, const string uri,
+                   const char* payload, size_t payload_length, struct client_response* response);
+
+/**
+ * Send a single request to the given peer and receive its response
+ *
+ * Unlike `client_request()`, redirects are not followed. A failing
+ * keep-alive connection is reopened once, as peers may close idle
+ * connections at any time. Returns 0 if a response was received, -1
+ * otherwise.
+ */
+int client_exchange(struct client* client, const struct peer* peer, const string method, const string uri,
+                    const char* payload, size_t payload_length, struct client_response* response);
+
+/**
+ * Send a request to the given peer without waiting for the response
+ *
+ * Allows keeping requests to several peers in flight at once. The response
+ * must be collected with `client_receive()` before the next request to the
+ * same peer. Returns 0 on success, -1 otherwise.
+ */
+int client_send(struct client* client, const struct peer* peer, const string method, const string uri,
+                const char* payload, size_t payload_length);
+
+/**
+ * Receive the response to the request last sent to the given peer
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int client_receive(struct client* client, const struct peer* peer, struct client_response* response);
+
+/**
+ * Parse an HTTP response
+ *
+ * Analog to `parse_request()`: returns the number of bytes the response
+ * occupies in `buffer` once it is complete, zero while it is incomplete, and
+ * -1 if it is malformed. The response reuses `buffer`'s memory.
+ */
+ssize_t client_parse_response(char* buffer, size_t n, struct client_response* response);
+
+/**
+ * Open a blocking TCP connection to the given peer, or return -1
+ */
+int client_connect(const struct peer* peer);
+
+/**
+ * Parse the peer from an `http://ip:port/...` URL
+ */
+bool client_peer_from_url(const string url, struct peer* peer);
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""Benchmark a ring of webservers on loopback
+
+Starts an N-node ring, waits until every peer's view of its neighborhood
+agrees with the ring, then runs one `loadgen` per peer, each using its peer
+as contact, all at the same time. Their histograms are merged, so the
+reported latencies are those of the whole ring.
+
+    ./cluster_bench.py --nodes 8 --duration 10 -- -d 4 -z 0.99
+
+Arguments after `--` are passed on to every `loadgen`.
+"""
+
+import argparse
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+import urllib.request
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), 'test'))
+import dht  # noqa: E402
+
+
+# Must match `histogram.h`
+HISTOGRAM_SUB_BUCKET_BITS = 6
+HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS
+
+PERCENTILES = (50, 90, 99, 99.9, 99.99)
+
+
+def slot_highest(slot):
+    """Return the highest value counted in a histogram slot, see `histogram.c`"""
+    if slot < 2 * HISTOGRAM_SUB_BUCKETS:
+        return slot
+    shift = (slot >> HISTOGRAM_SUB_BUCKET_BITS) - 1
+    sub = slot - (shift << HISTOGRAM_SUB_BUCKET_BITS)
+    return ((sub + 1) << shift) - 1
+
+
+def percentile(counts, maximum, p):
+    """Return the value at percentile `p` of merged histogram slots, in microseconds"""
+    total = sum(counts.values())
+    if total == 0:
+        return 0.
+    rank = max(1, int(p / 100 * total + .5))
+    seen = 0
+    for slot in sorted(counts):
+        seen += counts[slot]
+        if seen >= rank:
+            return min(slot_highest(slot) / 1e3, maximum)
+    return maximum
+
+
+def start_ring(args, peers):
+    """Start a webserver per peer, either with static neighbors or by joining"""
+    env = dict(os.environ)
+    if args.no_stabilize:
+        env['NO_STABILIZE'] = '1'
+    if args.one_hop:
+        env['ONE_HOP'] = '1'
+
+    processes = []
+    for i, peer in enumerate(peers):
+        peer_env = dict(env)
+        command = [args.executable, peer.ip, str(peer.port), str(peer.id)]
+        if args.join and i > 0:
+            command += [peers[0].ip, str(peers[0].port)]
+        elif not args.join:
+            pred = peers[i - 1]
+            succ = peers[(i + 1) % len(peers)]
+            peer_env.update({
+                'PRED_ID': str(pred.id), 'PRED_IP': pred.ip, 'PRED_PORT': str(pred.port),
+                'SUCC_ID': str(succ.id), 'SUCC_IP': succ.ip, 'SUCC_PORT': str(succ.port),
+            })
+        processes.append(subprocess.Popen(command, env=peer_env, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+        if args.join:
+            time.sleep(.05)  # Let the ring absorb the joins one after the other
+    return processes
+
+
+def converged(peers):
+    """Check whether every peer knows its actual successor"""
+    for i, peer in enumerate(peers):
+        try:
+            with urllib.request.urlopen(f'http://{peer.ip}:{peer.port}/_ring', timeout=1) as response:
+                entries = dht.deserialize_ring(response.read())
+        except OSError:
+            return False
+        successors = [e.peer for e in entries if e.role == dht.RingRole.successor]
+        if successors != [peers[(i + 1) % len(peers)]]:
+            return False
+    return True
+
+
+def run_load(args, peers, loadgen_args):
+    """Run a load generator per peer in parallel and return their results"""
+    command = [args.loadgen, '-j', '-t', str(args.duration), *loadgen_args]
+    processes = [
+        subprocess.Popen([*command, peer.ip, str(peer.port)], stdout=subprocess.PIPE, text=True)
+        for peer in peers
+    ]
+    results = []
+    for process in processes:
+        output, _ = process.communicate()
+        if process.returncode != 0:
+            raise RuntimeError(f'loadgen failed with status {process.returncode}')
+        results.append(json.loads(output))
+    return results
+
+
+def aggregate(results):
+    """Merge the results of several load generators"""
+    duration = max(r['duration_s'] for r in results)
+    summary = {
+        'requests': sum(r['requests'] for r in results),
+        'errors': sum(r['errors'] for r in results),
+        'duration_s': duration,
+    }
+    summary['throughput'] = sum(r['throughput'] for r in results)
+
+    hops = [sum(h) for h in zip(*(r['hops'] for r in results))]
+    answered = sum(hops)
+    summary['hops'] = hops
+    summary['mean_hops'] = sum(i * n for i, n in enumerate(hops)) / answered if answered else 0.
+    summary['redirect_ratio'] = sum(hops[1:]) / answered if answered else 0.
+
+    for name in ('latency', 'service_time'):
+        counts = {}
+        for r in results:
+            for slot, count in r[name]['histogram']:
+                counts[slot] = counts.get(slot, 0) + count
+        maximum = max(r[name]['p100_us'] for r in results)
+        summary[name] = {f'p{p:g}_us': percentile(counts, maximum, p) for p in PERCENTILES}
+        summary[name]['max_us'] = maximum
+    return summary
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--nodes', '-n', type=int, default=4)
+    parser.add_argument('--base-port', type=int, default=5000)
+    parser.add_argument('--executable', default='build/webserver')
+    parser.add_argument('--loadgen', default='build/loadgen')
+    parser.add_argument('--duration', '-t', type=float, default=10)
+    parser.add_argument('--join', action='store_true', help='build the ring by joining instead of static neighbors')
+    parser.add_argument('--one-hop', action='store_true', help='gossip the full membership (ONE_HOP)')
+    parser.add_argument('--no-stabilize', action='store_true', help='disable stabilization (NO_STABILIZE)')
+    parser.add_argument('--convergence-timeout', type=float, default=30)
+    parser.add_argument('--seed', type=int, default=None, help='draw random IDs instead of spacing them evenly')
+    parser.add_argument('--json', action='store_true', help='print the summary as JSON')
+    parser.add_argument('loadgen_args', nargs='*', help='arguments passed on to loadgen')
+    args = parser.parse_args()
+
+    if args.seed is None:
+        ids = [(i * 0x10000) // args.nodes for i in range(args.nodes)]
+    else:
+        ids = sorted(random.Random(args.seed).sample(range(0x10000), args.nodes))
+    peers = [dht.Peer(id_, '127.0.0.1', args.base_port + i) for i, id_ in enumerate(ids)]
+
+    processes = start_ring(args, peers)
+    try:
+        started = time.monotonic()
+        while not converged(peers):
+            if time.monotonic() - started > args.convergence_timeout:
+                raise RuntimeError('Ring did not converge')
+            time.sleep(.1)
+        convergence = time.monotonic() - started
+
+        summary = aggregate(run_load(args, peers, args.loadgen_args))
+        summary['nodes'] = args.nodes
+        summary['convergence_s'] = convergence
+    finally:
+        for process in processes:
+            process.kill()
+            process.wait()
+
+    if args.json:
+        print(json.dumps(summary))
+        return
+
+    print(f"{summary['nodes']} nodes, converged after {summary['convergence_s']:.2f} s")
+    print(f"{summary['requests']} requests in {summary['duration_s']:.2f} s, "
+          f"{summary['throughput']:.1f} requests/s, {summary['errors']} errors")
+    print(f"Redirected {100 * summary['redirect_ratio']:.2f}% of requests, "
+          f"{summary['mean_hops']:.3f} hops on average, by hops: {summary['hops']}")
+    for name in ('latency', 'service_time'):
+        values = '  '.join(f'{key[:-3]} {value:9.1f}' for key, value in summary[name].items())
+        print(f'{name:<14} {values}  (us)')
+
+
+if __name__ == '__main__':
+    main()
@@ -1,67 +1,429 @@
 #include "data.h"
 
 #include <string.h>
+#include <sys/mman.h>
 
+#include "probes.h"
 
-struct tuple* find(string key, struct tuple* tuples, size_t n_tuples) {
-    for (size_t i = 0; i < n_tuples; i += 1) {
-        // compare keys with 'strcmp'
-        if (tuples[i].key && strcmp(key, tuples[i].key) == 0) {
-            return &(tuples[i]);
+#define STORE_MIN_CAPACITY 64
+
+
+/**
+ * FNV-1a, cheap and good enough for keys that are mostly URIs
+ */
+static uint32_t key_hash(const char* key, size_t key_length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key_length; i += 1) {
+        hash = (hash ^ (uint8_t) key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * Return the slot holding the key, or the free slot it would be inserted at
+ */
+static struct entry* find(const struct store* store, const char* key, size_t key_length, uint32_t hash) {
+    const size_t mask = store->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct entry* entry = &store->entries[i];
+        if (!entry->key || (entry->hash == hash && entry->key_length == key_length
+                            && memcmp(entry->key, key, key_length) == 0)) {
+            return entry;
         }
     }
-    return NULL;
 }
 
 
-const char* get(const string key, struct tuple* tuples, size_t n_tuples, size_t* value_length) {
-    struct tuple* tuple = find(key, tuples, n_tuples);
-    if (tuple) {
-        *value_length = tuple->value_length;
-        return tuple->value;
+/**
+ * Drop a reference to a block, freeing it with the last one
+ */
+static void block_unref(struct store_block* block) {
+    if (--block->refs == 0) {
+        if (block->mapping) {
+            munmap(block->mapping, block->mapping_length);
+        }
+        free(block);
+    }
+}
+
+
+/**
+ * Return what an entry is charged against the budget in cache mode
+ *
+ * The table holds between 4/3 and 8/3 slots per entry, see `reserve()`.
+ */
+static size_t cost(size_t key_length, size_t value_length) {
+    return key_length + value_length + 2 * sizeof(struct entry);
+}
+
+
+/**
+ * Make the entry in `slot` the most recently used of its segment
+ */
+static void link_front(struct store* store, uint32_t slot) {
+    struct entry* entry = &store->entries[slot];
+    struct store_list* list = &store->cache.lists[entry->segment];
+    entry->prev = STORE_NIL;
+    entry->next = list->head;
+    if (list->head != STORE_NIL) {
+        store->entries[list->head].prev = slot;
     } else {
-        return NULL;
+        list->tail = slot;
     }
+    list->head = slot;
+    list->bytes += cost(entry->key_length, entry->value_length);
 }
 
 
-bool set(const string key, char* value, size_t value_length, struct tuple* tuples, size_t n_tuples) {
-    // check if tuple already exists
-    struct tuple* tuple = find(key, tuples, n_tuples);
+/**
+ * Remove the entry in `slot` from its segment
+ */
+static void unlink_entry(struct store* store, uint32_t slot) {
+    struct entry* entry = &store->entries[slot];
+    struct store_list* list = &store->cache.lists[entry->segment];
+    if (entry->prev != STORE_NIL) {
+        store->entries[entry->prev].next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next != STORE_NIL) {
+        store->entries[entry->next].prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    list->bytes -= cost(entry->key_length, entry->value_length);
+}
+
+
+/**
+ * Point the neighbors of an entry moved into `slot` at it
+ */
+static void relink(struct store* store, uint32_t slot) {
+    const struct entry* entry = &store->entries[slot];
+    struct store_list* list = &store->cache.lists[entry->segment];
+    if (entry->prev != STORE_NIL) {
+        store->entries[entry->prev].next = slot;
+    } else {
+        list->head = slot;
+    }
+    if (entry->next != STORE_NIL) {
+        store->entries[entry->next].prev = slot;
+    } else {
+        list->tail = slot;
+    }
+}
+
 
-    if (tuple) {  // overwrite existing value
-        free(tuple->value);
-        tuple->value = (char*) malloc(value_length * sizeof(char));
-        strcpy(tuple->value, value);
-        tuple->value_length = value_length;
-        return true;
-    } else {  // add tuple
-        for (size_t i = 0; i < n_tuples; i += 1) {
-            if (tuples[i].key == NULL) {
-                tuples[i].key = (char*) malloc((strlen(key) + 1) * sizeof(char));
-                strcpy(tuples[i].key, key);
-                tuples[i].value = (char*) malloc(value_length * sizeof(char));
-                memcpy(tuples[i].value, value, value_length);
-                tuples[i].value_length = value_length;
-                return false;
+/**
+ * Demote the least recently used protected entries while that segment is over its share
+ */
+static void rebalance(struct store* store) {
+    struct store_cache* cache = &store->cache;
+    const size_t limit = cache->budget / 100 * STORE_PROTECTED_PERCENT;
+    while (cache->lists[STORE_PROTECTED].bytes > limit) {
+        const uint32_t slot = cache->lists[STORE_PROTECTED].tail;
+        unlink_entry(store, slot);
+        store->entries[slot].segment = STORE_PROBATION;
+        link_front(store, slot);
+        cache->demotions += 1;
+    }
+}
+
+
+/**
+ * Mark the entry in `slot` as used, promoting it on its second use
+ */
+static void touch(struct store* store, uint32_t slot) {
+    struct entry* entry = &store->entries[slot];
+    if (entry->segment == STORE_PROTECTED && store->cache.lists[STORE_PROTECTED].head == slot) {
+        return;
+    }
+    unlink_entry(store, slot);
+    if (entry->segment == STORE_PROBATION) {
+        entry->segment = STORE_PROTECTED;
+        store->cache.promotions += 1;
+    }
+    link_front(store, slot);
+    rebalance(store);
+}
+
+
+/**
+ * Release the memory of an entry
+ */
+static void release(struct store* store, struct entry* entry) {
+    store->bytes -= entry->key_length + entry->value_length;
+    if (!entry->block) {
+        free((char*) entry->key);
+    } else {
+        block_unref(entry->block);
+    }
+}
+
+
+/**
+ * Rehash all entries into a table of the given capacity
+ */
+static void resize(struct store* store, size_t capacity) {
+    struct entry* old = store->entries;
+    const size_t old_capacity = store->capacity;
+
+    store->entries = calloc(capacity, sizeof(struct entry));
+    store->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i += 1) {
+        if (old[i].key) {
+            struct entry* entry = find(store, old[i].key, old[i].key_length, old[i].hash);
+            *entry = old[i];
+            // The old slot is no longer needed, remember where its entry went
+            old[i].hash = entry - store->entries;
+        }
+    }
+
+    if (store->cache.budget) {
+        for (size_t i = 0; i < capacity; i += 1) {
+            struct entry* entry = &store->entries[i];
+            if (entry->key) {
+                entry->prev = entry->prev == STORE_NIL ? STORE_NIL : old[entry->prev].hash;
+                entry->next = entry->next == STORE_NIL ? STORE_NIL : old[entry->next].hash;
             }
         }
+        for (size_t segment = 0; segment < N_STORE_SEGMENTS; segment += 1) {
+            struct store_list* list = &store->cache.lists[segment];
+            if (list->head != STORE_NIL) {
+                list->head = old[list->head].hash;
+                list->tail = old[list->tail].hash;
+            }
+        }
+    }
+    free(old);
+}
+
+
+/**
+ * Make room for `n` more entries, keeping the load factor below 3/4
+ */
+static void reserve(struct store* store, size_t n) {
+    size_t capacity = store->capacity ? store->capacity : STORE_MIN_CAPACITY;
+    while ((store->size + n) * 4 >= capacity * 3) {
+        capacity *= 2;
+    }
+    if (capacity != store->capacity) {
+        resize(store, capacity);
     }
-    return false;  // fail silently if no space for a new tuple is available 
 }
 
 
-bool delete(const string key, struct tuple* tuples, size_t n_tuples) {
-    struct tuple* tuple = find(key, tuples, n_tuples);
+/**
+ * Remove an entry from the table
+ */
+static void remove_entry(struct store* store, struct entry* entry) {
+    const bool cached = store->cache.budget != 0;
+    size_t gap = entry - store->entries;
+    if (cached) {
+        unlink_entry(store, gap);
+    }
+    release(store, entry);
+    store->size -= 1;
 
-    if (tuple) {
-        free(tuple->key);
-        tuple->key = NULL;
-        free(tuple->value);
-        tuple->value = NULL;
-        tuple->value_length = 0;
-        return true;
+    // Shift back following entries that would no longer be found past the gap
+    const size_t mask = store->capacity - 1;
+    for (size_t i = (gap + 1) & mask; store->entries[i].key; i = (i + 1) & mask) {
+        const size_t home = store->entries[i].hash & mask;
+        if (((i - home) & mask) >= ((i - gap) & mask)) {
+            store->entries[gap] = store->entries[i];
+            if (cached) {
+                relink(store, gap);
+            }
+            gap = i;
+        }
+    }
+    store->entries[gap].key = NULL;
+}
+
+
+/**
+ * Evict least recently used entries until the store is within its budget
+ *
+ * Probation is evicted first, but not its last entry while protected ones
+ * remain, which is usually the one just inserted.
+ */
+static void evict(struct store* store) {
+    struct store_cache* cache = &store->cache;
+    while (cache->lists[STORE_PROBATION].bytes + cache->lists[STORE_PROTECTED].bytes > cache->budget) {
+        const struct store_list* probation = &cache->lists[STORE_PROBATION];
+        const enum store_segment segment = (probation->head != probation->tail
+                                            || cache->lists[STORE_PROTECTED].head == STORE_NIL)
+                                           ? STORE_PROBATION : STORE_PROTECTED;
+        struct entry* entry = &store->entries[cache->lists[segment].tail];
+        cache->evictions[segment] += 1;
+        cache->evicted_bytes += entry->key_length + entry->value_length;
+        PROBE3(store__evict, entry->key_length, entry->value_length, segment);
+        remove_entry(store, entry);
+    }
+}
+
+
+/**
+ * Insert an entry, or overwrite the one with its key
+ *
+ * Room for it must have been reserved. An overwritten entry keeps its segment.
+ * Returns true if an entry was overwritten.
+ */
+static bool insert(struct store* store, const struct entry* new) {
+    struct entry* entry = find(store, new->key, new->key_length, new->hash);
+    const bool existed = entry->key != NULL;
+    const bool cached = store->cache.budget != 0;
+
+    uint8_t segment = STORE_PROBATION;
+    if (existed) {
+        if (cached) {
+            segment = entry->segment;
+            unlink_entry(store, entry - store->entries);
+        }
+        release(store, entry);
     } else {
+        store->size += 1;
+    }
+    *entry = *new;
+    store->bytes += new->key_length + new->value_length;
+
+    if (cached) {
+        entry->segment = segment;
+        link_front(store, entry - store->entries);
+        rebalance(store);
+        evict(store);
+    }
+    return existed;
+}
+
+
+/**
+ * Remove the key in place of a loaded value exceeding the budget
+ */
+static void reject(struct store* store, const char* key, size_t key_length, uint32_t hash) {
+    store->cache.rejections += 1;
+    if (store->size == 0) {
+        return;
+    }
+    struct entry* entry = find(store, key, key_length, hash);
+    if (entry->key) {
+        remove_entry(store, entry);
+    }
+}
+
+
+void store_set_budget(struct store* store, size_t budget) {
+    store->cache = (struct store_cache) { .budget = budget };
+    for (size_t segment = 0; segment < N_STORE_SEGMENTS; segment += 1) {
+        store->cache.lists[segment] = (struct store_list) { .head = STORE_NIL, .tail = STORE_NIL };
+    }
+}
+
+
+const char* store_get(struct store* store, const string key, size_t* value_length) {
+    if (store->size == 0) {
+        store->misses += 1;
+        return NULL;
+    }
+
+    const size_t key_length = strlen(key);
+    struct entry* entry = find(store, key, key_length, key_hash(key, key_length));
+    PROBE3(store__get, key, entry->key != NULL, entry->value_length);
+    if (!entry->key) {
+        store->misses += 1;
+        return NULL;
+    }
+    store->hits += 1;
+    if (store->cache.budget) {
+        touch(store, entry - store->entries);
+    }
+    *value_length = entry->value_length;
+    return entry->value;
+}
+
+
+enum store_result store_set(struct store* store, const string key, const char* value, size_t value_length) {
+    const size_t key_length = strlen(key);
+    if (key_length > STORE_MAX_KEY_LENGTH) {
+        return STORE_REJECTED;  // Could never be found again, see `struct entry`
+    }
+    if (store->cache.budget && cost(key_length, value_length) > store->cache.budget) {
+        store->cache.rejections += 1;
+        return STORE_REJECTED;
+    }
+    const uint32_t hash = key_hash(key, key_length);
+    reserve(store, 1);
+
+    char* memory = malloc(key_length + value_length);
+    memcpy(memory, key, key_length);
+    memcpy(memory + key_length, value, value_length);
+    const bool existed = insert(store, &(struct entry) {
+        .key = memory,
+        .value = memory + key_length,
+        .value_length = value_length,
+        .hash = hash,
+        .key_length = key_length,
+        .block = NULL,
+    });
+    PROBE3(store__set, key, value_length, existed);
+    return existed ? STORE_REPLACED : STORE_CREATED;
+}
+
+
+bool store_delete(struct store* store, const string key) {
+    if (store->size == 0) {
+        return false;
+    }
+
+    const size_t key_length = strlen(key);
+    struct entry* entry = find(store, key, key_length, key_hash(key, key_length));
+    PROBE2(store__delete, key, entry->key != NULL);
+    if (!entry->key) {
         return false;
     }
+    remove_entry(store, entry);
+    return true;
+}
+
+
+void store_load(struct store* store, struct store_block* block, const struct store_record* records, size_t n_records) {
+    reserve(store, n_records);
+    block->refs = 1;  // Held until all records are inserted
+
+    for (size_t i = 0; i < n_records; i += 1) {
+        const struct store_record* record = &records[i];
+        const uint32_t hash = key_hash(record->key, record->key_length);
+        if (store->cache.budget && cost(record->key_length, record->value_length) > store->cache.budget) {
+            reject(store, record->key, record->key_length, hash);
+            continue;
+        }
+
+        // Taken first, evicting the new entry must not free the block yet
+        block->refs += 1;
+        insert(store, &(struct entry) {
+            .key = record->key,
+            .value = record->value,
+            .value_length = record->value_length,
+            .hash = hash,
+            .key_length = record->key_length,
+            .block = block,
+        });
+    }
+
+    block_unref(block);
+}
+
+
+void store_adopt(struct store* store) {
+    if (!store->cache.budget) {
+        return;
+    }
+    for (size_t i = 0; i < store->capacity; i += 1) {
+        if (store->entries[i].key) {
+            store->entries[i].segment = STORE_PROBATION;
+            link_front(store, i);
+        }
+    }
+    evict(store);
 }
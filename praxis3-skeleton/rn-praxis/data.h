@@ -1,40 +1,188 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "util.h"
 
 /**
- * A simple key-value entry
+ * Marks the end of a segment's list, see `struct entry`
+ */
+#define STORE_NIL UINT32_MAX
+
+/**
+ * Longest key the store holds, as entries and the write-ahead log record key
+ * lengths in 16 bits
+ */
+#define STORE_MAX_KEY_LENGTH UINT16_MAX
+
+/**
+ * Segments of a store in cache mode, see `store_set_budget()`
+ */
+enum store_segment {
+    STORE_PROBATION,
+    STORE_PROTECTED,
+    N_STORE_SEGMENTS,
+};
+
+/**
+ * A key-value entry of the store
  *
- * Provides a simple, inefficient, key-value when combined with `get()`,
- * `set()`, and `delete()`.
+ * Keys are not null-terminated. Entries set individually own a single
+ * allocation holding key and value, starting at `key`. Entries inserted by
+ * `store_load()` point into a shared `block` instead.
+ *
+ * In cache mode, `prev` and `next` link the entry into its `segment`'s list
+ * by slot index, so the links survive resizing the table.
  */
-struct tuple {
-    string key;
-    char* value;
+struct entry {
+    const char* key;
+    const char* value;
     size_t value_length;
+    uint32_t hash;
+    uint16_t key_length;
+    uint8_t segment;
+    struct store_block* block;
+    uint32_t prev;
+    uint32_t next;
 };
 
 /**
- * Get the value matching the key in an array of tuples
+ * Memory shared by all entries inserted by one `store_load()`
  *
- * Returns a pointer to the begin of the value, stores its length in `value_length`.
+ * Freed when the last of its entries is overwritten or deleted. If `mapping`
+ * is set, the entries point into it rather than into `data`, and it is
+ * unmapped then, too.
  */
-const char* get(const string key, struct tuple* tuples, size_t n_tuples, size_t* value_length);
+struct store_block {
+    size_t refs;
+    void* mapping;
+    size_t mapping_length;
+    char data[];
+};
 
 /**
- * Set the value for the key in an array of tuples
+ * List of a segment's entries, from the most recently used `head` to `tail`
  *
- * Returns true if a value was overwritten, false if it was created.
+ * `bytes` is what the entries are charged against the budget.
  */
-bool set(const string key, char* value, size_t value_length, struct tuple* tuples, size_t n_tuples);
+struct store_list {
+    uint32_t head;
+    uint32_t tail;
+    size_t bytes;
+};
 
+/**
+ * Budget and counters of a store in cache mode
+ *
+ * `evictions`: entries evicted from each segment
+ * `rejections`: values not stored as they exceed the whole budget
+ * `promotions`: entries moved to the protected segment on a second use
+ * `demotions`: entries moved back as the protected segment overflowed
+ */
+struct store_cache {
+    size_t budget;
+    struct store_list lists[N_STORE_SEGMENTS];
+    uint64_t evictions[N_STORE_SEGMENTS];
+    uint64_t evicted_bytes;
+    uint64_t rejections;
+    uint64_t promotions;
+    uint64_t demotions;
+};
+
+/**
+ * A hash table of entries with linear probing
+ *
+ * `capacity` is zero or a power of two, `entries` with a NULL key are free.
+ * The store is in cache mode if `cache.budget` is set.
+ */
+struct store {
+    struct entry* entries;
+    size_t capacity;
+    size_t size;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    struct store_cache cache;
+};
 
 /**
- * Deletes the key in the array of tuples.
+ * A record to insert with `store_load()`, pointing into the block's data
+ *
+ * Its `key_length` cannot exceed `STORE_MAX_KEY_LENGTH` by construction.
+ */
+struct store_record {
+    const char* key;
+    uint16_t key_length;
+    const char* value;
+    size_t value_length;
+};
+
+/**
+ * Share of the budget the protected segment may fill, in percent
+ */
+#define STORE_PROTECTED_PERCENT 80
+
+/**
+ * Put an empty store into cache mode, bounding it to `budget` bytes
+ *
+ * A segmented LRU decides what to evict: new entries start in the probation
+ * segment and are promoted to the protected one when used again, so a scan
+ * of keys used once only evicts other such keys. Each entry is charged its
+ * key, its value and two slots of the table. Entries of a shared block are
+ * charged individually; the block is freed with the last of them.
+ */
+void store_set_budget(struct store* store, size_t budget);
+
+/**
+ * Get the value matching the key
+ *
+ * Returns a pointer to the begin of the value, stores its length in `value_length`.
+ * In cache mode, marks the entry as used.
+ */
+const char* store_get(struct store* store, const string key, size_t* value_length);
+
+/**
+ * Outcome of `store_set()`
+ */
+enum store_result {
+    STORE_CREATED,
+    STORE_REPLACED,
+    STORE_REJECTED,
+};
+
+/**
+ * Set the value for the key
+ *
+ * Returns whether the value was created or replaced an existing one. In cache
+ * mode, this may evict other entries. A value exceeding the budget on its own
+ * and a key longer than `STORE_MAX_KEY_LENGTH` are rejected, leaving the store
+ * unchanged.
+ */
+enum store_result store_set(struct store* store, const string key, const char* value, size_t value_length);
+
+/**
+ * Delete the key
  *
  * Returns true if it existed.
  */
-bool delete(const string key, struct tuple* tuples, size_t n_tuples);
+bool store_delete(struct store* store, const string key);
+
+/**
+ * Insert records pointing into `block`'s data at once
+ *
+ * The store takes ownership of `block`, which must have been allocated with
+ * `malloc()`. No memory is allocated per record; the table grows at most once.
+ * Existing keys are overwritten. In cache mode, a value exceeding the budget on its
+ * own removes the key instead, as the caller cannot tell which records failed.
+ */
+void store_load(struct store* store, struct store_block* block, const struct store_record* records, size_t n_records);
+
+/**
+ * Take over entries written into the table directly, as `snapshot_load()` does
+ *
+ * In cache mode, links them into the probation segment and evicts down to the
+ * budget. Their `prev` and `next` are ignored.
+ */
+void store_adopt(struct store* store);
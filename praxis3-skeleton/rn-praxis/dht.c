@@ -5,48 +5,197 @@
 
 
 #include "dht.h"
+#include "probes.h"
+#include "timer.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <limits.h>
-#include <math.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
-#include <time.h>
 #include <unistd.h>
 
-#include <openssl/sha.h>
-
 #define LOOKUP_CACHE_ENTRIES 30
 #define LOOKUP_CACHE_VALIDIY_MS 2000
+#define DHT_OUTBOX_PEERS 16
+#define STABILIZE_MIN_MS 250
+#define STABILIZE_MAX_MS 2000
+#define JOIN_RETRY_MIN_MS 500
+#define JOIN_RETRY_MAX_MS 4000
+#define MAX_ANCHORS 8
+#define MAX_PENDING_JOINS 64
+#define MAX_MEMBERS 256
+#define MEMBER_TIMEOUT_MS (10 * STABILIZE_MAX_MS)
+#define STABILIZE_MAX_UNANSWERED 3
+#define N_BACKUP_SUCCESSORS 4
+#define PREDECESSOR_TIMEOUT_MS (3 * STABILIZE_MAX_MS)
+#define MAX_FAILED 8
+#define FAILED_MEMORY_MS (2 * PREDECESSOR_TIMEOUT_MS)
 
 
 struct peer predecessor; 
 struct peer self;
 struct peer successor;
-struct peer anchor;
 int dht_socket;
 
+// Sender of the datagram being processed, if known, for the trace
+static struct peer receiving_from;
+
+
+/**
+ * A gossiped membership entry for one-hop routing
+ *
+ * Every peer increments its own heartbeat once per stabilization round and
+ * gossips its table. Entries whose heartbeat did not advance for
+ * `MEMBER_TIMEOUT_MS` belong to failed peers and are dropped.
+ */
+struct member {
+    struct peer peer;
+    uint16_t heartbeat;
+    unsigned long updated;
+};
 
 
 /**
- * Table for the most recent lookup replies.
+ * A recent lookup reply: `peer` is responsible for (`predecessor`, `peer.id`]
  */
-struct {
+struct lookup_cache_entry {
     unsigned long entry;
     dht_id predecessor;
     struct peer peer;
-} lookup_cache[LOOKUP_CACHE_ENTRIES];
+};
+
+
+/**
+ * A datagram under construction for a single destination
+ *
+ * `length` covers the container header and all records appended so far.
+ */
+struct outbox_datagram {
+    struct sockaddr_in addr;
+    size_t n_records;
+    size_t length;
+    uint8_t data[DHT_PACKET_MAX_SIZE];
+};
+
+
+/**
+ * The complete protocol state of a peer, see `dht_context_switch()`
+ *
+ * `stabilize_*`: the stabilization schedule. The period doubles with every
+ *                round up to `STABILIZE_MAX_MS` and drops back to
+ *                `STABILIZE_MIN_MS` whenever our neighborhood changes.
+ * `stabilize_unanswered`: stabilizes sent to our successor since the last
+ *                notify. After `STABILIZE_MAX_UNANSWERED`, it has failed.
+ * `successor_answered`: whether our successor notified us at all, only then
+ *                do we look up its `backups`
+ * `backups`: the peers following our successor, each the successor of the
+ *                one before, to fall back on should it fail. Learned by
+ *                plain lookups, so other peers need not know about them;
+ *                the one at `backup_next` is refreshed next.
+ * `predecessor_heard`: when our predecessor last stabilized with us. After
+ *                `PREDECESSOR_TIMEOUT_MS` without, it has failed.
+ * `failed`, `failed_at`: recently failed neighbors, so that stale notifies
+ *                naming them are ignored until the ring has forgotten them
+ * `anchors`, `join_retry_*`: peers we try to join the DHT through, all in
+ *                parallel, until we are notified of our successor
+ * `pending_joins`: joins we are responsible for, received since the last
+ *                flush. Handling them together allows splicing a whole burst
+ *                of joining peers into the ring at once, instead of each of
+ *                them ending up as our predecessor in turn.
+ * `members`: full ring membership for one-hop routing, sorted by ID
+ * `lookup_cache`: table for the most recent lookup replies
+ * `outbox`: datagrams under construction, one per destination
+ * `counters`: the peer's activity, see `struct dht_counters`
+ * `predecessor`, `self`, `successor`: the peer's neighborhood while another
+ *                context is active; the active one's is in the globals
+ */
+struct dht_context {
+    bool stabilize_enabled;
+    unsigned long stabilize_period;
+    unsigned long stabilize_next;
+    unsigned stabilize_unanswered;
+    bool successor_answered;
+    struct peer backups[N_BACKUP_SUCCESSORS];
+    size_t backup_next;
+    unsigned long predecessor_heard;
+
+    struct peer failed[MAX_FAILED];
+    unsigned long failed_at[MAX_FAILED];
+    size_t failed_next;
+
+    struct peer anchors[MAX_ANCHORS];
+    size_t n_anchors;
+    unsigned long join_retry_period;
+    unsigned long join_retry_next;
+
+    struct peer pending_joins[MAX_PENDING_JOINS];
+    size_t n_pending_joins;
+
+    bool one_hop;
+    struct member members[MAX_MEMBERS];
+    size_t n_members;
+    uint16_t heartbeat;
+
+    struct lookup_cache_entry lookup_cache[LOOKUP_CACHE_ENTRIES];
+
+    struct outbox_datagram outbox[DHT_OUTBOX_PEERS];
+    size_t outbox_used;
+
+    struct dht_counters counters;
+
+    struct peer predecessor;
+    struct peer self;
+    struct peer successor;
+};
+
+#define DHT_CONTEXT_INITIALIZER { \
+    .stabilize_period = STABILIZE_MIN_MS, \
+    .stabilize_next = TIMER_NEVER, \
+    .join_retry_period = JOIN_RETRY_MIN_MS, \
+    .join_retry_next = TIMER_NEVER, \
+}
+
+static struct dht_context default_context = DHT_CONTEXT_INITIALIZER;
+static struct dht_context* context = &default_context;
 
 
 /**
- * Return the current time in milliseconds
+ * Transmit raw bytes to the given address via the `dht_socket`
  */
-unsigned long time_ms(void) {
-    struct timespec spec;
-    clock_gettime(CLOCK_REALTIME, &spec);
-    return 1000 * spec.tv_sec + round(spec.tv_nsec / 1.0e6);
+static void socket_transmit(const uint8_t* data, size_t length, const struct sockaddr_in* addr) {
+    if (sendto(dht_socket, data, length, 0, (struct sockaddr*) addr, sizeof(struct sockaddr_in)) == -1) {
+        perror("sendto");
+        exit(1);
+    }
+}
+
+static dht_transport transmit = socket_transmit;
+
+
+struct dht_context* dht_context_new(void) {
+    struct dht_context* created = malloc(sizeof(struct dht_context));
+    *created = (struct dht_context) DHT_CONTEXT_INITIALIZER;
+    return created;
+}
+
+
+void dht_context_switch(struct dht_context* next) {
+    context->predecessor = predecessor;
+    context->self = self;
+    context->successor = successor;
+
+    context = next ? next : &default_context;
+    predecessor = context->predecessor;
+    self = context->self;
+    successor = context->successor;
+}
+
+
+void dht_set_transport(dht_transport transport) {
+    transmit = transport ? transport : socket_transmit;
 }
 
 
@@ -71,9 +220,11 @@ static void dht_serialize(struct dht_message* msg) {
 
 /**
  * Check whether a cache entry is outdated
+ *
+ * Unused entries have an entry time of zero and are always outdated.
  */
 static bool outdated(unsigned long entry) {
-    return (time_ms() - entry) >= LOOKUP_CACHE_VALIDIY_MS;
+    return entry == 0 || (time_ms() - entry) >= LOOKUP_CACHE_VALIDIY_MS;
 }
 
 
@@ -85,6 +236,26 @@ static bool peer_cmp(const struct peer* a, const struct peer* b) {
 }
 
 
+/**
+ * Check whether the peer describes an actual node, i.e., is not zeroed
+ */
+static bool peer_valid(const struct peer* peer) {
+    return peer->port != 0;
+}
+
+
+/**
+ * Check whether `id` lies strictly between `from` and `to` on the ring
+ *
+ * If `from` equals `to`, every other ID lies in between.
+ */
+static bool between(dht_id from, dht_id id, dht_id to) {
+    const dht_id distance_id = id - from;
+    const dht_id distance_to = to - from;
+    return distance_id != 0 && (distance_to == 0 || distance_id < distance_to);
+}
+
+
 
 void peer_to_sockaddr(const struct peer* peer, struct sockaddr_in* addr) {
     addr->sin_family = AF_INET;
@@ -94,21 +265,112 @@ void peer_to_sockaddr(const struct peer* peer, struct sockaddr_in* addr) {
 
 
 /**
- * Send the given DHT message to the given peer
+ * Encode a message in the legacy wire format
  */
-static void dht_send(struct dht_message* msg, const struct peer* peer) {
-    dht_serialize(msg);
+static void encode_message(const struct dht_message* msg, uint8_t* out) {
+    struct dht_message wire = *msg;
+    dht_serialize(&wire);
+    memcpy(out, &wire, sizeof(struct dht_message));
+}
+
 
+/**
+ * Transmit the datagram for the given outbox slot
+ *
+ * A lone message record is converted back to the legacy format, so peers
+ * unaware of containers keep working as long as nothing is batched.
+ */
+static void outbox_transmit(size_t slot) {
+    const uint8_t* record = context->outbox[slot].data + DHT_PACKET_HEADER_SIZE;
+    const bool legacy = context->outbox[slot].n_records == 1 && record[0] < N_OPCODES
+        && record[1] == DHT_MESSAGE_VALUE_SIZE;
+
+    if (legacy) {
+        uint8_t datagram[sizeof(struct dht_message)];
+        datagram[0] = record[0];
+        memcpy(datagram + 1, record + DHT_RECORD_HEADER_SIZE, DHT_MESSAGE_VALUE_SIZE);
+        transmit(datagram, sizeof datagram, &context->outbox[slot].addr);
+    } else {
+        transmit(context->outbox[slot].data, context->outbox[slot].length, &context->outbox[slot].addr);
+    }
+
+    context->outbox[slot].n_records = 0;
+    context->outbox[slot].length = DHT_PACKET_HEADER_SIZE;
+}
+
+
+static void outbox_flush(void) {
+    for (size_t i = 0; i < context->outbox_used; i += 1) {
+        outbox_transmit(i);
+    }
+    context->outbox_used = 0;
+}
+
+
+/**
+ * Reserve space for a record of the given type and length in the datagram to `peer`
+ *
+ * Returns a pointer to the record's value. If the pending datagram is full, it
+ * is transmitted first; if all slots are taken, everything is flushed.
+ */
+static uint8_t* outbox_reserve(const struct peer* peer, uint8_t type, uint8_t length) {
     struct sockaddr_in addr;
     peer_to_sockaddr(peer, &addr);
 
-    if (sendto(dht_socket, msg, sizeof(struct dht_message), 0, (struct sockaddr*) &addr, sizeof(struct sockaddr_in)) == -1) {
-        perror("sendto");
-        exit(1);
+    size_t slot = 0;
+    while (slot < context->outbox_used && !(context->outbox[slot].addr.sin_addr.s_addr == addr.sin_addr.s_addr
+                                            && context->outbox[slot].addr.sin_port == addr.sin_port)) {
+        slot += 1;
     }
+
+    if (slot == DHT_OUTBOX_PEERS) {
+        outbox_flush();
+        slot = 0;
+    }
+    if (slot == context->outbox_used) {
+        context->outbox[slot].addr = addr;
+        context->outbox[slot].n_records = 0;
+        context->outbox[slot].length = DHT_PACKET_HEADER_SIZE;
+        context->outbox[slot].data[0] = DHT_PACKET_MAGIC;
+        context->outbox[slot].data[1] = DHT_PACKET_VERSION;
+        context->outbox_used += 1;
+    }
+    if (context->outbox[slot].length + DHT_RECORD_HEADER_SIZE + length > DHT_PACKET_MAX_SIZE) {
+        outbox_transmit(slot);
+    }
+
+    uint8_t* record = context->outbox[slot].data + context->outbox[slot].length;
+    record[0] = type;
+    record[1] = length;
+    context->outbox[slot].length += DHT_RECORD_HEADER_SIZE + length;
+    context->outbox[slot].n_records += 1;
+    return record + DHT_RECORD_HEADER_SIZE;
 }
 
-void send_join(const struct peer peer){
+
+/**
+ * Queue the given DHT message for the given peer
+ *
+ * The message is transmitted on the next `dht_flush()`.
+ */
+static void dht_send(const struct dht_message* msg, const struct peer* peer) {
+    if (!peer_valid(peer)) {
+        return;  // Neighborhood not known yet, e.g., while joining
+    }
+
+    uint8_t encoded[sizeof(struct dht_message)];
+    encode_message(msg, encoded);
+
+    uint8_t* value = outbox_reserve(peer, msg->flags, DHT_MESSAGE_VALUE_SIZE);
+    memcpy(value, encoded + 1, DHT_MESSAGE_VALUE_SIZE);
+    trace_event(TRACE_SEND, msg->flags, msg->hash, &msg->peer, peer);
+    PROBE4(dht__send, msg->flags, msg->hash, peer->ip.s_addr, peer->port);
+    if (msg->flags < N_OPCODES) {
+        context->counters.sent[msg->flags] += 1;
+    }
+}
+
+static void send_join(const struct peer peer){
 
     struct dht_message join = {
             .flags = JOIN,
@@ -120,99 +382,556 @@ void send_join(const struct peer peer){
 }
 
 
-void stabilize(){
-    sleep(1.0);
-    struct dht_message msg = {
-            .flags = STABILIZE,
-            .hash = 0,
-            .peer = self,
-    };
+/**
+ * Send joins to all anchors and schedule the next attempt
+ */
+static void join_attempt(void) {
+    for (size_t i = 0; i < context->n_anchors; i += 1) {
+        send_join(context->anchors[i]);
+    }
 
-    dht_send(&msg, &successor);
+    context->join_retry_next = time_ms() + context->join_retry_period;
+    context->join_retry_period = (2 * context->join_retry_period < JOIN_RETRY_MAX_MS) ? 2 * context->join_retry_period : JOIN_RETRY_MAX_MS;
 }
 
-void notify(struct dht_message* msg){
 
-    struct dht_message notify = {
-            .flags = NOTIFY,
-            .hash = 0,
-            .peer = predecessor,
-    };
-    dht_send(&notify, &(msg->peer));
-    if(!peer_cmp(&predecessor, &(msg->peer))){
-        successor = predecessor;
-        predecessor = msg->peer;
+void dht_join(const struct peer* peers, size_t n) {
+    static const struct peer unknown = {0};
+    trace_event(TRACE_PREDECESSOR, 0, 0, &unknown, &predecessor);
+    trace_event(TRACE_SUCCESSOR, 0, 0, &unknown, &successor);
+    predecessor = unknown;
+    successor = unknown;
+
+    context->n_anchors = (n < MAX_ANCHORS) ? n : MAX_ANCHORS;
+    memcpy(context->anchors, peers, context->n_anchors * sizeof(struct peer));
+
+    context->join_retry_period = JOIN_RETRY_MIN_MS;
+    join_attempt();
+}
+
+
+/**
+ * Note a change of our neighborhood
+ *
+ * Stabilization falls back to its shortest period and the next round is
+ * pulled in accordingly, so changes propagate quickly through the ring.
+ */
+static void ring_changed(void) {
+    context->stabilize_period = STABILIZE_MIN_MS;
+    if (context->stabilize_next > time_ms() + STABILIZE_MIN_MS) {
+        context->stabilize_next = time_ms() + STABILIZE_MIN_MS;
     }
+}
 
+
+static void set_predecessor(const struct peer* peer) {
+    if (!peer_cmp(&predecessor, peer)) {
+        trace_event(TRACE_PREDECESSOR, 0, 0, peer, &predecessor);
+        predecessor = *peer;
+        context->predecessor_heard = time_ms();
+        ring_changed();
+    }
 }
 
-static void succ_update(struct dht_message* msg){
 
-    if(self.id == 4096 && self.port == 4711){
-        if (!peer_cmp(&successor, &(msg->peer))) {
-            successor = msg->peer;
-            struct dht_message update_msg = {
-                    .flags = STABILIZE,
-                    .hash = 0,
-                    .peer = self,
-            };
-            dht_send(&update_msg, &successor);
+static void set_successor(const struct peer* peer) {
+    if (!peer_cmp(&successor, peer)) {
+        trace_event(TRACE_SUCCESSOR, 0, 0, peer, &successor);
+        successor = *peer;
+        context->stabilize_unanswered = 0;
+        context->successor_answered = false;
+        memset(context->backups, 0, sizeof context->backups);
+        ring_changed();
+    }
+}
 
-            return;
+
+/**
+ * Check whether the peer failed recently
+ */
+static bool recently_failed(const struct peer* peer) {
+    for (size_t i = 0; i < MAX_FAILED; i += 1) {
+        if (peer_cmp(&context->failed[i], peer) && time_ms() - context->failed_at[i] < FAILED_MEMORY_MS) {
+            return true;
         }
     }
+    return false;
+}
 
-    if(successor.port == 0){
-        if (!peer_cmp(&successor, &(msg->peer))) {
-            successor = msg->peer;
-            struct dht_message update_msg = {
-                    .flags = STABILIZE,
-                    .hash = 0,
-                    .peer = self,
-            };
-            dht_send(&update_msg, &successor);
+
+/**
+ * Remember a failed peer and forget what the lookup cache knows about it
+ */
+static void peer_failed(const struct peer* peer) {
+    context->failed[context->failed_next] = *peer;
+    context->failed_at[context->failed_next] = time_ms();
+    context->failed_next = (context->failed_next + 1) % MAX_FAILED;
+
+    for (size_t i = 0; i < LOOKUP_CACHE_ENTRIES; i += 1) {
+        if (peer_cmp(&context->lookup_cache[i].peer, peer)) {
+            context->lookup_cache[i] = (struct lookup_cache_entry) {0};
+        }
+    }
+}
+
+
+/**
+ * Drop our predecessor, it stopped stabilizing with us
+ *
+ * The next peer to stabilize with us becomes our predecessor.
+ */
+static void predecessor_failed(void) {
+    static const struct peer unknown = {0};
+    context->counters.predecessor_failures += 1;
+    peer_failed(&predecessor);
+    trace_event(TRACE_PREDECESSOR, 0, 0, &unknown, &predecessor);
+    predecessor = unknown;
+    ring_changed();
+}
+
+
+/**
+ * Replace our failed successor by the first of its backups that did not fail
+ *
+ * Without backups, the closest member follows us in one-hop mode, or our
+ * predecessor otherwise. Stabilizing with it walks back along the ring until
+ * we reach the failed successor's successor, which by then has dropped its
+ * failed predecessor in turn.
+ */
+static void successor_failed(void) {
+    context->counters.successor_failures += 1;
+    peer_failed(&successor);
+    if (recently_failed(&predecessor)) {
+        predecessor_failed();  // It was our only neighbor
+    }
+
+    for (size_t i = 0; i < N_BACKUP_SUCCESSORS; i += 1) {
+        if (peer_valid(&context->backups[i]) && !recently_failed(&context->backups[i])) {
+            struct peer backups[N_BACKUP_SUCCESSORS] = {0};
+            memcpy(backups, &context->backups[i + 1], (N_BACKUP_SUCCESSORS - i - 1) * sizeof(struct peer));
+            set_successor(&context->backups[i]);
+            memcpy(context->backups, backups, sizeof backups);
             return;
         }
     }
-    if(predecessor.port == 0){
-        struct dht_message Upmsg = {
+
+    const struct peer* best = NULL;
+    for (size_t i = 0; i < context->n_members; i += 1) {
+        const struct peer* member = &context->members[i].peer;
+        if (!peer_cmp(member, &self) && !recently_failed(member)
+            && (!best || (dht_id) (member->id - self.id) < (dht_id) (best->id - self.id))) {
+            best = member;
+        }
+    }
+    if (best) {
+        set_successor(best);
+    } else {
+        set_successor(peer_valid(&predecessor) ? &predecessor : &self);
+    }
+}
+
+
+/**
+ * Return the index of the first member with an ID not below `id`
+ */
+static size_t member_search(dht_id id) {
+    size_t low = 0;
+    size_t high = context->n_members;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (context->members[mid].peer.id < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+
+/**
+ * Merge a gossiped membership entry into our table
+ *
+ * Entries are only replaced by ones with a more recent heartbeat.
+ */
+static void member_update(const struct peer* peer, uint16_t member_heartbeat) {
+    const size_t i = member_search(peer->id);
+
+    if (i < context->n_members && context->members[i].peer.id == peer->id) {
+        if ((int16_t) (member_heartbeat - context->members[i].heartbeat) > 0) {
+            context->members[i].peer = *peer;
+            context->members[i].heartbeat = member_heartbeat;
+            context->members[i].updated = time_ms();
+        }
+        return;
+    }
+
+    if (context->n_members == MAX_MEMBERS) {
+        return;
+    }
+    memmove(&context->members[i + 1], &context->members[i], (context->n_members - i) * sizeof(struct member));
+    context->members[i] = (struct member) {
+        .peer = *peer,
+        .heartbeat = member_heartbeat,
+        .updated = time_ms(),
+    };
+    context->n_members += 1;
+}
+
+
+/**
+ * Drop members that stopped advancing their heartbeat
+ */
+static void member_expire(void) {
+    size_t kept = 0;
+    for (size_t i = 0; i < context->n_members; i += 1) {
+        if (peer_cmp(&context->members[i].peer, &self) || time_ms() - context->members[i].updated < MEMBER_TIMEOUT_MS) {
+            context->members[kept] = context->members[i];
+            kept += 1;
+        }
+    }
+    context->n_members = kept;
+}
+
+
+/**
+ * Send our complete membership table to the given peer
+ *
+ * The records are appended to whatever else is queued for the peer, the
+ * outbox spreads them over several datagrams if needed.
+ */
+static void member_gossip(const struct peer* peer) {
+    if (!peer_valid(peer) || peer_cmp(peer, &self)) {
+        return;
+    }
+
+    for (size_t i = 0; i < context->n_members; i += 1) {
+        struct dht_message wire = { .peer = context->members[i].peer };
+        dht_serialize(&wire);
+
+        uint8_t* value = outbox_reserve(peer, DHT_RECORD_MEMBER, DHT_MEMBER_VALUE_SIZE);
+        memcpy(value, &wire.peer, sizeof(struct peer));
+        const uint16_t member_heartbeat = htons(context->members[i].heartbeat);
+        memcpy(value + sizeof(struct peer), &member_heartbeat, sizeof member_heartbeat);
+    }
+}
+
+
+/**
+ * Process a gossiped membership record
+ */
+static void process_member(const uint8_t* value) {
+    struct dht_message wire;
+    memcpy(&wire.peer, value, sizeof(struct peer));
+    dht_deserialize(&wire);
+
+    uint16_t member_heartbeat;
+    memcpy(&member_heartbeat, value + sizeof(struct peer), sizeof member_heartbeat);
+
+    if (!peer_cmp(&wire.peer, &self)) {
+        member_update(&wire.peer, ntohs(member_heartbeat));
+    }
+}
+
+
+/**
+ * Retrieve the responsible peer according to the membership table
+ */
+static struct peer* member_responsible(dht_id id) {
+    size_t i = member_search(id);
+    if (i == context->n_members) {
+        i = 0;  // Wrap around
+    }
+    return peer_cmp(&context->members[i].peer, &self) ? &self : &context->members[i].peer;
+}
+
+
+/**
+ * Check whether the given peer is responsible for the given ID
+ *
+ * Note that this returning false does not imply the passed peer's predecessor is
+ * responsible for the ID, this is not generally the case. 
+ */
+static bool is_responsible(dht_id peer_predecessor, dht_id peer, dht_id id) {
+    // Gotta store differences explicitly as unsigned since C promotes them to signed otherwise...
+    const dht_id distance_peer_predecessor = peer_predecessor - id;
+    const dht_id distance_peer = peer - id;
+    return (peer_predecessor == peer) || (distance_peer < distance_peer_predecessor);
+}
+
+
+/**
+ * Retrieve the responsible peer, see `dht_responsible()`
+ *
+ * Without `use_members`, only our neighborhood and lookup replies are
+ * consulted. Unlike the gossiped membership, they are verified by
+ * stabilization and cannot lag behind the ring's changes.
+ */
+static struct peer* responsible_peer(dht_id id, bool use_members) {
+    if (peer_valid(&predecessor) && is_responsible(predecessor.id, self.id, id)) {
+        return &self;
+    } else if (peer_valid(&successor) && is_responsible(self.id, successor.id, id)) {
+        return &successor;
+    }
+
+    // With the complete membership at hand, no lookups are required
+    if (use_members && context->one_hop && context->n_members > 1) {
+        return member_responsible(id);
+    }
+
+    // Check for recent lookup replies that match the datum
+    for (size_t i = 0; i < LOOKUP_CACHE_ENTRIES; i += 1) {
+        const bool match = is_responsible(context->lookup_cache[i].predecessor, context->lookup_cache[i].peer.id, id);
+
+        if (match && !outdated(context->lookup_cache[i].entry)) {
+            context->counters.cache_hits += 1;
+            return &context->lookup_cache[i].peer;
+        }
+    }
+
+    context->counters.cache_misses += 1;
+    return NULL;
+}
+
+
+void dht_init(bool enable_stabilize, bool enable_one_hop) {
+    context->one_hop = enable_one_hop;
+    context->n_members = 0;
+    if (context->one_hop) {
+        member_update(&self, context->heartbeat);
+    }
+
+    context->stabilize_enabled = enable_stabilize;
+    context->stabilize_period = STABILIZE_MIN_MS;
+    context->stabilize_next = time_ms() + STABILIZE_MIN_MS;
+    context->stabilize_unanswered = 0;
+    context->predecessor_heard = time_ms();
+}
+
+
+unsigned long dht_deadline(void) {
+    if (!peer_valid(&successor)) {
+        return context->join_retry_next;
+    }
+    return context->stabilize_enabled ? context->stabilize_next : TIMER_NEVER;
+}
+
+
+void dht_tick(void) {
+    if (!peer_valid(&successor)) {
+        if (context->join_retry_next <= time_ms()) {
+            join_attempt();
+        }
+    } else if (context->stabilize_enabled && context->stabilize_next <= time_ms()) {
+        stabilize();
+    }
+}
+
+
+void stabilize(void) {
+    PROBE2(stabilize, successor.id, context->stabilize_period);
+    if (context->one_hop) {
+        context->heartbeat += 1;
+        member_update(&self, context->heartbeat);
+        member_expire();
+    }
+
+    // Neighbors that stopped answering have failed
+    if (context->stabilize_unanswered >= STABILIZE_MAX_UNANSWERED) {
+        successor_failed();
+    }
+    if (peer_valid(&predecessor) && !peer_cmp(&predecessor, &self)
+        && time_ms() - context->predecessor_heard > PREDECESSOR_TIMEOUT_MS) {
+        predecessor_failed();
+    }
+
+    if (peer_cmp(&successor, &self)) {
+        // We are our own successor, so our predecessor is the only candidate
+        // for a better one. No need to send a message to ourselves for that.
+        if (peer_valid(&predecessor) && !peer_cmp(&predecessor, &self)) {
+            set_successor(&predecessor);
+        }
+    } else if (peer_valid(&successor)) {
+        struct dht_message msg = {
                 .flags = STABILIZE,
                 .hash = 0,
                 .peer = self,
         };
-        dht_send(&Upmsg, &successor);
-        predecessor = msg->peer;
+        dht_send(&msg, &successor);
+
+        // The successor of a peer answers a lookup for the ID following it.
+        // One backup is refreshed per round, each learned from the one before.
+        const size_t i = context->backup_next;
+        const struct peer* previous = (i == 0) ? &successor : &context->backups[i - 1];
+        if (context->successor_answered && peer_valid(previous) && !peer_cmp(previous, &self)) {
+            struct dht_message lookup = {
+                    .flags = LOOKUP,
+                    .hash = previous->id + 1,
+                    .peer = self,
+            };
+            dht_send(&lookup, &successor);
+            context->backup_next = (i + 1) % N_BACKUP_SUCCESSORS;
+        } else {
+            context->backup_next = 0;
+        }
+        context->stabilize_unanswered += 1;
+    }
 
+    if (context->one_hop && context->n_members > 1) {
+        // Piggyback our membership on the stabilize, and push it to a random
+        // member for epidemic spreading across the ring
+        member_gossip(&successor);
+        member_gossip(&context->members[rand() % context->n_members].peer);
     }
 
+    // Back off exponentially while nothing changes
+    context->stabilize_next = time_ms() + context->stabilize_period;
+    context->stabilize_period = (2 * context->stabilize_period < STABILIZE_MAX_MS) ? 2 * context->stabilize_period : STABILIZE_MAX_MS;
+}
+
+
+/**
+ * Process the given stabilize
+ *
+ * The originator becomes our predecessor if it is closer than the current
+ * one. In any case, it is notified of our (possibly updated) predecessor.
+ * While joining we stay silent: the originator took us for its successor, but
+ * the notify of our splice was lost and our retried joins are routed to us.
+ * Going unanswered, it drops us and the retries reach our successor again.
+ */
+static void process_stabilize(const struct dht_message* msg) {
+    if (!peer_valid(&successor)) {
+        return;  // Still joining, so the originator's splice notify got lost
+    }
+
+    const bool closer = !peer_valid(&predecessor) || peer_cmp(&predecessor, &self)
+        || between(predecessor.id, msg->peer.id, self.id);
+    if (closer) {
+        set_predecessor(&msg->peer);
+    }
+    if (peer_cmp(&predecessor, &msg->peer)) {
+        context->predecessor_heard = time_ms();
+    }
+
+    struct dht_message notify = {
+            .flags = NOTIFY,
+            .hash = 0,
+            .peer = predecessor,
+    };
+    dht_send(&notify, &(msg->peer));
+
+    if (context->one_hop) {
+        member_gossip(&msg->peer);
+    }
+}
+
+
+/**
+ * Process the given notify
+ *
+ * While joining, the first notify names our successor. Afterwards, the
+ * notified peer replaces our successor if it lies between us. Only our
+ * successor notifies us, so any notify answers our last stabilize.
+ */
+static void process_notify(const struct dht_message* msg) {
+    context->stabilize_unanswered = 0;
+    context->successor_answered = true;
+    if (!peer_valid(&msg->peer) || peer_cmp(&msg->peer, &self) || recently_failed(&msg->peer)) {
+        return;
+    }
+
+    if (!peer_valid(&successor) || between(self.id, msg->peer.id, successor.id)) {
+        set_successor(&msg->peer);
+    }
 }
 
 /**
  * Process the given join
  *
- * If our self is responsible for the joined ID, a notify is sent to the
- * join. Otherwise, the join message is forwarded to our successor.
+ * Joins for IDs we are responsible for are collected and handled by
+ * `splice_joins()`. Others are forwarded straight to the responsible peer if
+ * a lookup told us who that is, or along the ring to our successor otherwise.
+ * The one-hop membership is not consulted: while the ring changes, it may
+ * name a peer that is no longer responsible, or even us, and peers with
+ * different stale views would pass the join back and forth.
  */
 static void process_join(struct dht_message* join){
+    const struct peer* responsible = responsible_peer(join->peer.id, false);
 
-    if (!peer_cmp(&self, dht_responsible(join->peer.id))) {
-        if(join->peer.id > successor.id && join->peer.id < predecessor.id){
-            dht_send(join, &predecessor);
-            return;
+    if (responsible != &self) {
+        dht_send(join, responsible ? responsible : &successor);
+        return;
+    }
+
+    if (peer_cmp(&join->peer, &self)) {
+        return;
+    }
+    for (size_t i = 0; i < context->n_pending_joins; i += 1) {
+        if (peer_cmp(&context->pending_joins[i], &join->peer)) {
+            return;  // Same peer joining via multiple anchors
         }
+    }
+    if (context->n_pending_joins == MAX_PENDING_JOINS) {
+        return;  // The peer will retry
+    }
+    context->pending_joins[context->n_pending_joins] = join->peer;
+    context->n_pending_joins += 1;
+}
+
 
-        dht_send(join, &successor);
+/**
+ * Splice all pending joining peers between our predecessor and us
+ *
+ * The joining peers are ordered along the ring and each is notified of its
+ * successor: the next joining peer, or us for the last one. Our previous
+ * predecessor is notified of the first one, so that it adopts it as successor
+ * without waiting for its next stabilization round.
+ */
+static void splice_joins(void) {
+    const size_t n = context->n_pending_joins;
+    context->n_pending_joins = 0;
+    if (n == 0) {
         return;
     }
 
-    struct dht_message join_notify = {
-            .flags = NOTIFY,
-            .hash = 0,
-            .peer = self,
-    };
+    // Insertion sort by distance from our predecessor, bursts are small
+    const dht_id base = peer_valid(&predecessor) ? predecessor.id : self.id;
+    struct peer joining[MAX_PENDING_JOINS];
+    for (size_t i = 0; i < n; i += 1) {
+        size_t j = i;
+        while (j > 0 && (dht_id) (joining[j - 1].id - base) > (dht_id) (context->pending_joins[i].id - base)) {
+            joining[j] = joining[j - 1];
+            j -= 1;
+        }
+        joining[j] = context->pending_joins[i];
+    }
+
+    for (size_t i = 0; i < n; i += 1) {
+        struct dht_message join_notify = {
+                .flags = NOTIFY,
+                .hash = 0,
+                .peer = (i + 1 < n) ? joining[i + 1] : self,
+        };
+        dht_send(&join_notify, &joining[i]);
+    }
+
+    if (peer_cmp(&predecessor, &self)) {
+        set_successor(&joining[0]);
+    } else if (peer_valid(&predecessor) && !peer_cmp(&predecessor, &joining[0])) {
+        struct dht_message notify = {
+                .flags = NOTIFY,
+                .hash = 0,
+                .peer = joining[0],
+        };
+        dht_send(&notify, &predecessor);
+    }
+    set_predecessor(&joining[n - 1]);
+}
 
-    dht_send(&join_notify, &(join->peer));
 
+void dht_flush(void) {
+    splice_joins();
+    outbox_flush();
 }
 
 
@@ -224,9 +943,11 @@ static void process_join(struct dht_message* join){
  */
 static void process_lookup(struct dht_message* lookup) {
     if (!peer_cmp(&successor, dht_responsible(lookup->hash))) {
+        context->counters.lookups_forwarded += 1;
         dht_send(lookup, &successor);
         return;
     }
+    context->counters.lookups_answered += 1;
 
     struct dht_message reply = {
         .flags = REPLY,
@@ -242,17 +963,28 @@ static void process_lookup(struct dht_message* lookup) {
 *
 * The information about the peer is entered into the the `lookup_cache`,
 * replacing a previous entry for the same hash, the first empty entry, or the
-* first outdated one, in this order.
+* first outdated one, in this order. A reply naming the successor of our
+* successor or one of its backups updates the next backup, too.
 */
 static void process_reply(const struct dht_message* reply) {
+    const unsigned long now = time_ms();
+    trace_event(TRACE_CACHE, reply->flags, reply->hash, &reply->peer, NULL);
+    PROBE3(lookup__complete, reply->hash, reply->peer.id, reply->peer.port);
+
+    const struct peer* previous = &successor;
+    for (size_t i = 0; i < N_BACKUP_SUCCESSORS && peer_valid(previous); i += 1) {
+        if (reply->hash == previous->id && !peer_cmp(previous, &self)) {
+            context->backups[i] = reply->peer;
+            break;
+        }
+        previous = &context->backups[i];
+    }
+
     // Try to replace existing value
     for (size_t i = 0; i < LOOKUP_CACHE_ENTRIES; i += 1) {
-        const bool peer_match = peer_cmp(&lookup_cache[i].peer, &reply->peer);
-        const bool more_recent = lookup_cache[i].entry < time_ms();
-
-        if (peer_match && more_recent) {
-            lookup_cache[i].entry = time_ms();
-            lookup_cache[i].predecessor = reply->hash;
+        if (peer_cmp(&context->lookup_cache[i].peer, &reply->peer)) {
+            context->lookup_cache[i].entry = now;
+            context->lookup_cache[i].predecessor = reply->hash;
             return;
         }
     }
@@ -260,7 +992,8 @@ static void process_reply(const struct dht_message* reply) {
     unsigned long oldest_time = ULONG_MAX;
     size_t oldest_idx = 0;
     for (size_t i = 0; i < LOOKUP_CACHE_ENTRIES; i += 1) {
-        if (lookup_cache[i].entry < oldest_time) {
+        if (context->lookup_cache[i].entry < oldest_time) {
+            oldest_time = context->lookup_cache[i].entry;
             oldest_idx = i;
         }
     }
@@ -268,9 +1001,9 @@ static void process_reply(const struct dht_message* reply) {
     // Since the table is zero-initialized, empty values are implicitly the
     // oldest ones. Moreover, any outdated value is older than any non-outdated
     // one, so no explicit check is required.
-    lookup_cache[oldest_idx].entry = time_ms();
-    lookup_cache[oldest_idx].predecessor = reply->hash;
-    lookup_cache[oldest_idx].peer = reply->peer;
+    context->lookup_cache[oldest_idx].entry = now;
+    context->lookup_cache[oldest_idx].predecessor = reply->hash;
+    context->lookup_cache[oldest_idx].peer = reply->peer;
 }
 
 
@@ -278,6 +1011,11 @@ static void process_reply(const struct dht_message* reply) {
  * Process an incoming DHT message
  */
 void dht_process_message(struct dht_message* msg) {
+    if (msg->flags < N_OPCODES) {
+        context->counters.received[msg->flags] += 1;
+    }
+    trace_event(TRACE_RECV, msg->flags, msg->hash, &msg->peer, &receiving_from);
+
     if (msg->flags == LOOKUP) {
         process_lookup(msg);
     } else if (msg->flags == REPLY) {
@@ -285,91 +1023,175 @@ void dht_process_message(struct dht_message* msg) {
     } else if (msg->flags == JOIN){
         process_join(msg);
     } else if (msg->flags == STABILIZE){
-        notify(msg);
+        process_stabilize(msg);
     } else if (msg->flags == NOTIFY){
-        succ_update(msg);
+        process_notify(msg);
     } else {
-        printf("Received invalid DHT Message\n");
+        context->counters.invalid += 1;
+        PROBE2(dht__invalid, msg->flags, sizeof *msg);
     }
 }
 
 
 /**
- * Receive a DHT message from the `dht_socket`
+ * Decode a message record's value, i.e., a legacy message without its flags
  */
-ssize_t dht_recv(struct dht_message* msg, struct sockaddr* address, socklen_t* address_length) {
-    ssize_t result = recvfrom(dht_socket, msg, sizeof(struct dht_message), 0, address, address_length);
+static void decode_message(uint8_t type, const uint8_t* value, struct dht_message* msg) {
+    msg->flags = type;
+    memcpy((uint8_t*) msg + 1, value, DHT_MESSAGE_VALUE_SIZE);
+    dht_deserialize(msg);
+}
+
+
+void dht_process_packet(const uint8_t* data, size_t length) {
+    struct dht_message msg;
+
+    if (length == sizeof(struct dht_message) && data[0] != DHT_PACKET_MAGIC) {
+        decode_message(data[0], data + 1, &msg);
+        dht_process_message(&msg);
+        return;
+    }
+
+    if (length < DHT_PACKET_HEADER_SIZE || data[0] != DHT_PACKET_MAGIC || data[1] != DHT_PACKET_VERSION) {
+        context->counters.invalid += 1;
+        PROBE2(dht__invalid, length > 0 ? data[0] : 0, length);
+        return;
+    }
+
+    const uint8_t* pos = data + DHT_PACKET_HEADER_SIZE;
+    const uint8_t* end = data + length;
+    while (pos < end) {
+        if (end - pos < DHT_RECORD_HEADER_SIZE || end - pos < DHT_RECORD_HEADER_SIZE + pos[1]) {
+            context->counters.invalid += 1;
+            PROBE2(dht__invalid, pos[0], length);
+            return;
+        }
+        const uint8_t type = pos[0];
+        const uint8_t record_length = pos[1];
+        const uint8_t* value = pos + DHT_RECORD_HEADER_SIZE;
+
+        if (type < N_OPCODES && record_length >= DHT_MESSAGE_VALUE_SIZE) {
+            decode_message(type, value, &msg);
+            dht_process_message(&msg);
+        } else if (type == DHT_RECORD_MEMBER && record_length >= DHT_MEMBER_VALUE_SIZE && context->one_hop) {
+            process_member(value);
+        }
+        // Unknown records are skipped
+
+        pos = value + record_length;
+    }
+}
+
+
+/**
+ * Receive a datagram from the `dht_socket`
+ */
+ssize_t dht_recv(uint8_t* buffer, size_t n, struct sockaddr* address, socklen_t* address_length) {
+    ssize_t result = recvfrom(dht_socket, buffer, n, 0, address, address_length);
     if (result < 0) {
 
         perror("recv");
         exit(EXIT_FAILURE);
     }
 
-    dht_deserialize(msg);
-
+    PROBE1(dht__recv, result);
     return result;
 }
 
 
-/**
- * Check whether the given peer is responsible for the given ID
- *
- * Note that this returning false does not imply the passed peer's predecessor is
- * responsible for the ID, this is not generally the case. 
- */
-static bool is_responsible(dht_id peer_predecessor, dht_id peer, dht_id id) {
-    // Gotta store differences explicitly as unsigned since C promotes them to signed otherwise...
-    const dht_id distance_peer_predecessor = peer_predecessor - id;
-    const dht_id distance_peer = peer - id;
-    return (peer_predecessor == peer) || (distance_peer < distance_peer_predecessor);
+struct peer* dht_responsible(dht_id id) {
+    return responsible_peer(id, true);
 }
 
 
-dht_id hash(const string str) {
-    uint8_t digest[SHA256_DIGEST_LENGTH];
-    SHA256((uint8_t*) str, strlen(str), digest);
-    return htons(*((dht_id*) digest));  // We only use the first two bytes here
+/**
+ * Append a ring view entry, if it fits
+ */
+static size_t ring_view_entry(uint8_t* buffer, size_t offset, size_t n, uint8_t role, dht_id from, const struct peer* peer) {
+    if (offset + sizeof(struct dht_message) > n) {
+        return offset;
+    }
+
+    struct dht_message entry = {
+        .flags = role,
+        .hash = from,
+        .peer = *peer,
+    };
+    encode_message(&entry, buffer + offset);
+    return offset + sizeof(struct dht_message);
 }
 
 
-struct peer* dht_responsible(dht_id id) {
-    if (is_responsible(predecessor.id, self.id, id)) {
-        return &self;
-    } else if (is_responsible(self.id, successor.id, id)) {
-        return &successor;
+size_t dht_ring_view(uint8_t* buffer, size_t n) {
+    if (n < RING_HEADER_SIZE) {
+        return 0;
     }
+    size_t offset = RING_HEADER_SIZE;
 
-    // Check for recent lookup replies that match the datum
+    if (peer_valid(&predecessor)) {
+        offset = ring_view_entry(buffer, offset, n, RING_SELF, predecessor.id, &self);
+    }
+    if (peer_valid(&successor) && !peer_cmp(&successor, &self)) {
+        offset = ring_view_entry(buffer, offset, n, RING_SUCCESSOR, self.id, &successor);
+    }
+    if (context->one_hop) {
+        for (size_t i = 0; i < context->n_members; i += 1) {
+            const dht_id from = context->members[(i + context->n_members - 1) % context->n_members].peer.id;
+            offset = ring_view_entry(buffer, offset, n, RING_MEMBER, from, &context->members[i].peer);
+        }
+    }
     for (size_t i = 0; i < LOOKUP_CACHE_ENTRIES; i += 1) {
-        const bool match = is_responsible(lookup_cache[i].predecessor, lookup_cache[i].peer.id, id);
-
-        if (match && !outdated(lookup_cache[i].entry)) {
-            return &lookup_cache[i].peer;
+        if (!outdated(context->lookup_cache[i].entry)) {
+            offset = ring_view_entry(buffer, offset, n, RING_CACHED, context->lookup_cache[i].predecessor, &context->lookup_cache[i].peer);
         }
     }
 
-    return NULL;
+    const uint16_t count = htons((offset - RING_HEADER_SIZE) / sizeof(struct dht_message));
+    memcpy(buffer, RING_MAGIC, 4);
+    buffer[4] = RING_VERSION;
+    buffer[5] = 0;
+    memcpy(buffer + 6, &count, sizeof count);
+    return offset;
 }
 
 
-
 void dht_lookup(dht_id id) {
+    if (!peer_valid(&successor)) {
+        return;  // Still joining, nobody to ask
+    }
+
     struct dht_message msg = {
         .flags = LOOKUP,
         .hash = id,
         .peer = self,
     };
+    context->counters.lookups_started += 1;
+    PROBE1(lookup__issue, id);
     dht_send(&msg, &successor);
 }
 
 
+const struct dht_counters* dht_counters(void) {
+    return &context->counters;
+}
+
+
+size_t dht_members(void) {
+    return context->n_members;
+}
+
+
 void dht_handle_socket(void) {
+    static uint8_t buffer[UINT16_MAX];
 
     struct sockaddr address = {0};
     socklen_t address_length = sizeof(struct sockaddr);
-    struct dht_message msg = {0};
-    dht_recv(&msg, &address, &address_length);
-    dht_process_message(&msg);
-
-
+    ssize_t length = dht_recv(buffer, sizeof buffer, &address, &address_length);
+    const struct sockaddr_in* sender = (const struct sockaddr_in*) &address;
+    receiving_from = (struct peer) {
+        .ip = { .s_addr = ntohl(sender->sin_addr.s_addr) },
+        .port = ntohs(sender->sin_port),
+    };
+    dht_process_packet(buffer, length);
+    receiving_from = (struct peer) {0};
 }
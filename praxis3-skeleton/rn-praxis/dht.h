@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <netinet/in.h>
 
@@ -58,6 +59,64 @@ struct __attribute__((packed)) dht_message {
     struct peer peer;
 };
 
+/**
+ * Container format for packing several messages into one datagram
+ *
+ * A legacy datagram consists of exactly one `struct dht_message`. A container
+ * starts with `DHT_PACKET_MAGIC` and a version byte, followed by a sequence of
+ * type-length-value records:
+ *
+ *   | magic (1) | version (1) | type (1) | length (1) | value (length) | ...
+ *
+ * Records with a type below `N_OPCODES` carry a message, their value is the
+ * legacy message without its leading `flags` byte. Trailing bytes of a known
+ * record and records of unknown types are skipped, so new record types and
+ * message extensions can be added without bumping the version.
+ */
+#define DHT_PACKET_MAGIC 0xD7
+#define DHT_PACKET_VERSION 1
+#define DHT_PACKET_HEADER_SIZE 2
+#define DHT_RECORD_HEADER_SIZE 2
+#define DHT_MESSAGE_VALUE_SIZE (sizeof(struct dht_message) - 1)
+
+/**
+ * Record carrying a gossiped membership entry for one-hop routing
+ *
+ * Its value is a peer description followed by the peer's 16 bit heartbeat,
+ * all in network byte order.
+ */
+#define DHT_RECORD_MEMBER 0x10
+#define DHT_MEMBER_VALUE_SIZE (sizeof(struct peer) + sizeof(uint16_t))
+
+/**
+ * Upper bound for containers we send, small enough to avoid IP fragmentation
+ */
+#define DHT_PACKET_MAX_SIZE 1400
+
+/**
+ * Binary description of a peer's view of the ring, as served at `/_ring`
+ *
+ *   | magic "RING" (4) | version (1) | reserved (1) | count (2) | entries ...
+ *
+ * Each entry is a `struct dht_message` in wire format: `flags` holds the
+ * entry's role, `peer` a peer known to the serving node, and `hash` the ID
+ * of that peer's predecessor. So every entry states that `peer` is
+ * responsible for the IDs in (`hash`, `peer.id`].
+ */
+#define RING_MAGIC "RING"
+#define RING_VERSION 1
+#define RING_HEADER_SIZE 8
+
+/**
+ * Roles of ring view entries
+ */
+enum {
+    RING_SELF,
+    RING_SUCCESSOR,
+    RING_MEMBER,
+    RING_CACHED,
+};
+
 /**
  * A description of our predecessor in the DHT
  *
@@ -80,8 +139,6 @@ extern struct peer self;
  */
 extern struct peer successor;
 
-extern struct peer anchor;
-
 /**
  * The socket used for communicating with the DHT
  */
@@ -101,6 +158,14 @@ dht_id hash(const string str);
  */
 struct peer* dht_responsible(dht_id id); 
 
+/**
+ * Serialize our view of the ring into `buffer`, see `RING_MAGIC`
+ *
+ * Returns the number of bytes written. Entries that do not fit into `n` bytes
+ * are omitted.
+ */
+size_t dht_ring_view(uint8_t* buffer, size_t n);
+
 /**
  * Derive an address for message transmission from a peer
  */
@@ -112,12 +177,130 @@ void peer_to_sockaddr(const struct peer* peer, struct sockaddr_in* addr);
 void dht_lookup(dht_id id);
 
 /**
- * Receive and process a DHT message
+ * Receive and process a DHT datagram
  */
 void dht_handle_socket(void);
 
-void send_join(const struct peer peer);
+/**
+ * Transmit all messages queued since the last flush
+ *
+ * Messages are not sent right away but collected per destination, so that
+ * everything addressed to the same peer leaves in one datagram. A single
+ * message is sent in the legacy format, multiple ones in a container.
+ */
+void dht_flush(void);
+
+/**
+ * Set up the protocol's periodic activities
+ *
+ * Without `enable_stabilize`, the neighborhood is only changed by incoming
+ * messages, which is useful for static rings. With `enable_one_hop`, peers
+ * gossip the complete ring membership while stabilizing and
+ * `dht_responsible()` answers from it, so lookups are never required. This
+ * is meant for small rings of up to a few hundred peers.
+ */
+void dht_init(bool enable_stabilize, bool enable_one_hop);
+
+/**
+ * Return the time of the next periodic protocol activity, see `timer.h`
+ */
+unsigned long dht_deadline(void);
+
+/**
+ * Perform due periodic protocol activities
+ */
+void dht_tick(void);
+
+/**
+ * Join an existing DHT via the given anchors
+ *
+ * Only the anchors' addresses are used, their IDs need not be known. Joins
+ * are sent to all anchors at once and repeated with increasing delay until
+ * some peer notifies us of our successor.
+ */
+void dht_join(const struct peer* anchors, size_t n_anchors);
 void dht_process_message(struct dht_message* msg);
-ssize_t dht_recv(struct dht_message* msg, struct sockaddr* address, socklen_t* address_length);
+
+/**
+ * The protocol state of a single peer, opaque outside of `dht.c`
+ */
+struct dht_context;
+
+/**
+ * Create the state of another peer, e.g., for simulations
+ *
+ * The context starts out like a freshly started process: no neighborhood
+ * and nothing scheduled. It is set up via the usual functions, such as
+ * `dht_init()` and `dht_join()`, after switching to it.
+ */
+struct dht_context* dht_context_new(void);
+
+/**
+ * Make the given context the one all other functions operate on
+ *
+ * `predecessor`, `self` and `successor` are saved into the previous context
+ * and loaded from the given one. NULL switches back to the context the
+ * process started with.
+ */
+void dht_context_switch(struct dht_context* context);
+
+/**
+ * Function transmitting a datagram to the given address
+ */
+typedef void (*dht_transport)(const uint8_t* data, size_t length, const struct sockaddr_in* addr);
+
+/**
+ * Replace how datagrams are transmitted, NULL restores sending via `dht_socket`
+ */
+void dht_set_transport(dht_transport transport);
+
+/**
+ * Counters of a peer's protocol activity, see `dht_counters()`
+ *
+ * `received`, `sent`: messages by opcode, regardless of their encoding
+ * `invalid`: datagrams and records that could not be decoded
+ * `cache_hits`, `cache_misses`: `dht_responsible()` calls that had to
+ *                consult the lookup cache, and whether it knew the answer
+ * `lookups_started`: lookups we originated
+ * `lookups_forwarded`, `lookups_answered`: lookups of others we passed on to
+ *                our successor or replied to. Every forward is one hop of
+ *                somebody's lookup.
+ * `successor_failures`, `predecessor_failures`: neighbors dropped as they
+ *                stopped taking part in stabilization
+ */
+struct dht_counters {
+    uint64_t received[N_OPCODES];
+    uint64_t sent[N_OPCODES];
+    uint64_t invalid;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t lookups_started;
+    uint64_t lookups_forwarded;
+    uint64_t lookups_answered;
+    uint64_t successor_failures;
+    uint64_t predecessor_failures;
+};
+
+/**
+ * Return the counters of the current context
+ */
+const struct dht_counters* dht_counters(void);
+
+/**
+ * Return the number of peers known for one-hop routing
+ */
+size_t dht_members(void);
+
+/**
+ * Process all messages contained in a datagram, legacy or container
+ */
+void dht_process_packet(const uint8_t* data, size_t length);
+
+ssize_t dht_recv(uint8_t* buffer, size_t n, struct sockaddr* address, socklen_t* address_length);
+
+/**
+ * Start a stabilization round by querying our successor for its predecessor
+ *
+ * Never blocks; the reply is handled as notify by `dht_process_message()`.
+ */
 void stabilize(void);
-unsigned long time_ms(void);
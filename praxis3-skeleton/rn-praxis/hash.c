@@ -0,0 +1,16 @@
+/**
+* hash.c maps strings onto the DHT's ID space. It is shared by peers and clients, so both agree on the responsible peer.
+*/
+
+#include "dht.h"
+
+#include <string.h>
+
+#include <openssl/sha.h>
+
+
+dht_id hash(const string str) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((uint8_t*) str, strlen(str), digest);
+    return htons(*((dht_id*) digest));  // We only use the first two bytes here
+}
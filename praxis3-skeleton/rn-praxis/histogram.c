@@ -0,0 +1,108 @@
+/**
+* histogram.c records latencies and other values into log-linear histograms, see `histogram.h`.
+*/
+
+#include "histogram.h"
+
+#include <string.h>
+
+
+/**
+ * Map a value to its slot
+ *
+ * The first two buckets' worth of values map onto themselves. Above, a value
+ * shifted right until it has `HISTOGRAM_SUB_BUCKET_BITS + 1` bits selects the
+ * slot within the bucket given by the shift.
+ */
+static size_t slot_of(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    const unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return ((size_t) shift << HISTOGRAM_SUB_BUCKET_BITS) + (value >> shift);
+}
+
+
+/**
+ * Return the highest value mapped to the given slot
+ */
+static uint64_t slot_highest(size_t slot) {
+    if (slot < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return slot;
+    }
+    const unsigned int shift = (slot >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    const uint64_t sub = slot - ((size_t) shift << HISTOGRAM_SUB_BUCKET_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+
+void histogram_init(struct histogram* histogram) {
+    memset(histogram, 0, sizeof *histogram);
+    histogram->min = UINT64_MAX;
+}
+
+
+void histogram_record(struct histogram* histogram, uint64_t value) {
+    histogram->counts[slot_of(value)] += 1;
+    histogram->total += 1;
+    histogram->sum += value;
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+
+void histogram_record_corrected(struct histogram* histogram, uint64_t value, uint64_t interval) {
+    histogram_record(histogram, value);
+    if (interval == 0) {
+        return;
+    }
+    for (uint64_t missed = value; missed > interval; ) {
+        missed -= interval;
+        histogram_record(histogram, missed);
+    }
+}
+
+
+void histogram_merge(struct histogram* histogram, const struct histogram* other) {
+    for (size_t i = 0; i < HISTOGRAM_SLOTS; i += 1) {
+        histogram->counts[i] += other->counts[i];
+    }
+    histogram->total += other->total;
+    histogram->sum += other->sum;
+    if (other->min < histogram->min) {
+        histogram->min = other->min;
+    }
+    if (other->max > histogram->max) {
+        histogram->max = other->max;
+    }
+}
+
+
+uint64_t histogram_percentile(const struct histogram* histogram, double percentile) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (percentile / 100 * histogram->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_SLOTS; i += 1) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            const uint64_t highest = slot_highest(i);
+            return (highest < histogram->max) ? highest : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+double histogram_mean(const struct histogram* histogram) {
+    return histogram->total ? histogram->sum / histogram->total : 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Values below `2 * HISTOGRAM_SUB_BUCKETS` are counted exactly, larger ones
+ * with a relative error below 1 / `HISTOGRAM_SUB_BUCKETS`
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_SLOTS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+
+/**
+ * A log-linear histogram in the style of HdrHistogram
+ *
+ * Values are split into buckets by their highest set bit, each of which is
+ * divided linearly into `HISTOGRAM_SUB_BUCKETS` slots. Recording is a few
+ * shifts and an increment, the memory needed is fixed and histograms of
+ * several threads or processes can be merged by adding their counts.
+ */
+struct histogram {
+    uint64_t counts[HISTOGRAM_SLOTS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+};
+
+/**
+ * Reset all counts of the histogram
+ */
+void histogram_init(struct histogram* histogram);
+
+/**
+ * Count a single value
+ */
+void histogram_record(struct histogram* histogram, uint64_t value);
+
+/**
+ * Count a value measured by a closed loop expecting one sample every `interval`
+ *
+ * A value exceeding the interval means the samples that should have been
+ * taken meanwhile were delayed too. These are recorded as well, with values
+ * decreasing by `interval`, which corrects the coordinated omission of slow
+ * samples. Zero disables the correction.
+ */
+void histogram_record_corrected(struct histogram* histogram, uint64_t value, uint64_t interval);
+
+/**
+ * Add all counts of `other` to `histogram`
+ */
+void histogram_merge(struct histogram* histogram, const struct histogram* other);
+
+/**
+ * Return the value below or at which the given percentage of values lies
+ *
+ * The result is the highest value equivalent to the slot reached, so it
+ * never underestimates. Returns zero for empty histograms.
+ */
+uint64_t histogram_percentile(const struct histogram* histogram, double percentile);
+
+/**
+ * Return the mean of all values, or zero for empty histograms
+ */
+double histogram_mean(const struct histogram* histogram);
@@ -3,11 +3,13 @@
 */
 
 #include "http.h"
+#include "probes.h"
 
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 
 /**
@@ -65,15 +67,118 @@ static bool parse_header(char* buffer, size_t n, struct non_string* key, struct
         .start = buffer,
         .n = field_name_end - buffer
     };
+    // Strip optional whitespace around the value
+    char* value_start = field_name_end + 1;
+    char* value_end = buffer + n;
+    while (value_start < value_end && (*value_start == ' ' || *value_start == '\t')) {
+        value_start += 1;
+    }
+    while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end -= 1;
+    }
     *value = (struct non_string) {
-        .start = field_name_end + 1,
-        .n = (buffer + n) - (field_name_end + 1)
+        .start = value_start,
+        .n = value_end - value_start
     };
 
     return true;
 }
 
 
+/**
+ * Names of the well-known headers, indexed by `enum http_header`
+ */
+static const struct fragment known_header_names[N_KNOWN_HEADERS] = {
+    [HEADER_CONTENT_LENGTH] = FRAGMENT("Content-Length"),
+    [HEADER_CONNECTION] = FRAGMENT("Connection"),
+    [HEADER_HOST] = FRAGMENT("Host"),
+    [HEADER_IF_NONE_MATCH] = FRAGMENT("If-None-Match"),
+    [HEADER_RANGE] = FRAGMENT("Range"),
+    [HEADER_TRANSFER_ENCODING] = FRAGMENT("Transfer-Encoding"),
+    [HEADER_EXPECT] = FRAGMENT("Expect"),
+};
+
+
+/**
+ * Determine which well-known header a name refers to
+ *
+ * The names' lengths are distinct, so a single case-insensitive comparison
+ * decides. Returns `N_KNOWN_HEADERS` for other headers.
+ */
+static enum http_header classify_header(const char* name, size_t n) {
+    enum http_header candidate;
+    switch (n) {
+        case 14: candidate = HEADER_CONTENT_LENGTH; break;
+        case 10: candidate = HEADER_CONNECTION; break;
+        case 4: candidate = HEADER_HOST; break;
+        case 13: candidate = HEADER_IF_NONE_MATCH; break;
+        case 5: candidate = HEADER_RANGE; break;
+        case 17: candidate = HEADER_TRANSFER_ENCODING; break;
+        case 6: candidate = HEADER_EXPECT; break;
+        default: return N_KNOWN_HEADERS;
+    }
+    return (strncasecmp(name, known_header_names[candidate].data, n) == 0) ? candidate : N_KNOWN_HEADERS;
+}
+
+
+/**
+ * Parse a decimal number without reading past the end of `digits`
+ *
+ * Returns -1 unless `digits` is a non-negative number, optionally surrounded
+ * by spaces.
+ */
+static ssize_t parse_length(struct non_string digits) {
+    const char* pos = digits.start;
+    const char* end = digits.start + digits.n;
+    while (pos < end && *pos == ' ') {
+        pos += 1;
+    }
+    if (pos == end || !isdigit((unsigned char) *pos)) {
+        return -1;
+    }
+
+    ssize_t result = 0;
+    while (pos < end && isdigit((unsigned char) *pos)) {
+        if (result > (HTTP_MAX_REQUEST_SIZE - (*pos - '0')) / 10) {
+            return -1;  // Larger than any request we accept anyway
+        }
+        result = result * 10 + (*pos - '0');
+        pos += 1;
+    }
+    while (pos < end && *pos == ' ') {
+        pos += 1;
+    }
+    return (pos == end) ? result : -1;
+}
+
+
+/**
+ * Determine the method of a request
+ */
+static enum http_method parse_method(struct non_string method) {
+    switch (method.n) {
+        case 3:
+            if (memcmp(method.start, "GET", 3) == 0) {
+                return HTTP_GET;
+            } else if (memcmp(method.start, "PUT", 3) == 0) {
+                return HTTP_PUT;
+            }
+            break;
+        case 4:
+            if (memcmp(method.start, "POST", 4) == 0) {
+                return HTTP_POST;
+            }
+            break;
+        case 6:
+            if (memcmp(method.start, "DELETE", 6) == 0) {
+                return HTTP_DELETE;
+            }
+            break;
+    }
+    return HTTP_OTHER;
+}
+
+
 ssize_t parse_request(char* buffer, size_t n, struct request* request) {
     char* line_separator = "\r\n";
 
@@ -93,45 +198,59 @@ ssize_t parse_request(char* buffer, size_t n, struct request* request) {
 
     pos = line_end + strlen(line_separator);  // Skip line separator
 
-    // Parse headers
+    // Parse headers, sorting well-known ones into their slots
+    struct non_string known[N_KNOWN_HEADERS] = {0};
     struct {
         struct non_string key;
         struct non_string value;
-    } headers[HTTP_MAX_HEADERS] = {0};
+    } headers[HTTP_MAX_HEADERS];
     size_t header_count = 0;
 
     while ((line_end = memstr(pos, end - pos, line_separator)) != pos) {
-        if (header_count > HTTP_MAX_HEADERS) {
-            fprintf(stderr, "Exceeded max header count.\n");
-            exit(EXIT_FAILURE);
-        }
         if (!line_end) {
             return 0; // Header not fully received
         }
-        if (!parse_header(pos, line_end - pos, &(headers[header_count].key), &(headers[header_count].value))) {
+        struct non_string key;
+        struct non_string value;
+        if (!parse_header(pos, line_end - pos, &key, &value)) {
             return -1; // Error parsing header
         }
         pos = line_end + strlen(line_separator);  // Skip line separator
-        header_count += 1;
+
+        const enum http_header header = classify_header(key.start, key.n);
+        if (header == HEADER_CONTENT_LENGTH && known[header].start) {
+            return -1; // Conflicting message lengths
+        } else if (header != N_KNOWN_HEADERS) {
+            if (!known[header].start) {
+                known[header] = value;  // The first occurrence counts
+            }
+        } else if (header_count == HTTP_MAX_HEADERS) {
+            return -1; // Exceeded max header count
+        } else {
+            headers[header_count].key = key;
+            headers[header_count].value = value;
+            header_count += 1;
+        }
     }
 
     pos = line_end + strlen(line_separator);  // Skip empty line
 
-    // Parse payload length from headers
-    for (size_t i = 0; i < header_count; i += 1) {
-        if (strncmp(headers[i].key.start, "Content-Length", headers[i].key.n) == 0) {
-            request->payload_length = strtoul(headers[i].value.start, NULL, 10);
-            break;
-        }
+    // Parse payload length. Only the received bytes are looked at, the
+    // buffer may hold stale data of earlier requests past them.
+    request->payload_length = -1;
+    if (known[HEADER_CONTENT_LENGTH].start
+        && (request->payload_length = parse_length(known[HEADER_CONTENT_LENGTH])) == -1) {
+        return -1; // Malformed Content-Length
     }
+    const enum http_method method_id = parse_method(method);
     if (request->payload_length < 0) {
-        if (request->method && strncmp(request->method, "PUT", strlen("PUT")) == 0) {
+        if (method_id == HTTP_PUT) {
             return -1; // Content-Length non-optional on PUT-requests
         }
         request->payload_length = 0;
     }
     request->payload = pos;
-    if  (pos + request->payload_length > end) {
+    if  (request->payload_length > end - pos) {
         return 0;  // Payload not yet received completely, try again.
     }
 
@@ -142,9 +261,18 @@ ssize_t parse_request(char* buffer, size_t n, struct request* request) {
 
     method.start[method.n] = '\0';
     request->method = method.start;
+    request->method_id = method_id;
 
     uri.start[uri.n] = '\0';
     request->uri = uri.start;
+    request->uri_length = uri.n;
+
+    for (size_t i = 0; i < N_KNOWN_HEADERS; i += 1) {
+        if (known[i].start) {
+            known[i].start[known[i].n] = '\0';
+        }
+        request->known_headers[i] = known[i].start;
+    }
 
     for (size_t i = 0; i < header_count; i += 1) {
         headers[i].key.start[headers[i].key.n] = '\0';
@@ -153,17 +281,95 @@ ssize_t parse_request(char* buffer, size_t n, struct request* request) {
         headers[i].value.start[headers[i].value.n] = '\0';
         request->headers[i].value = headers[i].value.start;
     }
+    request->n_headers = header_count;
 
+    PROBE3(parse__done, request->method_id, request->uri, request->payload_length);
     return (pos + request->payload_length) - buffer;  // Parsed until `pos`
 }
 
 
 string get_header(const struct request* request, const string name) {
-    for (size_t i = 0; i < HTTP_MAX_HEADERS; i += 1) {
-        if (request->headers[i].key && strcmp(request->headers[i].key, name) == 0) {
+    const enum http_header header = classify_header(name, strlen(name));
+    if (header != N_KNOWN_HEADERS) {
+        return request->known_headers[header];
+    }
+
+    for (size_t i = 0; i < request->n_headers; i += 1) {
+        if (strcasecmp(request->headers[i].key, name) == 0) {
             return request->headers[i].value;
         }
     }
     return NULL; // Header not found
 }
 
+
+// Status lines and heads of bodiless responses, rendered at compile time
+#define EMPTY "Content-Length: 0\r\n"
+#define STATUSES(X) \
+    X(200, "200 OK", EMPTY) \
+    X(201, "201 Created", EMPTY) \
+    X(202, "202 Accepted", EMPTY) \
+    X(204, "204 No Content", "") \
+    X(303, "303 See Other", EMPTY) \
+    X(400, "400 Bad Request", EMPTY) \
+    X(404, "404 Not Found", EMPTY) \
+    X(405, "405 Method Not Allowed", EMPTY) \
+    X(413, "413 Payload Too Large", EMPTY) \
+    X(414, "414 URI Too Long", EMPTY) \
+    X(421, "421 Misdirected Request", EMPTY) \
+    X(500, "500 Internal Server Error", EMPTY) \
+    X(501, "501 Method Not Supported", EMPTY) \
+    X(503, "503 Service Unavailable", "Retry-After: 1\r\n" EMPTY)
+
+#define STATUS_LINE(code, text, headers) [STATUS_##code] = FRAGMENT("HTTP/1.1 " text "\r\n"),
+#define EMPTY_REPLY(code, text, headers) [STATUS_##code] = FRAGMENT("HTTP/1.1 " text "\r\n" headers "\r\n"),
+#define STATUS_INDEX(code, text, headers) STATUS_##code,
+
+enum { STATUSES(STATUS_INDEX) N_STATUSES };
+
+static const struct fragment status_lines[N_STATUSES] = { STATUSES(STATUS_LINE) };
+static const struct fragment empty_replies[N_STATUSES] = { STATUSES(EMPTY_REPLY) };
+
+
+/**
+ * Map a status code to its index in the tables
+ */
+static size_t status_index(int status) {
+    switch (status) {
+#define STATUS_CASE(code, text, headers) case code: return STATUS_##code;
+        STATUSES(STATUS_CASE)
+#undef STATUS_CASE
+        default: return STATUS_500;
+    }
+}
+
+
+const struct fragment* http_status_line(int status) {
+    return &status_lines[status_index(status)];
+}
+
+
+const struct fragment* http_empty_reply(int status) {
+    return &empty_replies[status_index(status)];
+}
+
+
+size_t http_content_length(char* out, size_t length) {
+    static const char prefix[] = "Content-Length: ";
+    memcpy(out, prefix, sizeof prefix - 1);
+    char* pos = out + sizeof prefix - 1;
+
+    // Render the digits backwards, then move them in place
+    char digits[20];
+    size_t n_digits = 0;
+    do {
+        digits[sizeof digits - 1 - n_digits] = '0' + length % 10;
+        length /= 10;
+        n_digits += 1;
+    } while (length > 0);
+    memcpy(pos, digits + sizeof digits - n_digits, n_digits);
+    pos += n_digits;
+
+    memcpy(pos, "\r\n\r\n", 4);
+    return pos + 4 - out;
+}
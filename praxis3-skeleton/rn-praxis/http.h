@@ -3,9 +3,11 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include "ring_buffer.h"
 #include "util.h"
 
 #define HTTP_MAX_SIZE 8192
+#define HTTP_MAX_REQUEST_SIZE (16 << 20)
 #define HTTP_MAX_HEADERS 40
 
 
@@ -18,32 +20,80 @@ struct header {
 };
 
 
+/**
+ * Request methods we distinguish, anything else is `HTTP_OTHER`
+ */
+enum http_method {
+    HTTP_GET,
+    HTTP_PUT,
+    HTTP_DELETE,
+    HTTP_POST,
+    HTTP_OTHER,
+};
+
+
+/**
+ * Headers detected while parsing, available via `request_header()`
+ */
+enum http_header {
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONNECTION,
+    HEADER_HOST,
+    HEADER_IF_NONE_MATCH,
+    HEADER_RANGE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    N_KNOWN_HEADERS,
+};
+
+
 /**
  * Representation of a HTTP request
+ *
+ * `method_id` is determined once while parsing, so dispatching on it does not
+ * require string comparisons. Likewise, the values of well-known headers are
+ * stored in `known_headers`, indexed by `enum http_header`, or NULL if
+ * absent. The first `n_headers` entries of `headers` hold all other headers.
+ * Header values are stripped of surrounding whitespace.
  */
 struct request {
     string method;
+    enum http_method method_id;
     string uri;
+    size_t uri_length;
+    string known_headers[N_KNOWN_HEADERS];
     struct header headers[HTTP_MAX_HEADERS];
+    size_t n_headers;
     char* payload;
     ssize_t payload_length;
 };
 
 
+struct batch;
+
+
 /**
  * The state of an ongoing HTTP connection
  *
  * `sock`: the socket connected to the client
- * `buffer`: buffer for the raw received data
- * `end`: end of unprocessed data in `buffer`
+ * `input`: ring buffer for the raw received data, holding `HTTP_MAX_SIZE`
+ *          bytes unless a larger request required growing it, up to
+ *          `HTTP_MAX_REQUEST_SIZE`
  * `current_request`: current, complete request, not yet answered to. Reuses
- *                    memory of `buffer`.
+ *                    memory of `input`.
+ * `output`: replies not sent yet
+ * `batch`: batch whose response is still being streamed, further requests
+ *          are answered once it completes
+ * `wal_wait`: the write-ahead log record that must be committed before
+ *             `output` may be sent, see `wal.h`
  */
 struct connection_state {
     int sock;
-    char buffer[HTTP_MAX_SIZE];
-    char* end;
+    struct ring_buffer input;
     struct request current_request;
+    struct buffer output;
+    struct batch* batch;
+    uint64_t wal_wait;
 };
 
 /**
@@ -52,11 +102,57 @@ struct connection_state {
  * When a full request is read, `request` is populated with its corresponding
  * values, utilizing the existing memory in `buffer`, and the number of bytes
  * read is returned. Otherwise, `buffer` remains unchanged, and zero is
- * returned.
+ * returned, or -1 if the request is malformed. Only the first `n` bytes of
+ * `buffer` are accessed, whatever follows them is irrelevant.
  */
 ssize_t parse_request(char* buffer, size_t n, struct request* request);
 
+/**
+ * A pre-serialized part of a response
+ */
+struct fragment {
+    const char* data;
+    size_t length;
+};
+
+#define FRAGMENT(literal) { literal, sizeof literal - 1 }
+
+/**
+ * Return the status line for the given status, including the line separator
+ *
+ * Unknown statuses yield the line of 500 Internal Server Error.
+ */
+const struct fragment* http_status_line(int status);
+
+/**
+ * Return the complete head of a response without body for the given status
+ *
+ * Includes all headers such a response needs, e.g., `Retry-After` for 503.
+ * Unknown statuses yield the head of 500 Internal Server Error.
+ */
+const struct fragment* http_empty_reply(int status);
+
+/**
+ * Write the `Content-Length` header and the empty line ending the head
+ *
+ * `out` must have room for `HTTP_CONTENT_LENGTH_SIZE` bytes. Returns the
+ * number of bytes written.
+ */
+size_t http_content_length(char* out, size_t length);
+
+#define HTTP_CONTENT_LENGTH_SIZE (sizeof "Content-Length: 18446744073709551615\r\n\r\n" - 1)
+
+/**
+ * Get value of a well-known header in request if set, or NULL.
+ */
+static inline string request_header(const struct request* request, enum http_header header) {
+    return request->known_headers[header];
+}
+
 /**
  * Get value of header in request if set, or NULL.
+ *
+ * Header names are compared case-insensitively. Prefer `request_header()` for
+ * well-known headers.
  */
 string get_header(const struct request* request, const string name);
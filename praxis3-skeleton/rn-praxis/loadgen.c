@@ -0,0 +1,605 @@
+/**
+* loadgen.c generates HTTP load against a ring over many keep-alive connections, recording latencies into histograms.
+*
+* Call as:
+*
+*  ./build/loadgen [options] contact.ip contact.port
+*
+*  -c connections  connections per peer (default 16)
+*  -d depth        requests pipelined per connection (default 1)
+*  -t seconds      duration of the run (default 10)
+*  -R rate         total requests per second, 0 for a closed loop (default 0)
+*  -k keys         number of distinct keys (default 10000)
+*  -z exponent     Zipfian key distribution with the given exponent, 0 for
+*                  uniform (default 0)
+*  -m get:put:del  ratio of the operations (default 90:9:1)
+*  -s size         size of PUT payloads in bytes (default 64)
+*  -r              route requests via the ring instead of following 303s
+*  -j              print the results as a single JSON object
+*
+* Without a rate, `connections * depth` requests are kept outstanding per
+* peer, each one sent as soon as another completes. With a rate, requests
+* are scheduled at fixed intervals and their latency is measured from the
+* time they were due, not from when they could actually be sent, so a
+* stalling peer shows in the latencies instead of only lowering the load.
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "histogram.h"
+
+#define LOADGEN_MAX_DEPTH 256
+#define LOADGEN_MAX_TARGETS CLIENT_MAX_RANGES
+#define LOADGEN_MAX_HOPS 8
+#define LOADGEN_RECV_SIZE (64 << 10)
+
+
+/**
+ * A request from being generated until its final response
+ *
+ * `intended` is the time the request was due, `sent` the time it was last
+ * sent, which differs after redirects and while it waited for a connection.
+ */
+struct load_request {
+    uint32_t key;
+    uint8_t op;
+    uint8_t hops;
+    uint64_t intended;
+    uint64_t sent;
+};
+
+
+/**
+ * A keep-alive connection with requests pipelined on it, answered in order
+ */
+struct load_connection {
+    int sock;
+    struct buffer out;
+    size_t out_sent;
+    struct buffer in;
+    struct load_request pipeline[LOADGEN_MAX_DEPTH];
+    size_t head;
+    size_t n_pipelined;
+};
+
+
+/**
+ * A peer requests are sent to, with its connections and the requests
+ * waiting for one of them to become available
+ */
+struct target {
+    struct peer peer;
+    struct load_connection* connections;
+    struct load_request* queue;
+    size_t queue_head;
+    size_t queue_length;
+};
+
+
+enum { OP_GET, OP_PUT, OP_DELETE };
+static const string op_methods[] = { "GET", "PUT", "DELETE" };
+
+// Options
+static size_t connections_per_target = 16;
+static size_t depth = 1;
+static double duration_s = 10;
+static double rate = 0;
+static uint32_t n_keys = 10000;
+static double zipf_exponent = 0;
+static unsigned int mix[3] = { 90, 9, 1 };
+static size_t value_size = 64;
+static bool route = false;
+static bool json = false;
+
+static struct client client;
+static struct target targets[LOADGEN_MAX_TARGETS];
+static size_t n_targets = 0;
+static size_t queue_capacity;
+
+static char* payload;
+static double* zipf_cdf;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// Results
+static struct histogram latency;
+static struct histogram service_time;
+static unsigned long statuses[6];
+static unsigned long hops[LOADGEN_MAX_HOPS + 1];
+static unsigned long errors = 0;
+static unsigned long completed = 0;
+
+
+static uint64_t now_ns(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return 1000000000ULL * spec.tv_sec + spec.tv_nsec;
+}
+
+
+/**
+ * Return a uniformly distributed random number (xorshift64*)
+ */
+static uint64_t random_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+
+static double random_unit(void) {
+    return (random_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+
+/**
+ * Precompute the cumulative distribution of Zipf's law over the keys
+ */
+static void zipf_init(void) {
+    zipf_cdf = malloc(n_keys * sizeof(double));
+    double sum = 0;
+    for (uint32_t i = 0; i < n_keys; i += 1) {
+        sum += 1 / pow(i + 1, zipf_exponent);
+        zipf_cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < n_keys; i += 1) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+
+static uint32_t random_key(void) {
+    if (zipf_exponent == 0) {
+        return random_next() % n_keys;
+    }
+
+    const double u = random_unit();
+    uint32_t low = 0;
+    uint32_t high = n_keys - 1;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (zipf_cdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+static uint8_t random_op(void) {
+    const unsigned int r = random_next() % (mix[0] + mix[1] + mix[2]);
+    return (r < mix[0]) ? OP_GET : (r < mix[0] + mix[1]) ? OP_PUT : OP_DELETE;
+}
+
+
+static int key_uri(uint32_t key, char* uri, size_t n) {
+    return snprintf(uri, n, "/loadgen/%08x", key);
+}
+
+
+/**
+ * Return the target of the given peer, creating it if necessary
+ */
+static struct target* target_get(const struct peer* peer) {
+    for (size_t i = 0; i < n_targets; i += 1) {
+        if (targets[i].peer.ip.s_addr == peer->ip.s_addr && targets[i].peer.port == peer->port) {
+            return &targets[i];
+        }
+    }
+    if (n_targets == LOADGEN_MAX_TARGETS) {
+        return NULL;
+    }
+
+    struct target* target = &targets[n_targets];
+    n_targets += 1;
+    *target = (struct target) {
+        .peer = *peer,
+        .connections = calloc(connections_per_target, sizeof(struct load_connection)),
+        .queue = malloc(queue_capacity * sizeof(struct load_request)),
+    };
+    for (size_t i = 0; i < connections_per_target; i += 1) {
+        target->connections[i].sock = -1;
+    }
+    return target;
+}
+
+
+/**
+ * Count a request as failed
+ */
+static void request_fail(void) {
+    errors += 1;
+    completed += 1;
+}
+
+
+/**
+ * Close a connection, failing all requests pipelined on it
+ */
+static void connection_close(struct load_connection* connection) {
+    close(connection->sock);
+    connection->sock = -1;
+    for (size_t i = 0; i < connection->n_pipelined; i += 1) {
+        request_fail();
+    }
+    connection->n_pipelined = 0;
+    connection->head = 0;
+    connection->out.length = 0;
+    connection->out_sent = 0;
+    connection->in.length = 0;
+}
+
+
+/**
+ * Append a request to a connection's pipeline and its output
+ */
+static void connection_send(struct load_connection* connection, struct load_request* request) {
+    char uri[32];
+    key_uri(request->key, uri, sizeof uri);
+    const size_t length = (request->op == OP_PUT) ? value_size : 0;
+
+    char head[128];
+    const int head_length = snprintf(head, sizeof head, "%s %s HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+                                     op_methods[request->op], uri, length);
+    memcpy(buffer_append(&connection->out, head_length), head, head_length);
+    if (length > 0) {
+        memcpy(buffer_append(&connection->out, length), payload, length);
+    }
+
+    request->sent = now_ns();
+    connection->pipeline[(connection->head + connection->n_pipelined) % LOADGEN_MAX_DEPTH] = *request;
+    connection->n_pipelined += 1;
+}
+
+
+/**
+ * Send a request to the target, or queue it until a connection is available
+ *
+ * The least busy open connection is used, a closed one is opened only if
+ * all open ones have a full pipeline.
+ */
+static void target_submit(struct target* target, struct load_request* request) {
+    struct load_connection* best = NULL;
+    struct load_connection* closed = NULL;
+    for (size_t i = 0; i < connections_per_target; i += 1) {
+        struct load_connection* connection = &target->connections[i];
+        if (connection->sock == -1) {
+            closed = closed ? closed : connection;
+        } else if (connection->n_pipelined < depth && (!best || connection->n_pipelined < best->n_pipelined)) {
+            best = connection;
+        }
+    }
+
+    if ((!best || best->n_pipelined > 0) && closed) {
+        closed->sock = client_connect(&target->peer);
+        if (closed->sock != -1) {
+            fcntl(closed->sock, F_SETFL, O_NONBLOCK);
+            best = closed;
+        }
+    }
+
+    if (best) {
+        connection_send(best, request);
+    } else if (target->queue_length < queue_capacity) {
+        target->queue[(target->queue_head + target->queue_length) % queue_capacity] = *request;
+        target->queue_length += 1;
+    } else {
+        request_fail();
+    }
+}
+
+
+/**
+ * Send a request to the peer responsible for its key, or the contact
+ */
+static void dispatch(struct load_request* request) {
+    const struct peer* peer = &client.contact;
+    if (route) {
+        char uri[32];
+        key_uri(request->key, uri, sizeof uri);
+        const struct peer* responsible = client_route(&client, hash(uri));
+        peer = responsible ? responsible : peer;
+    }
+
+    struct target* target = target_get(peer);
+    if (target) {
+        target_submit(target, request);
+    } else {
+        request_fail();
+    }
+}
+
+
+/**
+ * Handle the response to the oldest request pipelined on a connection
+ */
+static void complete(struct load_connection* connection, const struct client_response* response) {
+    struct load_request request = connection->pipeline[connection->head];
+    connection->head = (connection->head + 1) % LOADGEN_MAX_DEPTH;
+    connection->n_pipelined -= 1;
+
+    if (response->status == 303 && response->location && request.hops < LOADGEN_MAX_HOPS) {
+        struct peer peer;
+        if (client_peer_from_url(response->location, &peer)) {
+            struct target* target = target_get(&peer);
+            if (target) {
+                request.hops += 1;
+                target_submit(target, &request);
+                return;
+            }
+        }
+    }
+
+    const uint64_t now = now_ns();
+    const uint64_t service = now - request.sent;
+    histogram_record(&service_time, service);
+    if (rate > 0) {
+        histogram_record(&latency, now - request.intended);
+    } else {
+        // A closed loop issues requests at the pace they complete
+        histogram_record_corrected(&latency, now - request.intended, histogram_mean(&service_time));
+    }
+
+    const int class = response->status / 100;
+    statuses[(class >= 1 && class <= 5) ? class : 0] += 1;
+    hops[request.hops] += 1;
+    completed += 1;
+}
+
+
+/**
+ * Process the responses received on a connection, then refill it from the queue
+ */
+static void connection_receive(struct target* target, struct load_connection* connection) {
+    if (connection->in.capacity - connection->in.length < LOADGEN_RECV_SIZE) {
+        buffer_append(&connection->in, LOADGEN_RECV_SIZE);
+        connection->in.length -= LOADGEN_RECV_SIZE;
+    }
+    const ssize_t received = recv(connection->sock, connection->in.data + connection->in.length,
+                                  connection->in.capacity - connection->in.length, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    } else if (received <= 0) {
+        connection_close(connection);
+        return;
+    }
+    connection->in.length += received;
+
+    size_t consumed = 0;
+    ssize_t length = 0;
+    struct client_response response;
+    while (connection->n_pipelined > 0
+           && (length = client_parse_response(connection->in.data + consumed, connection->in.length - consumed, &response)) > 0) {
+        complete(connection, &response);
+        consumed += length;
+    }
+    if (length == -1 || (connection->n_pipelined == 0 && consumed < connection->in.length)) {
+        connection_close(connection);  // Malformed or unexpected responses
+        return;
+    }
+    memmove(connection->in.data, connection->in.data + consumed, connection->in.length - consumed);
+    connection->in.length -= consumed;
+
+    while (target->queue_length > 0 && connection->n_pipelined < depth) {
+        connection_send(connection, &target->queue[target->queue_head]);
+        target->queue_head = (target->queue_head + 1) % queue_capacity;
+        target->queue_length -= 1;
+    }
+}
+
+
+static void connection_flush(struct load_connection* connection) {
+    while (connection->out_sent < connection->out.length) {
+        const ssize_t sent = send(connection->sock, connection->out.data + connection->out_sent,
+                                  connection->out.length - connection->out_sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                connection_close(connection);
+            }
+            return;
+        }
+        connection->out_sent += sent;
+    }
+    connection->out.length = 0;
+    connection->out_sent = 0;
+}
+
+
+static void print_latencies(const char* name, const struct histogram* histogram) {
+    static const double percentiles[] = { 50, 90, 99, 99.9, 99.99, 100 };
+    if (json) {
+        printf("\"%s\": {\"mean_us\": %.1f", name, histogram_mean(histogram) / 1e3);
+        for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i += 1) {
+            printf(", \"p%g_us\": %.1f", percentiles[i], histogram_percentile(histogram, percentiles[i]) / 1e3);
+        }
+        // Non-empty slots, so the histograms of several runs can be merged
+        printf(", \"histogram\": [");
+        const char* separator = "";
+        for (size_t i = 0; i < HISTOGRAM_SLOTS; i += 1) {
+            if (histogram->counts[i]) {
+                printf("%s[%lu, %lu]", separator, i, histogram->counts[i]);
+                separator = ", ";
+            }
+        }
+        printf("]}");
+    } else {
+        printf("%-14s mean %9.1f", name, histogram_mean(histogram) / 1e3);
+        for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i += 1) {
+            printf("  p%-5g %9.1f", percentiles[i], histogram_percentile(histogram, percentiles[i]) / 1e3);
+        }
+        printf("  (us)\n");
+    }
+}
+
+
+static void print_results(double elapsed_s) {
+    unsigned long redirected = 0;
+    unsigned long total_hops = 0;
+    for (size_t i = 1; i <= LOADGEN_MAX_HOPS; i += 1) {
+        redirected += hops[i];
+        total_hops += i * hops[i];
+    }
+    const unsigned long answered = completed - errors;
+    const double redirect_ratio = answered ? (double) redirected / answered : 0;
+    const double mean_hops = answered ? (double) total_hops / answered : 0;
+
+    if (json) {
+        printf("{\"requests\": %lu, \"duration_s\": %.3f, \"throughput\": %.1f, \"errors\": %lu, ",
+               completed, elapsed_s, completed / elapsed_s, errors);
+        printf("\"statuses\": {\"2xx\": %lu, \"3xx\": %lu, \"4xx\": %lu, \"5xx\": %lu}, ",
+               statuses[2], statuses[3], statuses[4], statuses[5]);
+        printf("\"redirect_ratio\": %.4f, \"mean_hops\": %.3f, \"hops\": [", redirect_ratio, mean_hops);
+        for (size_t i = 0; i <= LOADGEN_MAX_HOPS; i += 1) {
+            printf("%s%lu", i ? ", " : "", hops[i]);
+        }
+        printf("], ");
+        print_latencies("latency", &latency);
+        printf(", ");
+        print_latencies("service_time", &service_time);
+        printf("}\n");
+    } else {
+        printf("%lu requests in %.2f s, %.1f requests/s, %lu errors\n", completed, elapsed_s, completed / elapsed_s, errors);
+        printf("Statuses: 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu\n", statuses[2], statuses[3], statuses[4], statuses[5]);
+        printf("Redirected %.2f%% of requests, %.3f hops on average\n", 100 * redirect_ratio, mean_hops);
+        print_latencies("Latency", &latency);
+        print_latencies("Service time", &service_time);
+    }
+}
+
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-c connections] [-d depth] [-t seconds] [-R rate] [-k keys] [-z exponent] "
+                    "[-m get:put:delete] [-s size] [-r] [-j] contact.ip contact.port\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "c:d:t:R:k:z:m:s:rj")) != -1) {
+        switch (option) {
+            case 'c': connections_per_target = strtoul(optarg, NULL, 10); break;
+            case 'd': depth = strtoul(optarg, NULL, 10); break;
+            case 't': duration_s = strtod(optarg, NULL); break;
+            case 'R': rate = strtod(optarg, NULL); break;
+            case 'k': n_keys = strtoul(optarg, NULL, 10); break;
+            case 'z': zipf_exponent = strtod(optarg, NULL); break;
+            case 'm':
+                if (sscanf(optarg, "%u:%u:%u", &mix[0], &mix[1], &mix[2]) != 3) {
+                    usage(argv[0]);
+                }
+                break;
+            case 's': value_size = strtoul(optarg, NULL, 10); break;
+            case 'r': route = true; break;
+            case 'j': json = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || connections_per_target == 0 || depth == 0 || depth > LOADGEN_MAX_DEPTH
+        || n_keys == 0 || mix[0] + mix[1] + mix[2] == 0) {
+        usage(argv[0]);
+    }
+
+    if (client_init(&client, argv[optind], argv[optind + 1]) == -1) {
+        fprintf(stderr, "Failed to resolve %s:%s\n", argv[optind], argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    if (route && client_discover(&client) == -1) {
+        fprintf(stderr, "Failed to learn the ring, routing only partially\n");
+    }
+
+    payload = malloc(value_size + 1);
+    memset(payload, 'x', value_size);
+    if (zipf_exponent > 0) {
+        zipf_init();
+    }
+    histogram_init(&latency);
+    histogram_init(&service_time);
+
+    // Keep as many requests outstanding as the peers' connections can carry
+    const size_t n_peers = route ? client.n_ranges + 1 : 1;
+    const size_t max_outstanding = n_peers * connections_per_target * depth;
+    queue_capacity = max_outstanding;
+
+    struct pollfd* fds = malloc(LOADGEN_MAX_TARGETS * connections_per_target * sizeof(struct pollfd));
+    struct load_connection** polled = malloc(LOADGEN_MAX_TARGETS * connections_per_target * sizeof(struct load_connection*));
+    size_t* polled_targets = malloc(LOADGEN_MAX_TARGETS * connections_per_target * sizeof(size_t));
+
+    const uint64_t start = now_ns();
+    const uint64_t end = start + (uint64_t) (duration_s * 1e9);
+    const uint64_t interval = (rate > 0) ? (uint64_t) (1e9 / rate) : 0;
+    uint64_t next_due = start;
+    unsigned long issued = 0;
+
+    for (uint64_t now = start; now < end; now = now_ns()) {
+        // Issue all requests that are due and fit
+        while (issued - completed < max_outstanding && (interval == 0 || next_due <= now)) {
+            struct load_request request = {
+                .key = random_key(),
+                .op = random_op(),
+                .hops = 0,
+                .intended = (interval == 0) ? now : next_due,
+            };
+            next_due += interval;
+            issued += 1;
+            dispatch(&request);
+        }
+
+        size_t n_fds = 0;
+        for (size_t t = 0; t < n_targets; t += 1) {
+            for (size_t i = 0; i < connections_per_target; i += 1) {
+                struct load_connection* connection = &targets[t].connections[i];
+                if (connection->sock == -1) {
+                    continue;
+                }
+                connection_flush(connection);
+                if (connection->sock == -1) {
+                    continue;
+                }
+                fds[n_fds] = (struct pollfd) {
+                    .fd = connection->sock,
+                    .events = POLLIN | ((connection->out.length > 0) ? POLLOUT : 0),
+                };
+                polled[n_fds] = connection;
+                polled_targets[n_fds] = t;
+                n_fds += 1;
+            }
+        }
+
+        uint64_t wake = end;
+        if (interval > 0 && issued - completed < max_outstanding && next_due < wake) {
+            wake = next_due;
+        }
+        now = now_ns();
+        const int timeout = (wake > now) ? (int) ((wake - now + 999999) / 1000000) : 0;
+        if (poll(fds, n_fds, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < n_fds; i += 1) {
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                connection_receive(&targets[polled_targets[i]], polled[i]);
+            }
+        }
+    }
+
+    print_results((now_ns() - start) / 1e9);
+    free(fds);
+    free(polled);
+    free(polled_targets);
+    client_close(&client);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+/**
+* metrics.c renders the server's counters for scraping, see `metrics.h`.
+*/
+
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "access_log.h"
+#include "dht.h"
+#include "snapshot.h"
+
+
+struct metrics metrics;
+
+static const char* const method_names[HTTP_OTHER + 1] = {
+    [HTTP_GET] = "GET",
+    [HTTP_PUT] = "PUT",
+    [HTTP_DELETE] = "DELETE",
+    [HTTP_POST] = "POST",
+    [HTTP_OTHER] = "OTHER",
+};
+
+static const char* const segment_names[N_STORE_SEGMENTS] = {
+    [STORE_PROBATION] = "probation",
+    [STORE_PROTECTED] = "protected",
+};
+
+static const char* const opcode_names[N_OPCODES] = {
+    [LOOKUP] = "lookup",
+    [REPLY] = "reply",
+    [STABILIZE] = "stabilize",
+    [NOTIFY] = "notify",
+    [JOIN] = "join",
+};
+
+
+/**
+ * Append formatted text to `out`
+ */
+__attribute__((format(printf, 2, 3)))
+static void append(struct buffer* out, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    memcpy(buffer_append(out, n), line, n);
+}
+
+
+/**
+ * Append the `HELP` and `TYPE` lines introducing a metric
+ */
+static void describe(struct buffer* out, const char* name, const char* type, const char* help) {
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/**
+ * Append a metric with a single sample
+ */
+static void single(struct buffer* out, const char* name, const char* type, const char* help, uint64_t value) {
+    describe(out, name, type, help);
+    append(out, "%s %lu\n", name, value);
+}
+
+
+void metrics_report(struct buffer* out, const struct store* store) {
+    describe(out, "rn_requests_total", "counter", "HTTP requests answered, by method and status.");
+    for (size_t method = 0; method <= HTTP_OTHER; method += 1) {
+        for (size_t status = 0; status < METRICS_STATUS_END - METRICS_STATUS_BASE; status += 1) {
+            if (metrics.requests[method][status]) {
+                append(out, "rn_requests_total{method=\"%s\",status=\"%zu\"} %lu\n", method_names[method],
+                       status + METRICS_STATUS_BASE, metrics.requests[method][status]);
+            }
+        }
+    }
+    single(out, "rn_received_bytes_total", "counter", "Bytes received from clients.", metrics.bytes_received);
+    single(out, "rn_sent_bytes_total", "counter", "Bytes of replies sent to clients.", metrics.bytes_sent);
+    single(out, "rn_connections_accepted_total", "counter", "Client connections accepted.",
+           metrics.connections_accepted);
+    single(out, "rn_connections_active", "gauge", "Open client connections.", metrics.connections_active);
+    describe(out, "rn_load_records_total", "counter", "Records of bulk loads, by whether they were stored.");
+    append(out, "rn_load_records_total{result=\"stored\"} %lu\n", metrics.load_stored);
+    append(out, "rn_load_records_total{result=\"refused\"} %lu\n", metrics.load_refused);
+
+    single(out, "rn_access_log_dropped_total", "counter", "Access log records dropped as the log fell behind.",
+           atomic_load_explicit(&access_log.dropped, memory_order_relaxed));
+
+    single(out, "rn_store_resources", "gauge", "Resources held by the store.", store->size);
+    single(out, "rn_store_bytes", "gauge", "Bytes of keys and values held by the store.", store->bytes);
+    single(out, "rn_store_table_bytes", "gauge", "Bytes of the store's hash table.",
+           store->capacity * sizeof(struct entry));
+    describe(out, "rn_store_lookups_total", "counter", "Lookups of the store, by result.");
+    append(out, "rn_store_lookups_total{result=\"hit\"} %lu\n", store->hits);
+    append(out, "rn_store_lookups_total{result=\"miss\"} %lu\n", store->misses);
+
+    const struct store_cache* cache = &store->cache;
+    single(out, "rn_store_budget_bytes", "gauge", "Bytes the store may be charged in cache mode, 0 if unbounded.",
+           cache->budget);
+    describe(out, "rn_store_segment_bytes", "gauge", "Bytes charged to each segment in cache mode.");
+    for (size_t segment = 0; segment < N_STORE_SEGMENTS; segment += 1) {
+        append(out, "rn_store_segment_bytes{segment=\"%s\"} %lu\n", segment_names[segment],
+               cache->lists[segment].bytes);
+    }
+    describe(out, "rn_store_evictions_total", "counter", "Entries evicted in cache mode, by segment.");
+    for (size_t segment = 0; segment < N_STORE_SEGMENTS; segment += 1) {
+        append(out, "rn_store_evictions_total{segment=\"%s\"} %lu\n", segment_names[segment],
+               cache->evictions[segment]);
+    }
+    single(out, "rn_store_evicted_bytes_total", "counter", "Bytes of keys and values evicted in cache mode.",
+           cache->evicted_bytes);
+    single(out, "rn_store_rejections_total", "counter", "Values not stored as they exceed the budget on their own.",
+           cache->rejections);
+    single(out, "rn_store_promotions_total", "counter", "Entries promoted to the protected segment.",
+           cache->promotions);
+    single(out, "rn_store_demotions_total", "counter", "Entries demoted back to the probation segment.",
+           cache->demotions);
+
+    describe(out, "rn_snapshots_total", "counter", "Snapshots of the store completed, by result.");
+    append(out, "rn_snapshots_total{result=\"success\"} %lu\n", snapshot_stats.succeeded);
+    append(out, "rn_snapshots_total{result=\"failure\"} %lu\n", snapshot_stats.failed);
+    single(out, "rn_snapshot_running", "gauge", "Whether a snapshot is being written.", snapshot_stats.running);
+    describe(out, "rn_snapshot_duration_seconds", "gauge", "Duration of the last successful snapshot.");
+    append(out, "rn_snapshot_duration_seconds %.6f\n", snapshot_stats.last_duration_s);
+    single(out, "rn_snapshot_cow_pages", "gauge",
+           "Pages copied on write while the last successful snapshot was written.", snapshot_stats.last_cow_pages);
+    single(out, "rn_snapshot_last_success_timestamp_seconds", "gauge",
+           "Time the last successful snapshot completed.", snapshot_stats.last_success);
+
+    const struct dht_counters* dht = dht_counters();
+    describe(out, "rn_dht_messages_received_total", "counter", "DHT messages received, by type.");
+    for (size_t opcode = 0; opcode < N_OPCODES; opcode += 1) {
+        append(out, "rn_dht_messages_received_total{type=\"%s\"} %lu\n", opcode_names[opcode], dht->received[opcode]);
+    }
+    describe(out, "rn_dht_messages_sent_total", "counter", "DHT messages sent, by type.");
+    for (size_t opcode = 0; opcode < N_OPCODES; opcode += 1) {
+        append(out, "rn_dht_messages_sent_total{type=\"%s\"} %lu\n", opcode_names[opcode], dht->sent[opcode]);
+    }
+    single(out, "rn_dht_invalid_total", "counter", "DHT datagrams and records that could not be decoded.",
+           dht->invalid);
+
+    describe(out, "rn_dht_lookup_cache_total", "counter", "Routing decisions that consulted the lookup cache.");
+    append(out, "rn_dht_lookup_cache_total{result=\"hit\"} %lu\n", dht->cache_hits);
+    append(out, "rn_dht_lookup_cache_total{result=\"miss\"} %lu\n", dht->cache_misses);
+
+    describe(out, "rn_dht_lookups_total", "counter",
+             "Lookups started here, and lookups of others forwarded (one hop each) or answered.");
+    append(out, "rn_dht_lookups_total{role=\"started\"} %lu\n", dht->lookups_started);
+    append(out, "rn_dht_lookups_total{role=\"forwarded\"} %lu\n", dht->lookups_forwarded);
+    append(out, "rn_dht_lookups_total{role=\"answered\"} %lu\n", dht->lookups_answered);
+
+    describe(out, "rn_dht_neighbor_failures_total", "counter", "Neighbors dropped as they stopped stabilizing.");
+    append(out, "rn_dht_neighbor_failures_total{role=\"successor\"} %lu\n", dht->successor_failures);
+    append(out, "rn_dht_neighbor_failures_total{role=\"predecessor\"} %lu\n", dht->predecessor_failures);
+
+    single(out, "rn_dht_members", "gauge", "Peers known for one-hop routing.", dht_members());
+}
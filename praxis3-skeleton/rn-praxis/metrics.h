@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "data.h"
+#include "http.h"
+#include "util.h"
+
+
+/**
+ * Status codes are counted from 100 up to, excluding, `METRICS_STATUS_END`
+ */
+#define METRICS_STATUS_BASE 100
+#define METRICS_STATUS_END 600
+
+
+/**
+ * Counters of the webserver's activity, exported at `/_metrics`
+ *
+ * The event loop is the only one updating them, so plain increments suffice.
+ * DHT counters are kept by `dht.c`, see `dht_counters()`.
+ *
+ * `requests`: answered requests by method and status
+ * `bytes_received`, `bytes_sent`: payload of client connections
+ * `connections_accepted`, `connections_active`: client connections
+ * `load_stored`, `load_refused`: records of `/_load` requests inserted into
+ *                                the store, or answered with an error
+ */
+struct metrics {
+    uint64_t requests[HTTP_OTHER + 1][METRICS_STATUS_END - METRICS_STATUS_BASE];
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t connections_accepted;
+    uint64_t connections_active;
+    uint64_t load_stored;
+    uint64_t load_refused;
+};
+
+extern struct metrics metrics;
+
+
+/**
+ * Count a request answered with the given status
+ */
+static inline void metrics_request(enum http_method method, int status) {
+    if (status >= METRICS_STATUS_BASE && status < METRICS_STATUS_END) {
+        metrics.requests[method][status - METRICS_STATUS_BASE] += 1;
+    }
+}
+
+/**
+ * Append all counters to `out` in the Prometheus text exposition format
+ *
+ * `store` contributes the number and size of resources held.
+ */
+void metrics_report(struct buffer* out, const struct store* store);
@@ -0,0 +1,44 @@
+#pragma once
+
+/**
+ * USDT probes of the provider `rn`
+ *
+ * If systemtap's `<sys/sdt.h>` is found at build time, every probe compiles
+ * to a single nop plus an ELF note describing its arguments, so tools like
+ * bpftrace and perf can attach to it, e.g.
+ *
+ *   bpftrace -e 'usdt:./build/webserver:rn:request__end { @[arg2] = count(); }'
+ *
+ * Otherwise, probes compile to nothing. Their arguments must be free of side
+ * effects, as they are not evaluated then.
+ *
+ * request__start(sock, bytes_buffered)             before parsing a request
+ * request__malformed(sock, bytes_buffered)         a request failed to parse
+ * request__end(method, uri, status)                its reply is queued
+ * request__route(uri, hash, responsible_id)        -1 if a lookup is required
+ * parse__done(method, uri, payload_length)         a complete request was parsed
+ * store__get(key, found, value_length)
+ * store__set(key, value_length, overwritten)
+ * store__delete(key, existed)
+ * store__evict(key_length, value_length, segment)  an entry was evicted in cache mode
+ * dht__send(opcode, hash, ip, port)                a message was queued for a peer
+ * dht__recv(length)                                a datagram was received
+ * dht__invalid(type, length)                       a datagram, record or message was dropped
+ * lookup__issue(hash)
+ * lookup__complete(predecessor_id, peer_id, port)  a reply was received
+ * stabilize(successor_id, period_ms)               a stabilization round starts
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(rn, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(rn, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(rn, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(rn, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+
+#include "ring_buffer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+bool ring_buffer_init(struct ring_buffer* ring, size_t capacity) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    capacity = (capacity + page_size - 1) / page_size * page_size;
+
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        return false;
+    }
+    if (ftruncate(fd, capacity) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+
+    // Reserve both halves at once, then map the file into each of them
+    char* data = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return false;
+    }
+    if (mmap(data, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(data + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap");
+        munmap(data, 2 * capacity);
+        close(fd);
+        return false;
+    }
+    close(fd);  // The mappings keep the memory alive
+
+    *ring = (struct ring_buffer) {
+        .data = data,
+        .capacity = capacity,
+        .head = 0,
+        .tail = 0,
+    };
+    return true;
+}
+
+
+void ring_buffer_free(struct ring_buffer* ring) {
+    if (ring->data) {
+        munmap(ring->data, 2 * ring->capacity);
+    }
+    *ring = (struct ring_buffer) {0};
+}
+
+
+bool ring_buffer_grow(struct ring_buffer* ring) {
+    struct ring_buffer grown;
+    if (!ring_buffer_init(&grown, 2 * ring->capacity)) {
+        return false;
+    }
+
+    const size_t used = ring_buffer_used(ring);
+    memcpy(grown.data, ring_buffer_read_ptr(ring), used);
+    grown.tail = used;
+
+    ring_buffer_free(ring);
+    *ring = grown;
+    return true;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+
+/**
+ * A ring buffer whose memory is mapped twice, back to back
+ *
+ * Thanks to the mirror, unread data and free space are always contiguous in
+ * memory, no matter where they wrap around. Consuming data is a pointer bump;
+ * nothing is ever moved or cleared.
+ *
+ * `data` maps `capacity` bytes twice. `head` is the offset of the first
+ * unread byte and always below `capacity`, `tail` the offset of the first
+ * free byte, at most `capacity` past `head`.
+ */
+struct ring_buffer {
+    char* data;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+};
+
+/**
+ * Set up an empty ring buffer of at least `capacity` bytes
+ *
+ * The capacity is rounded up to a multiple of the page size. Returns false if
+ * the memory could not be mapped.
+ */
+bool ring_buffer_init(struct ring_buffer* ring, size_t capacity);
+
+/**
+ * Release the memory of a ring buffer
+ */
+void ring_buffer_free(struct ring_buffer* ring);
+
+/**
+ * Move the unread data into a ring buffer of twice the capacity
+ *
+ * Returns false if the memory could not be mapped, leaving `ring` untouched.
+ */
+bool ring_buffer_grow(struct ring_buffer* ring);
+
+/**
+ * Return the first unread byte, followed by `ring_buffer_used()` bytes
+ */
+static inline char* ring_buffer_read_ptr(const struct ring_buffer* ring) {
+    return ring->data + ring->head;
+}
+
+/**
+ * Return the first free byte, followed by `ring_buffer_free_space()` bytes
+ */
+static inline char* ring_buffer_write_ptr(const struct ring_buffer* ring) {
+    return ring->data + ring->tail;
+}
+
+static inline size_t ring_buffer_used(const struct ring_buffer* ring) {
+    return ring->tail - ring->head;
+}
+
+static inline size_t ring_buffer_free_space(const struct ring_buffer* ring) {
+    return ring->capacity - ring_buffer_used(ring);
+}
+
+/**
+ * Mark `n` bytes at the write pointer as written
+ */
+static inline void ring_buffer_produce(struct ring_buffer* ring, size_t n) {
+    ring->tail += n;
+}
+
+/**
+ * Drop `n` bytes at the read pointer
+ */
+static inline void ring_buffer_consume(struct ring_buffer* ring, size_t n) {
+    ring->head += n;
+    if (ring->head >= ring->capacity) {
+        ring->head -= ring->capacity;
+        ring->tail -= ring->capacity;
+    }
+}
+
+/**
+ * Drop all unread data
+ */
+static inline void ring_buffer_clear(struct ring_buffer* ring) {
+    ring->head = 0;
+    ring->tail = 0;
+}
@@ -1,5 +1,11 @@
 rn_protocol = Proto("RN", "Computer Networks Chord Protocol")
 
+PACKET_MAGIC = 0xD7
+PACKET_VERSION = 1
+MESSAGE_VALUE_SIZE = 10
+RECORD_MEMBER = 0x10
+MEMBER_VALUE_SIZE = 10
+
 -- Header fields
 flags_f = ProtoField.uint8("rn_protocol.flags", "flags", base.HEX)
 hash_f = ProtoField.uint16("rn_protocol.hash", "hash", base.HEX)
@@ -7,7 +13,14 @@ id_f = ProtoField.uint16("rn_protocol.id", "id", base.HEX)
 ip_f = ProtoField.ipv4("rn_protocol.ip", "ip")
 port_f = ProtoField.uint16("rn_protocol.port", "port", base.DEC)
 
-rn_protocol.fields = {flags_f, hash_f, id_f, ip_f, port_f}
+-- Container fields
+version_f = ProtoField.uint8("rn_protocol.version", "version", base.DEC)
+type_f = ProtoField.uint8("rn_protocol.type", "type", base.HEX)
+length_f = ProtoField.uint8("rn_protocol.length", "length", base.DEC)
+value_f = ProtoField.bytes("rn_protocol.value", "value")
+heartbeat_f = ProtoField.uint16("rn_protocol.heartbeat", "heartbeat", base.DEC)
+
+rn_protocol.fields = {flags_f, hash_f, id_f, ip_f, port_f, version_f, type_f, length_f, value_f, heartbeat_f}
 
 op_names = {
     [0] = "Lookup",
@@ -17,41 +30,111 @@ op_names = {
     [4] = "Join",
 }
 
-function info_text(buffer, pinfo)
-    local name = op_names[buffer(0, 1):uint()]
+-- Describe a message given its opcode and a buffer holding hash, id, ip, port
+function message_text(op, body)
+    local name = op_names[op]
     local desc = ""
     if name == "Lookup" then
-        desc = string.format(" %x for %x@%s:%u", buffer(1, 2):uint(), buffer(3, 2):uint(), buffer(5, 4):uint(), buffer(9, 2):uint())
+        desc = string.format(" %x for %x@%s:%u", body(0, 2):uint(), body(2, 2):uint(), body(4, 4):ipv4(), body(8, 2):uint())
     elseif name == "Reply" then
     elseif name == "Stabilize" then
-        desc = string.format(" from 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
+        desc = string.format(" from 0x%02x@%s:%u", body(2, 2):uint(), body(4, 4):ipv4(), body(8, 2):uint())
     elseif name == "Notify" then
-        desc = string.format(" of 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
+        desc = string.format(" of 0x%02x@%s:%u", body(2, 2):uint(), body(4, 4):ipv4(), body(8, 2):uint())
     elseif name == "Join" then
-        desc = string.format(" from 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
+        desc = string.format(" from 0x%02x@%s:%u", body(2, 2):uint(), body(4, 4):ipv4(), body(8, 2):uint())
     end
-    local suffix = string.format(" (%s:%u → %s:%u)", pinfo.src, pinfo.src_port, pinfo.dst, pinfo.dst_port)
-    return name .. desc .. suffix
+    return name .. desc
 end
 
-function rn_protocol.dissector(buffer, pinfo, tree)
-    length = buffer:len()
+function message_tree(tree, op, op_range, body)
+    tree:add(flags_f, op_range):append_text(" (" .. op_names[op] .. ")")
+    tree:add(hash_f, body(0, 2))
+    tree:add(id_f, body(2, 2))
+    tree:add(ip_f, body(4, 4))
+    tree:add(port_f, body(8, 2))
+end
+
+function suffix_text(pinfo)
+    return string.format(" (%s:%u → %s:%u)", pinfo.src, pinfo.src_port, pinfo.dst, pinfo.dst_port)
+end
 
-    if length ~= 11 then
+function dissect_legacy(buffer, pinfo, tree)
+    local op = buffer(0, 1):uint()
+    if op_names[op] == nil then
         return 0
     end
 
     local subtree = tree:add(rn_protocol, buffer(), rn_protocol.description)
     pinfo.cols.protocol = rn_protocol.name
-    pinfo.cols.info = info_text(buffer, pinfo) -- string.format("%s: (%s:%u → %s:%u)", op_names[buffer(0, 1):uint()],  pinfo.src, pinfo.src_port, pinfo.dst, pinfo.dst_port)
+    pinfo.cols.info = message_text(op, buffer(1)) .. suffix_text(pinfo)
 
-    subtree:add(flags_f, buffer(0, 1)):append_text(" (" .. op_names[buffer(0, 1):uint()] .. ")")
-    subtree:add(hash_f, buffer(1, 2))
-    subtree:add(id_f, buffer(3, 2))
-    subtree:add(ip_f, buffer(5, 4))
-    subtree:add(port_f, buffer(9, 2))
+    message_tree(subtree, op, buffer(0, 1), buffer(1))
 
     return 11
 end
 
+function dissect_container(buffer, pinfo, tree)
+    local length = buffer:len()
+    local subtree = tree:add(rn_protocol, buffer(), rn_protocol.description .. " (container)")
+    pinfo.cols.protocol = rn_protocol.name
+    subtree:add(version_f, buffer(1, 1))
+
+    local pos = 2
+    local count = 0
+    local first = nil
+    while pos + 2 <= length do
+        local op = buffer(pos, 1):uint()
+        local record_length = buffer(pos + 1, 1):uint()
+        if pos + 2 + record_length > length then
+            subtree:add_expert_info(PI_MALFORMED, PI_ERROR, "Truncated record")
+            break
+        end
+
+        local record = subtree:add(rn_protocol, buffer(pos, 2 + record_length), "Record")
+        if op_names[op] ~= nil and record_length >= MESSAGE_VALUE_SIZE then
+            local body = buffer(pos + 2, record_length)
+            record:set_text(message_text(op, body))
+            message_tree(record, op, buffer(pos, 1), body)
+            first = first or message_text(op, body)
+        elseif op == RECORD_MEMBER and record_length >= MEMBER_VALUE_SIZE then
+            local body = buffer(pos + 2, record_length)
+            record:set_text(string.format("Member 0x%02x@%s:%u (heartbeat %u)", body(0, 2):uint(), body(2, 4):ipv4(), body(6, 2):uint(), body(8, 2):uint()))
+            record:add(id_f, body(0, 2))
+            record:add(ip_f, body(2, 4))
+            record:add(port_f, body(6, 2))
+            record:add(heartbeat_f, body(8, 2))
+        else
+            record:add(type_f, buffer(pos, 1))
+            record:add(length_f, buffer(pos + 1, 1))
+            if record_length > 0 then
+                record:add(value_f, buffer(pos + 2, record_length))
+            end
+        end
+
+        count = count + 1
+        pos = pos + 2 + record_length
+    end
+
+    local summary = string.format("%u records", count)
+    if first ~= nil then
+        summary = summary .. ": " .. first .. (count > 1 and ", …" or "")
+    end
+    pinfo.cols.info = summary .. suffix_text(pinfo)
+
+    return length
+end
+
+function rn_protocol.dissector(buffer, pinfo, tree)
+    local length = buffer:len()
+
+    if length >= 2 and buffer(0, 1):uint() == PACKET_MAGIC and buffer(1, 1):uint() == PACKET_VERSION then
+        return dissect_container(buffer, pinfo, tree)
+    elseif length == 11 then
+        return dissect_legacy(buffer, pinfo, tree)
+    end
+
+    return 0
+end
+
 rn_protocol:register_heuristic("udp", rn_protocol.dissector)
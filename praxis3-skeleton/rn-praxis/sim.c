@@ -0,0 +1,644 @@
+/**
+* sim.c simulates a whole ring in a single process, running the actual protocol logic of dht.c on a virtual network and clock.
+*
+* Call as:
+*
+*  ./build/sim [options]
+*
+*  -n nodes       number of peers (default 1000)
+*  -J ms          interval between joins (default 10)
+*  -L min:max     one-way latency range in milliseconds (default 1:10)
+*  -p loss        probability of losing a datagram (default 0)
+*  -l lookups     number of lookups to measure (default 100)
+*  -f fraction    fraction of peers failing after the lookups (default 0.1)
+*  -w seconds     duration of the steady state measuring overhead (default 10)
+*  -T seconds     how long to wait for convergence (default 300)
+*  -o             gossip the membership for one-hop routing (ONE_HOP)
+*  -s seed        seed of all random choices (default 1)
+*  -j             print the results as a single JSON object
+*
+* Every peer has its own `struct dht_context`. Events are processed in time
+* order, each one within the context of the peer it concerns: the virtual
+* clock is set, the peer's datagram or timer is handled and its outbox
+* flushed, which schedules the delivery of the datagrams sent. The run
+* consists of these phases:
+*
+*  1. Peers join one after the other, via a random peer already started,
+*     until the ring converges, i.e., every peer knows its actual neighbors.
+*  2. The ring runs undisturbed to measure the protocol's message overhead.
+*  3. Lookups for IDs their originator cannot resolve are sent one at a time,
+*     counting their hops until the originator knows the responsible peer.
+*  4. A fraction of the peers fails at once, the surviving ones are given
+*     time to converge again. Neighbors leaving unanswered stabilizes are
+*     dropped, and peers continue with the successors they learned beyond
+*     them, so the ring usually closes within a few stabilization periods.
+*
+* The exit status is non-zero if the ring did not converge in phase 1 or 4.
+* Note that under sustained datagram loss of about 1% and more, the ring may
+* settle into several interleaved loops, which stabilization does not repair,
+* so joins are reported as not converged.
+*/
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dht.h"
+#include "histogram.h"
+#include "timer.h"
+
+#define SIM_IP_BASE 0x0A000000  // 10.0.0.0, the peers are numbered from there
+#define SIM_PORT 4711
+#define SIM_CHECK_INTERVAL_MS 100
+#define SIM_LOOKUP_TIMEOUT_MS 60000
+
+
+/**
+ * A simulated peer
+ *
+ * `next_tick` is the time of the timer event currently scheduled for it, so
+ * outdated timer events can be skipped.
+ */
+struct sim_node {
+    struct dht_context* context;
+    struct peer peer;
+    bool alive;
+    unsigned long next_tick;
+};
+
+
+enum event_type {
+    EVENT_DELIVER,
+    EVENT_TICK,
+    EVENT_JOIN,
+};
+
+
+/**
+ * Something happening to a peer at a given time, e.g., a datagram arriving
+ *
+ * Events at the same time are ordered by `seq`, so runs are reproducible.
+ */
+struct event {
+    unsigned long time;
+    uint64_t seq;
+    uint32_t node;
+    uint8_t type;
+    uint16_t length;
+    uint8_t* data;
+};
+
+
+// Options
+static size_t n_nodes = 1000;
+static unsigned long join_interval = 10;
+static unsigned long latency_min = 1;
+static unsigned long latency_max = 10;
+static double loss = 0;
+static size_t n_lookups = 100;
+static double failure_fraction = 0.1;
+static unsigned long steady_ms = 10000;
+static unsigned long convergence_timeout = 300000;
+static bool one_hop = false;
+static uint64_t seed = 1;
+static bool json = false;
+
+static struct sim_node* nodes;
+static struct sim_node* current = NULL;
+
+// Indices of the peers in the order they started
+static size_t* started;
+static size_t n_started = 0;
+
+static struct event* events;
+static size_t n_events = 0;
+static size_t events_capacity = 0;
+static uint64_t next_seq = 0;
+
+static uint64_t rng_state;
+
+/**
+ * Traffic since the last reset
+ */
+static struct {
+    unsigned long datagrams;
+    unsigned long bytes;
+    unsigned long dropped;
+    unsigned long messages[N_OPCODES];
+    unsigned long member_records;
+} traffic;
+
+/**
+ * The lookup currently measured, if `active`
+ */
+struct lookup_state {
+    bool active;
+    dht_id id;
+    uint32_t origin;
+    unsigned long hops;
+};
+static struct lookup_state lookup;
+
+
+static uint64_t random_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+
+static double random_unit(void) {
+    return (random_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+
+/*
+ * Event queue, a binary min-heap
+ */
+
+static bool event_before(const struct event* a, const struct event* b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+
+static void event_push(struct event event) {
+    if (n_events == events_capacity) {
+        events_capacity = events_capacity ? 2 * events_capacity : 1024;
+        events = realloc(events, events_capacity * sizeof(struct event));
+    }
+    event.seq = next_seq;
+    next_seq += 1;
+
+    size_t i = n_events;
+    n_events += 1;
+    while (i > 0 && event_before(&event, &events[(i - 1) / 2])) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = event;
+}
+
+
+static struct event event_pop(void) {
+    const struct event top = events[0];
+    n_events -= 1;
+    const struct event last = events[n_events];
+
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= n_events) {
+            break;
+        }
+        if (child + 1 < n_events && event_before(&events[child + 1], &events[child])) {
+            child += 1;
+        }
+        if (!event_before(&events[child], &last)) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+
+/*
+ * Virtual network
+ */
+
+/**
+ * Count the messages of a datagram and note hops of the measured lookup
+ */
+static void account(const uint8_t* data, size_t length) {
+    traffic.datagrams += 1;
+    traffic.bytes += length;
+
+    if (length == sizeof(struct dht_message) && data[0] != DHT_PACKET_MAGIC) {
+        if (data[0] < N_OPCODES) {
+            traffic.messages[data[0]] += 1;
+        }
+        uint16_t id;
+        memcpy(&id, data + 1, sizeof id);
+        if (lookup.active && data[0] == LOOKUP && ntohs(id) == lookup.id) {
+            lookup.hops += 1;
+        }
+        return;
+    }
+
+    for (const uint8_t* pos = data + DHT_PACKET_HEADER_SIZE; pos + DHT_RECORD_HEADER_SIZE <= data + length;
+         pos += DHT_RECORD_HEADER_SIZE + pos[1]) {
+        if (pos[0] < N_OPCODES) {
+            traffic.messages[pos[0]] += 1;
+            uint16_t id;
+            memcpy(&id, pos + DHT_RECORD_HEADER_SIZE, sizeof id);
+            if (lookup.active && pos[0] == LOOKUP && ntohs(id) == lookup.id) {
+                lookup.hops += 1;
+            }
+        } else if (pos[0] == DHT_RECORD_MEMBER) {
+            traffic.member_records += 1;
+        }
+    }
+}
+
+
+/**
+ * Transport of all peers: deliver the datagram after a random latency
+ */
+static void sim_transmit(const uint8_t* data, size_t length, const struct sockaddr_in* addr) {
+    account(data, length);
+
+    const uint32_t destination = ntohl(addr->sin_addr.s_addr) - SIM_IP_BASE;
+    if (destination >= n_nodes || !nodes[destination].alive || random_unit() < loss) {
+        traffic.dropped += 1;
+        return;
+    }
+
+    uint8_t* copy = malloc(length);
+    memcpy(copy, data, length);
+    event_push((struct event) {
+        .time = time_ms() + latency_min + random_next() % (latency_max - latency_min + 1),
+        .node = destination,
+        .type = EVENT_DELIVER,
+        .length = length,
+        .data = copy,
+    });
+}
+
+
+/*
+ * Peers
+ */
+
+static void node_enter(struct sim_node* node) {
+    dht_context_switch(node->context);
+    current = node;
+}
+
+
+/**
+ * Flush the current peer's outbox and schedule its next timer event
+ */
+static void node_leave(void) {
+    dht_flush();
+
+    const unsigned long deadline = dht_deadline();
+    if (deadline != TIMER_NEVER && deadline != current->next_tick) {
+        current->next_tick = (deadline > time_ms()) ? deadline : time_ms();
+        event_push((struct event) {
+            .time = current->next_tick,
+            .node = current - nodes,
+            .type = EVENT_TICK,
+        });
+    }
+}
+
+
+static void handle_event(const struct event* event) {
+    struct sim_node* node = &nodes[event->node];
+    clock_now_ms = event->time;
+
+    if (event->type == EVENT_JOIN) {
+        // Join via a random peer that started before
+        const struct sim_node* anchor = &nodes[started[random_next() % n_started]];
+        started[n_started] = event->node;
+        n_started += 1;
+
+        node->alive = true;
+        node_enter(node);
+        self = node->peer;
+        dht_join(&anchor->peer, 1);
+        dht_init(true, one_hop);
+        node_leave();
+    } else if (!node->alive) {
+        // Failed peers neither receive nor act
+    } else if (event->type == EVENT_DELIVER) {
+        node_enter(node);
+        dht_process_packet(event->data, event->length);
+        node_leave();
+
+        if (lookup.active && event->node == lookup.origin && dht_responsible(lookup.id)) {
+            lookup.active = false;
+        }
+    } else if (event->type == EVENT_TICK && event->time == node->next_tick) {
+        node->next_tick = TIMER_NEVER;
+        node_enter(node);
+        dht_tick();
+        node_leave();
+    }
+    free(event->data);
+}
+
+
+/**
+ * Check whether every live peer knows its actual predecessor and successor
+ */
+static bool converged(void) {
+    size_t first = 0;
+    while (first < n_nodes && !nodes[first].alive) {
+        first += 1;
+    }
+
+    bool result = true;
+    size_t previous = first;
+    for (size_t step = 1; result && step <= n_nodes; step += 1) {
+        const size_t i = (first + step) % n_nodes;
+        if (!nodes[i].alive) {
+            continue;
+        }
+        dht_context_switch(nodes[previous].context);
+        const bool successor_known = successor.id == nodes[i].peer.id && successor.port != 0;
+        dht_context_switch(nodes[i].context);
+        const bool predecessor_known = predecessor.id == nodes[previous].peer.id && predecessor.port != 0;
+        result = successor_known && predecessor_known;
+        previous = i;
+        if (i == first) {
+            break;
+        }
+    }
+    current = NULL;
+    return result;
+}
+
+
+/**
+ * Process events up to `until`, stopping early once `done()` holds
+ *
+ * `done` is checked every `SIM_CHECK_INTERVAL_MS`. Returns whether it held.
+ */
+static bool run(unsigned long until, bool (*done)(void)) {
+    unsigned long next_check = time_ms();
+    while (n_events > 0 && events[0].time <= until) {
+        if (done && events[0].time >= next_check) {
+            clock_now_ms = next_check;
+            if (done()) {
+                return true;
+            }
+            next_check += SIM_CHECK_INTERVAL_MS;
+        }
+        const struct event event = event_pop();
+        handle_event(&event);
+    }
+    clock_now_ms = until;
+    return done && done();
+}
+
+
+static bool lookup_done(void) {
+    return !lookup.active;
+}
+
+
+/*
+ * Phases
+ */
+
+/**
+ * Assign distinct random IDs, ordered along the ring by index
+ */
+static void create_nodes(void) {
+    static dht_id ids[1 << 16];
+    for (size_t i = 0; i < (1 << 16); i += 1) {
+        ids[i] = i;
+    }
+    for (size_t i = 0; i < n_nodes; i += 1) {
+        const size_t j = i + random_next() % ((1 << 16) - i);
+        const dht_id swap = ids[i];
+        ids[i] = ids[j];
+        ids[j] = swap;
+    }
+    // Sorting the IDs makes the ring's order that of the indices
+    for (size_t i = 1; i < n_nodes; i += 1) {
+        const dht_id id = ids[i];
+        size_t j = i;
+        for (; j > 0 && ids[j - 1] > id; j -= 1) {
+            ids[j] = ids[j - 1];
+        }
+        ids[j] = id;
+    }
+
+    nodes = calloc(n_nodes, sizeof(struct sim_node));
+    for (size_t i = 0; i < n_nodes; i += 1) {
+        nodes[i] = (struct sim_node) {
+            .context = dht_context_new(),
+            .peer = {
+                .id = ids[i],
+                .ip = { .s_addr = SIM_IP_BASE + i },
+                .port = SIM_PORT,
+            },
+            .alive = false,
+            .next_tick = TIMER_NEVER,
+        };
+    }
+}
+
+
+/**
+ * Start the first peer on its own, all others join it in random order
+ *
+ * Returns the time of the last join.
+ */
+static unsigned long start_ring(void) {
+    // Random join order, starting with a random peer
+    size_t* order = malloc(n_nodes * sizeof(size_t));
+    for (size_t i = 0; i < n_nodes; i += 1) {
+        order[i] = i;
+    }
+    for (size_t i = n_nodes - 1; i > 0; i -= 1) {
+        const size_t j = random_next() % (i + 1);
+        const size_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    clock_now_ms = 1;  // Zero has special meanings, e.g., for cache entries
+    struct sim_node* first = &nodes[order[0]];
+    started = malloc(n_nodes * sizeof(size_t));
+    started[0] = order[0];
+    n_started = 1;
+    first->alive = true;
+    node_enter(first);
+    self = first->peer;
+    predecessor = self;
+    successor = self;
+    dht_init(true, one_hop);
+    node_leave();
+
+    unsigned long time = clock_now_ms;
+    for (size_t i = 1; i < n_nodes; i += 1) {
+        time += join_interval;
+        event_push((struct event) { .time = time, .node = order[i], .type = EVENT_JOIN });
+    }
+    free(order);
+    return time;
+}
+
+
+/**
+ * Let all peers run without external activity, returning the traffic per peer and second
+ */
+static double measure_overhead(double* bytes_per_node) {
+    memset(&traffic, 0, sizeof traffic);
+    run(time_ms() + steady_ms, NULL);
+
+    const double node_seconds = n_nodes * (steady_ms / 1000.0);
+    *bytes_per_node = traffic.bytes / node_seconds;
+    return traffic.datagrams / node_seconds;
+}
+
+
+/**
+ * Measure sequential lookups from random peers for IDs they cannot resolve
+ */
+static void measure_lookups(struct histogram* hops, struct histogram* latencies, unsigned long* timeouts,
+                            unsigned long* local) {
+    for (size_t i = 0; i < n_lookups; i += 1) {
+        const uint32_t origin = random_next() % n_nodes;
+        const dht_id id = random_next();
+
+        node_enter(&nodes[origin]);
+        if (dht_responsible(id)) {
+            *local += 1;
+            continue;
+        }
+        lookup = (struct lookup_state) { .active = true, .id = id, .origin = origin, .hops = 0 };
+        dht_lookup(id);
+        node_leave();
+
+        const unsigned long start = time_ms();
+        if (run(start + SIM_LOOKUP_TIMEOUT_MS, lookup_done)) {
+            histogram_record(hops, lookup.hops + 1);  // The reply is a hop as well
+            histogram_record(latencies, time_ms() - start);
+        } else {
+            *timeouts += 1;
+        }
+        lookup.active = false;
+    }
+}
+
+
+/**
+ * Fail a random fraction of the peers at once
+ */
+static size_t fail_nodes(void) {
+    size_t failed = 0;
+    const size_t n = (size_t) (failure_fraction * n_nodes);
+    while (failed < n && failed + 1 < n_nodes) {
+        struct sim_node* node = &nodes[random_next() % n_nodes];
+        if (node->alive) {
+            node->alive = false;
+            failed += 1;
+        }
+    }
+    return failed;
+}
+
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-n nodes] [-J ms] [-L min:max] [-p loss] [-l lookups] [-f fraction] "
+                    "[-w seconds] [-T seconds] [-o] [-s seed] [-j]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "n:J:L:p:l:f:w:T:os:j")) != -1) {
+        switch (option) {
+            case 'n': n_nodes = strtoul(optarg, NULL, 10); break;
+            case 'J': join_interval = strtoul(optarg, NULL, 10); break;
+            case 'L':
+                if (sscanf(optarg, "%lu:%lu", &latency_min, &latency_max) != 2) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'p': loss = strtod(optarg, NULL); break;
+            case 'l': n_lookups = strtoul(optarg, NULL, 10); break;
+            case 'f': failure_fraction = strtod(optarg, NULL); break;
+            case 'w': steady_ms = 1000 * strtod(optarg, NULL); break;
+            case 'T': convergence_timeout = 1000 * strtod(optarg, NULL); break;
+            case 'o': one_hop = true; break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'j': json = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || n_nodes < 2 || n_nodes > (1 << 16) || latency_min == 0 || latency_max < latency_min) {
+        usage(argv[0]);
+    }
+
+    rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    srand(seed);
+    dht_set_transport(sim_transmit);
+    create_nodes();
+
+    // Phase 1: joins
+    const unsigned long last_join = start_ring();
+    run(last_join, NULL);
+    const bool joined = run(last_join + convergence_timeout, converged);
+    const double join_convergence = (time_ms() - last_join) / 1000.0;
+    const unsigned long join_events = next_seq;
+
+    // Phase 2: overhead
+    double bytes_per_node;
+    const double datagrams_per_node = measure_overhead(&bytes_per_node);
+    const unsigned long steady_messages[N_OPCODES] = {
+        traffic.messages[LOOKUP], traffic.messages[REPLY], traffic.messages[STABILIZE],
+        traffic.messages[NOTIFY], traffic.messages[JOIN],
+    };
+    const unsigned long steady_members = traffic.member_records;
+
+    // Phase 3: lookups
+    struct histogram hops;
+    struct histogram latencies;
+    histogram_init(&hops);
+    histogram_init(&latencies);
+    unsigned long timeouts = 0;
+    unsigned long local = 0;
+    measure_lookups(&hops, &latencies, &timeouts, &local);
+
+    // Phase 4: failures
+    const size_t failed = fail_nodes();
+    const unsigned long failure_time = time_ms();
+    const bool recovered = run(failure_time + convergence_timeout, converged);
+    const double failure_convergence = (time_ms() - failure_time) / 1000.0;
+
+    const double seconds = steady_ms / 1000.0;
+    if (json) {
+        printf("{\"nodes\": %lu, \"one_hop\": %s, ", n_nodes, one_hop ? "true" : "false");
+        printf("\"join\": {\"converged\": %s, \"convergence_s\": %.3f, \"events\": %lu}, ",
+               joined ? "true" : "false", join_convergence, join_events);
+        printf("\"overhead\": {\"datagrams_per_node_s\": %.3f, \"bytes_per_node_s\": %.1f, "
+               "\"stabilize_per_node_s\": %.3f, \"notify_per_node_s\": %.3f, \"member_records_per_node_s\": %.3f}, ",
+               datagrams_per_node, bytes_per_node, steady_messages[STABILIZE] / (n_nodes * seconds),
+               steady_messages[NOTIFY] / (n_nodes * seconds), steady_members / (n_nodes * seconds));
+        printf("\"lookups\": {\"count\": %lu, \"local\": %lu, \"timeouts\": %lu, \"mean_hops\": %.2f, "
+               "\"p50_hops\": %lu, \"p99_hops\": %lu, \"max_hops\": %lu, \"mean_latency_ms\": %.1f, \"p99_latency_ms\": %lu}, ",
+               hops.total, local, timeouts, histogram_mean(&hops), histogram_percentile(&hops, 50),
+               histogram_percentile(&hops, 99), histogram_percentile(&hops, 100), histogram_mean(&latencies),
+               histogram_percentile(&latencies, 99));
+        printf("\"failure\": {\"failed\": %lu, \"converged\": %s, \"convergence_s\": %.3f}}\n",
+               failed, recovered ? "true" : "false", failure_convergence);
+    } else {
+        printf("%lu nodes%s, %lu to %lu ms latency, %.1f%% loss\n", n_nodes, one_hop ? " (one-hop)" : "",
+               latency_min, latency_max, 100 * loss);
+        printf("Joins: %s %.2f s after the last join, %lu events\n",
+               joined ? "converged" : "not converged", join_convergence, join_events);
+        printf("Overhead: %.2f datagrams and %.0f bytes per node and second, "
+               "%.2f stabilize, %.2f notify, %.2f member records\n",
+               datagrams_per_node, bytes_per_node, steady_messages[STABILIZE] / (n_nodes * seconds),
+               steady_messages[NOTIFY] / (n_nodes * seconds), steady_members / (n_nodes * seconds));
+        printf("Lookups: %lu measured, %lu resolved locally, %lu timed out\n", hops.total, local, timeouts);
+        printf("  hops mean %.2f, p50 %lu, p99 %lu, max %lu; latency mean %.1f ms, p99 %lu ms\n",
+               histogram_mean(&hops), histogram_percentile(&hops, 50), histogram_percentile(&hops, 99),
+               histogram_percentile(&hops, 100), histogram_mean(&latencies), histogram_percentile(&latencies, 99));
+        printf("Failures: %lu peers failed, %s after %.2f s\n", failed,
+               recovered ? "converged" : "not converged", failure_convergence);
+    }
+
+    dht_set_transport(NULL);
+    return (joined && recovered) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
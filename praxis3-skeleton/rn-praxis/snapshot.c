@@ -0,0 +1,299 @@
+/**
+* snapshot.c writes and maps snapshots of the store, see `snapshot.h`.
+*/
+
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// Descriptor of the pipe the child reports through, the only one it keeps open besides the standard ones
+#define CHILD_REPORT_FD 3
+
+
+struct snapshot_stats snapshot_stats;
+
+// The child writing the current snapshot and the pipe it reports through
+static pid_t child = -1;
+static int report_fd = -1;
+
+/**
+ * What the child reports about its snapshot
+ */
+struct child_report {
+    uint64_t duration_ns;
+    uint64_t cow_pages;
+};
+
+
+/**
+ * Write the header, index and heap of a snapshot to `file`
+ */
+static bool write_contents(FILE* file, const struct store* store) {
+    const uint64_t header[] = { store->capacity, store->size, store->bytes };
+    char magic[8] = SNAPSHOT_MAGIC;
+    magic[7] = SNAPSHOT_VERSION;
+    if (fwrite(magic, sizeof magic, 1, file) != 1 || fwrite(header, sizeof header, 1, file) != 1) {
+        return false;
+    }
+
+    uint64_t offset = SNAPSHOT_HEADER_SIZE + store->capacity * sizeof(struct snapshot_slot);
+    for (size_t i = 0; i < store->capacity; i += 1) {
+        const struct entry* entry = &store->entries[i];
+        struct snapshot_slot slot = {0};
+        if (entry->key) {
+            slot = (struct snapshot_slot) {
+                .key_offset = offset,
+                .value_length = entry->value_length,
+                .hash = entry->hash,
+                .key_length = entry->key_length,
+            };
+            offset += entry->key_length + entry->value_length;
+        }
+        if (fwrite(&slot, sizeof slot, 1, file) != 1) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < store->capacity; i += 1) {
+        const struct entry* entry = &store->entries[i];
+        if (entry->key && (fwrite(entry->key, 1, entry->key_length, file) != entry->key_length
+                           || fwrite(entry->value, 1, entry->value_length, file) != entry->value_length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool snapshot_write(const char* path, const struct store* store) {
+    char temporary[4096];
+    if (snprintf(temporary, sizeof temporary, "%s.tmp", path) >= (int) sizeof temporary) {
+        fprintf(stderr, "Snapshot path too long\n");
+        return false;
+    }
+
+    FILE* file = fopen(temporary, "w");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    bool written = write_contents(file, store) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(temporary, path) == -1 || !sync_directory_of(path)) {
+        perror("snapshot");
+        unlink(temporary);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Report a corrupt snapshot and exit, starting without the data would lose it
+ */
+static void corrupt(const char* path, const char* reason) {
+    fprintf(stderr, "Snapshot %s is corrupt: %s\n", path, reason);
+    exit(EXIT_FAILURE);
+}
+
+
+bool snapshot_load(const char* path, struct store* store) {
+    const int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd == -1 && errno == ENOENT) {
+        return false;
+    } else if (fd == -1 || fstat(fd, &info) == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    const size_t length = info.st_size;
+    if (length < SNAPSHOT_HEADER_SIZE) {
+        corrupt(path, "truncated header");
+    }
+
+    char* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t capacity;
+    memcpy(&capacity, map + 8, sizeof capacity);
+    if (memcmp(map, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC - 1) != 0 || map[7] != SNAPSHOT_VERSION) {
+        corrupt(path, "unknown format");
+    } else if ((capacity & (capacity - 1)) != 0
+               || capacity > (length - SNAPSHOT_HEADER_SIZE) / sizeof(struct snapshot_slot)) {
+        corrupt(path, "invalid index");
+    }
+
+    // The index is read once, front to back
+    const struct snapshot_slot* slots = (const struct snapshot_slot*) (map + SNAPSHOT_HEADER_SIZE);
+    madvise(map, SNAPSHOT_HEADER_SIZE + capacity * sizeof(struct snapshot_slot), MADV_SEQUENTIAL);
+
+    struct store_block* block = malloc(sizeof(struct store_block));
+    *block = (struct store_block) {
+        .mapping = map,
+        .mapping_length = length,
+    };
+    struct entry* entries = calloc(capacity, sizeof(struct entry));
+    size_t bytes = 0;
+    for (size_t i = 0; i < capacity; i += 1) {
+        const struct snapshot_slot* slot = &slots[i];
+        if (slot->key_offset == 0) {
+            continue;
+        } else if (slot->key_offset > length || slot->key_length + slot->value_length > length - slot->key_offset) {
+            corrupt(path, "entry out of bounds");
+        }
+        entries[i] = (struct entry) {
+            .key = map + slot->key_offset,
+            .value = map + slot->key_offset + slot->key_length,
+            .value_length = slot->value_length,
+            .hash = slot->hash,
+            .key_length = slot->key_length,
+            .block = block,
+        };
+        block->refs += 1;
+        bytes += slot->key_length + slot->value_length;
+    }
+
+    // Values are read as they are requested
+    madvise(map, length, MADV_RANDOM);
+
+    free(store->entries);
+    store->entries = entries;
+    store->capacity = capacity;
+    store->size = block->refs;
+    store->bytes = bytes;
+    if (block->refs == 0) {
+        munmap(map, length);
+        free(block);
+    }
+    store_adopt(store);
+    fprintf(stderr, "Mapped %lu resources from snapshot %s\n", store->size, path);
+    return true;
+}
+
+
+static uint64_t monotonic_ns(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return 1000000000ULL * spec.tv_sec + spec.tv_nsec;
+}
+
+
+/**
+ * Return the number of private, dirty pages of this process
+ *
+ * In the child, these are mostly the pages the parent modified: the parent
+ * gets the copy, and the original remains with the child alone.
+ */
+static uint64_t private_dirty_pages(void) {
+    FILE* rollup = fopen("/proc/self/smaps_rollup", "r");
+    if (!rollup) {
+        return 0;
+    }
+    char line[256];
+    unsigned long kilobytes = 0;
+    while (fgets(line, sizeof line, rollup)) {
+        if (sscanf(line, "Private_Dirty: %lu kB", &kilobytes) == 1) {
+            break;
+        }
+    }
+    fclose(rollup);
+    return kilobytes * 1024 / sysconf(_SC_PAGESIZE);
+}
+
+
+bool snapshot_start(const char* path, const struct store* store) {
+    if (child != -1) {
+        return false;
+    }
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return false;
+    }
+    const uint64_t start = monotonic_ns();
+    child = fork();
+    if (child == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (child == 0) {
+        // Drop the parent's descriptors, or connections it closes would stay open until we exit
+        dup2(fds[1], CHILD_REPORT_FD);
+        close_range(CHILD_REPORT_FD + 1, ~0U, 0);
+
+        const bool written = snapshot_write(path, store);
+        const struct child_report report = {
+            .duration_ns = monotonic_ns() - start,
+            .cow_pages = private_dirty_pages(),
+        };
+        if (write(CHILD_REPORT_FD, &report, sizeof report) != sizeof report) {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    report_fd = fds[0];
+    snapshot_stats.running = true;
+    return true;
+}
+
+
+enum snapshot_state snapshot_poll(void) {
+    if (child == -1) {
+        return SNAPSHOT_RUNNING;
+    }
+    int status;
+    pid_t exited;
+    do {
+        exited = waitpid(child, &status, WNOHANG);
+    } while (exited == -1 && errno == EINTR);
+    if (exited == 0) {
+        return SNAPSHOT_RUNNING;
+    }
+
+    struct child_report report;
+    bool reported = false;
+    if (exited == -1) {
+        // The child's fate is unknown, so it may still hold the pipe open
+        perror("waitpid");
+    } else {
+        // The report was written before the child exited, so reading does not block
+        reported = read(report_fd, &report, sizeof report) == sizeof report;
+    }
+    close(report_fd);
+    child = -1;
+    report_fd = -1;
+    snapshot_stats.running = false;
+
+    if (!reported || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        snapshot_stats.failed += 1;
+        return SNAPSHOT_FAILED;
+    }
+    snapshot_stats.succeeded += 1;
+    snapshot_stats.last_duration_s = report.duration_ns / 1e9;
+    snapshot_stats.last_cow_pages = report.cow_pages;
+    snapshot_stats.last_success = time(NULL);
+    return SNAPSHOT_SUCCEEDED;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "data.h"
+
+
+/**
+ * Snapshot of the store, laid out to be mapped rather than read
+ *
+ *   | magic "RNSNAP" (6) | reserved (1) | version (1) | capacity (8) | size (8) | bytes (8) |
+ *   | index: `capacity` slots | heap: key and value of each used slot |
+ *
+ * The index is the store's hash table, slot for slot, with offsets into the
+ * file instead of pointers. A table of the same capacity filled from it needs
+ * no hashing or probing, and its keys and values stay in the mapping: loading
+ * only reads the index, no matter how large the values are. Fields are in
+ * host byte order, snapshots are not meant to move between machines.
+ */
+#define SNAPSHOT_MAGIC "RNSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 32
+
+/**
+ * A slot of the index, unused if `key_offset` is zero
+ *
+ * The value follows the key in the heap.
+ */
+struct snapshot_slot {
+    uint64_t key_offset;
+    uint64_t value_length;
+    uint32_t hash;
+    uint16_t key_length;
+    uint16_t reserved;
+};
+
+/**
+ * States of a snapshot taken in the background
+ */
+enum snapshot_state {
+    SNAPSHOT_RUNNING,
+    SNAPSHOT_SUCCEEDED,
+    SNAPSHOT_FAILED,
+};
+
+/**
+ * Outcome of the snapshots taken so far, see `snapshot_start()`
+ *
+ * `last_duration_s`: from the fork until the snapshot was durable
+ * `last_cow_pages`: pages the child ended up with a copy of, as the parent
+ *                   modified them while the snapshot was written
+ * `last_success`: wall-clock time the last successful snapshot completed
+ */
+struct snapshot_stats {
+    uint64_t succeeded;
+    uint64_t failed;
+    double last_duration_s;
+    uint64_t last_cow_pages;
+    time_t last_success;
+    bool running;
+};
+
+extern struct snapshot_stats snapshot_stats;
+
+/**
+ * Write a snapshot of `store` to `path`, atomically replacing the previous one
+ *
+ * The snapshot is durable once this returns true.
+ */
+bool snapshot_write(const char* path, const struct store* store);
+
+/**
+ * Start writing a snapshot of `store` to `path` in a child process
+ *
+ * The child works on a copy-on-write image of our memory, so we can go on
+ * changing the store meanwhile. Returns false if a snapshot is running
+ * already or the child could not be forked.
+ */
+bool snapshot_start(const char* path, const struct store* store);
+
+/**
+ * Check on the snapshot started last, without blocking
+ *
+ * Once it completed, `snapshot_stats` are updated and the next one may be
+ * started. A child whose exit status cannot be collected counts as failed.
+ */
+enum snapshot_state snapshot_poll(void);
+
+/**
+ * Fill the empty `store` from the snapshot at `path`
+ *
+ * Keys and values are served from the mapped file. Returns false if there is
+ * no snapshot, exits if it is corrupt.
+ */
+bool snapshot_load(const char* path, struct store* store);
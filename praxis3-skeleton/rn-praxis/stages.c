@@ -0,0 +1,68 @@
+/**
+* stages.c aggregates the durations of the request path's stages, see `stages.h`.
+*/
+
+#include "stages.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+struct histogram stage_histograms[N_STAGES];
+
+static const char* const stage_names[N_STAGES] = {
+    [STAGE_RECV] = "recv",
+    [STAGE_PARSE] = "parse",
+    [STAGE_HASH] = "hash",
+    [STAGE_ROUTE] = "route",
+    [STAGE_STORE] = "store",
+    [STAGE_SEND] = "send",
+    [STAGE_REQUEST] = "request",
+};
+
+// Reference points to convert ticks into nanoseconds
+static uint64_t init_ticks;
+static uint64_t init_ns;
+
+
+static uint64_t monotonic_ns(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return 1000000000ULL * spec.tv_sec + spec.tv_nsec;
+}
+
+
+void stages_init(void) {
+    for (size_t i = 0; i < N_STAGES; i += 1) {
+        histogram_init(&stage_histograms[i]);
+    }
+    init_ticks = stage_now();
+    init_ns = monotonic_ns();
+}
+
+
+void stages_report(struct buffer* out) {
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+
+    // The longer since initialization, the more precise the tick rate
+    const uint64_t elapsed_ticks = stage_now() - init_ticks;
+    const uint64_t elapsed_ns = monotonic_ns() - init_ns;
+    const double ns_per_tick = elapsed_ticks ? (double) elapsed_ns / elapsed_ticks : 1;
+
+    char line[256];
+    int n = snprintf(line, sizeof line, "%-8s %10s %10s %10s %10s %10s %10s %10s\n",
+                     "stage", "count", "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+    memcpy(buffer_append(out, n), line, n);
+
+    for (size_t i = 0; i < N_STAGES; i += 1) {
+        const struct histogram* histogram = &stage_histograms[i];
+        n = snprintf(line, sizeof line, "%-8s %10lu %10.3f", stage_names[i], histogram->total,
+                     histogram_mean(histogram) * ns_per_tick / 1e3);
+        for (size_t p = 0; p < sizeof percentiles / sizeof percentiles[0]; p += 1) {
+            n += snprintf(line + n, sizeof line - n, " %10.3f",
+                          histogram_percentile(histogram, percentiles[p]) * ns_per_tick / 1e3);
+        }
+        n += snprintf(line + n, sizeof line - n, " %10.3f\n", histogram->max * ns_per_tick / 1e3);
+        memcpy(buffer_append(out, n), line, n);
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "histogram.h"
+#include "util.h"
+
+
+/**
+ * Stages of the request path whose durations are recorded
+ *
+ * `STAGE_REQUEST` spans a complete request, from parsing until its reply is
+ * queued.
+ */
+enum stage {
+    STAGE_RECV,
+    STAGE_PARSE,
+    STAGE_HASH,
+    STAGE_ROUTE,
+    STAGE_STORE,
+    STAGE_SEND,
+    STAGE_REQUEST,
+    N_STAGES,
+};
+
+
+/**
+ * Durations of each stage, in ticks of `stage_now()`
+ */
+extern struct histogram stage_histograms[N_STAGES];
+
+
+/**
+ * Return the current time in ticks of an unspecified, monotonic clock
+ *
+ * Reads the time stamp counter where available, which takes a few
+ * nanoseconds, so every request can be timed.
+ */
+static inline uint64_t stage_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return 1000000000ULL * spec.tv_sec + spec.tv_nsec;
+#endif
+}
+
+/**
+ * Record a stage that began at `start`, returning the time it ended
+ *
+ * The result serves as start of the next stage.
+ */
+static inline uint64_t stage_end(enum stage stage, uint64_t start) {
+    const uint64_t now = stage_now();
+    histogram_record(&stage_histograms[stage], now - start);
+    return now;
+}
+
+/**
+ * Reset all histograms and calibrate the clock against the monotonic one
+ */
+void stages_init(void);
+
+/**
+ * Append a table of the stages' counts and latency percentiles to `out`
+ */
+void stages_report(struct buffer* out);
@@ -14,6 +14,11 @@ Message = collections.namedtuple('Message', ['flags', 'id', 'peer'])
 Flags = enum.Enum('Flags', ['lookup', 'reply', 'stabilize', 'notify', 'join'], start=0)
 message_format = "!BHH4sH"
 
+PACKET_MAGIC = 0xD7
+PACKET_VERSION = 1
+packet_header_format = "!BB"
+record_header_format = "!BB"
+
 
 def deserialize(data):
     flags, hash_, id_, ip, port = struct.unpack(message_format, data)
@@ -24,6 +29,78 @@ def serialize(msg):
     return struct.pack(message_format, msg.flags.value, msg.id, msg.peer.id, IPv4Address(msg.peer.ip).packed, msg.peer.port)
 
 
+def serialize_packet(msgs, extra_records=()):
+    """Pack messages (and raw `(type, value)` records) into a container"""
+    data = struct.pack(packet_header_format, PACKET_MAGIC, PACKET_VERSION)
+    for msg in msgs:
+        value = serialize(msg)[1:]
+        data += struct.pack(record_header_format, msg.flags.value, len(value)) + value
+    for type_, value in extra_records:
+        data += struct.pack(record_header_format, type_, len(value)) + value
+    return data
+
+
+def deserialize_packet(data):
+    """Return all messages contained in a datagram, legacy or container"""
+    if len(data) == struct.calcsize(message_format) and data[0] != PACKET_MAGIC:
+        return [deserialize(data)]
+
+    magic, version = struct.unpack_from(packet_header_format, data)
+    assert magic == PACKET_MAGIC and version == PACKET_VERSION, "Datagram is neither a message nor a container"
+
+    msgs = []
+    pos = struct.calcsize(packet_header_format)
+    while pos < len(data):
+        type_, length = struct.unpack_from(record_header_format, data, pos)
+        pos += struct.calcsize(record_header_format)
+        value = data[pos:pos + length]
+        assert len(value) == length, "Container record is truncated"
+        if type_ < len(Flags):
+            msgs.append(deserialize(bytes([type_]) + value[:struct.calcsize(message_format) - 1]))
+        pos += length
+    return msgs
+
+
+RingEntry = collections.namedtuple('RingEntry', ['role', 'from_', 'peer'])
+RingRole = enum.Enum('RingRole', ['self', 'successor', 'member', 'cached'], start=0)
+ring_header_format = "!4sBxH"
+
+
+def deserialize_ring(data):
+    """Return the entries of a binary ring view as served at `/_ring`"""
+    magic, version, count = struct.unpack_from(ring_header_format, data)
+    assert magic == b'RING' and version == 1, "Invalid ring view header"
+
+    entries = []
+    size = struct.calcsize(message_format)
+    for i in range(count):
+        start = struct.calcsize(ring_header_format) + i * size
+        msg = struct.unpack(message_format, data[start:start + size])
+        role, from_, id_, ip, port = msg
+        entries.append(RingEntry(RingRole(role), from_, Peer(id_, IPv4Address(ip).exploded, port)))
+    return entries
+
+
+TraceRecord = collections.namedtuple('TraceRecord', ['time', 'type', 'opcode', 'hash', 'peer', 'remote'])
+TraceType = enum.Enum('TraceType', ['send', 'recv', 'predecessor', 'successor', 'cache'], start=0)
+trace_header_format = "!4sB3xQ"
+trace_record_format = "!IBBHH4sHH4sH"
+
+
+def deserialize_trace(data):
+    """Return the number of events recorded and the records of a trace dump as served at `/_trace`"""
+    magic, version, recorded = struct.unpack_from(trace_header_format, data)
+    assert magic == b'TRCE' and version == 1, "Invalid trace header"
+
+    records = []
+    for fields in struct.iter_unpack(trace_record_format, data[struct.calcsize(trace_header_format):]):
+        time_, type_, opcode, hash_, peer_id, peer_ip, peer_port, remote_id, remote_ip, remote_port = fields
+        records.append(TraceRecord(time_, TraceType(type_), opcode, hash_,
+                                   Peer(peer_id, IPv4Address(peer_ip).exploded, peer_port),
+                                   Peer(remote_id, IPv4Address(remote_ip).exploded, remote_port)))
+    return recorded, records
+
+
 def hash(data):
     return int.from_bytes(hashlib.sha256(data).digest()[:2], 'big')
 
@@ -0,0 +1,787 @@
+import contextlib
+import json
+import os
+import re
+import signal
+import socket
+import struct
+import subprocess
+import time
+from http.client import HTTPConnection
+
+import pytest
+
+import dht
+import util
+
+BATCH_GET, BATCH_PUT, BATCH_DELETE = range(3)
+
+
+@pytest.fixture
+def static_peer(request):
+    """Return a function for spawning DHT peers with a fixed neighborhood
+    """
+    def runner(peer, predecessor, successor):
+        return util.KillOnExit(
+            [request.config.getoption('executable'), peer.ip, f'{peer.port}', f'{peer.id}'],
+            env={
+                'PRED_ID': f'{predecessor.id}', 'PRED_IP': predecessor.ip, 'PRED_PORT': f'{predecessor.port}',
+                'SUCC_ID': f'{successor.id}', 'SUCC_IP': successor.ip, 'SUCC_PORT': f'{successor.port}',
+                'NO_STABILIZE': '1',
+            },
+        )
+
+    return runner
+
+
+def test_container_batching(static_peer, timeout):
+    """Messages in a container are processed individually, replies for the same peer are batched"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(
+        predecessor, timeout
+    ) as pred_mock, static_peer(
+        self, predecessor, successor
+    ), dht.peer_socket(
+        successor, timeout
+    ) as succ_mock:
+        lookups = [dht.Message(dht.Flags.lookup, hash_, predecessor) for hash_ in (0x2800, 0x3000, 0x1800)]
+        pred_mock.sendto(dht.serialize_packet(lookups), (self.ip, self.port))
+
+        time.sleep(.1)
+
+        # Both forwarded lookups share one datagram
+        forwarded = dht.deserialize_packet(succ_mock.recv(2048))
+        assert forwarded == lookups[:2], "Lookups should be forwarded in a single container"
+        assert util.bytes_available(succ_mock) == 0, "Forwarded lookups should not be split"
+
+        # A lone reply is sent in the legacy format
+        dht.expect_msg(pred_mock, dht.Message(dht.Flags.reply, self.id, successor))
+
+
+def test_container_unknown_record(static_peer, timeout):
+    """Unknown records in a container are skipped"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(
+        predecessor, timeout
+    ) as pred_mock, static_peer(
+        self, predecessor, successor
+    ), dht.peer_socket(
+        successor, timeout
+    ):
+        lookup = dht.Message(dht.Flags.lookup, 0x1800, predecessor)
+        packet = dht.serialize_packet([], extra_records=[(0x7f, b'\x01\x02\x03')]) + dht.serialize_packet([lookup])[2:]
+        pred_mock.sendto(packet, (self.ip, self.port))
+
+        time.sleep(.1)
+
+        dht.expect_msg(pred_mock, dht.Message(dht.Flags.reply, self.id, successor))
+
+
+def test_join_burst(static_peer, timeout):
+    """Joins arriving together are spliced into the ring in order"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x2000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x3000, '127.0.0.1', 4712)
+    first = dht.Peer(0x1000, '127.0.0.1', 4713)
+    second = dht.Peer(0x1800, '127.0.0.1', 4714)
+
+    with dht.peer_socket(
+        predecessor, timeout
+    ) as pred_mock, static_peer(
+        self, predecessor, successor
+    ), dht.peer_socket(
+        successor, timeout
+    ) as succ_mock, dht.peer_socket(
+        first, timeout
+    ) as first_mock, dht.peer_socket(
+        second, timeout
+    ) as second_mock:
+        joins = [dht.Message(dht.Flags.join, 0, peer) for peer in (second, first)]
+        pred_mock.sendto(dht.serialize_packet(joins), (self.ip, self.port))
+
+        time.sleep(.1)
+
+        dht.expect_msg(first_mock, dht.Message(dht.Flags.notify, None, second))
+        dht.expect_msg(second_mock, dht.Message(dht.Flags.notify, None, self))
+        dht.expect_msg(pred_mock, dht.Message(dht.Flags.notify, None, first))
+        assert util.bytes_available(succ_mock) == 0, "Data received on successor socket"
+
+
+def test_one_hop(request):
+    """In one-hop mode, every peer redirects straight to the responsible peer"""
+
+    executable = request.config.getoption('executable')
+    peers = [dht.Peer(id_, '127.0.0.1', 4710 + i) for i, id_ in enumerate([7044, 15792, 59957, 4386, 18648])]
+    env = {'ONE_HOP': '1'}
+
+    with contextlib.ExitStack() as contexts:
+        anchor = peers[0]
+        contexts.enter_context(util.KillOnExit(
+            [executable, anchor.ip, f'{anchor.port}', f'{anchor.id}'], env=env
+        ))
+        for peer in peers[1:]:
+            contexts.enter_context(util.KillOnExit(
+                [executable, peer.ip, f'{peer.port}', f'{peer.id}', anchor.ip, f'{anchor.port}'], env=env
+            ))
+        time.sleep(3)
+
+        ring = sorted(peers)
+        for key in range(16):
+            uri = f'/one-hop/{key}'
+            uri_hash = dht.hash(uri.encode('latin1'))
+            owner = next((peer for peer in ring if peer.id >= uri_hash), ring[0])
+
+            for contact in peers:
+                with contextlib.closing(HTTPConnection(contact.ip, contact.port, 2)) as conn:
+                    conn.request('GET', uri)
+                    reply = conn.getresponse()
+                    reply.read()
+
+                if contact == owner:
+                    assert reply.status == 404, "Owner should answer itself"
+                else:
+                    assert reply.status == 303, "Peer should redirect without a lookup"
+                    assert reply.headers['Location'] == f'http://{owner.ip}:{owner.port}{uri}', "Peer should redirect to the owner"
+
+
+def test_one_hop_join_convergence(request):
+    """In the simulator, rings in one-hop mode converge after joins no slower than without it"""
+
+    sim = os.path.join(os.path.dirname(request.config.getoption('executable')), 'sim')
+
+    def convergence(*args):
+        total = 0
+        for seed in range(1, 11):
+            run = subprocess.run([sim, '-n', '50', '-s', f'{seed}', '-j', *args], capture_output=True, timeout=30)
+            result = json.loads(run.stdout)
+            assert result['join']['converged'], f'seed {seed}'
+            total += result['join']['convergence_s']
+        return total
+
+    # Allow for the granularity of the stabilization period, seeds diverge as gossip draws random numbers
+    assert convergence('-o') <= 1.1 * convergence()
+
+
+def ring_neighbors(peer):
+    """Return the IDs of a peer's predecessor and successor according to its ring view"""
+    with contextlib.closing(HTTPConnection(peer.ip, peer.port, 2)) as conn:
+        conn.request('GET', '/_ring')
+        entries = dht.deserialize_ring(conn.getresponse().read())
+    predecessor = next((e.from_ for e in entries if e.role == dht.RingRole.self), None)
+    successor = next((e.peer.id for e in entries if e.role == dht.RingRole.successor), peer.id)
+    return predecessor, successor
+
+
+def test_failure_recovery(request):
+    """Once a peer fails, its neighbors stop waiting for it and close the ring"""
+
+    executable = request.config.getoption('executable')
+    anchor, failing, survivor = (dht.Peer(id_, '127.0.0.1', 4710 + i) for i, id_ in enumerate([0x1000, 0x5000, 0x9000]))
+
+    with contextlib.ExitStack() as contexts:
+        contexts.enter_context(util.KillOnExit([executable, anchor.ip, f'{anchor.port}', f'{anchor.id}']))
+        contexts.enter_context(util.KillOnExit(
+            [executable, survivor.ip, f'{survivor.port}', f'{survivor.id}', anchor.ip, f'{anchor.port}']
+        ))
+        with util.KillOnExit(
+            [executable, failing.ip, f'{failing.port}', f'{failing.id}', anchor.ip, f'{anchor.port}']
+        ):
+            for _ in range(50):
+                if ring_neighbors(anchor) == (survivor.id, failing.id):
+                    break
+                time.sleep(.1)
+            assert ring_neighbors(anchor) == (survivor.id, failing.id), "Ring should form"
+
+        # Three unanswered stabilizes and the predecessor timeout take a few seconds
+        for _ in range(150):
+            if ring_neighbors(anchor) == (survivor.id, survivor.id) and ring_neighbors(survivor) == (anchor.id, anchor.id):
+                break
+            time.sleep(.1)
+        assert ring_neighbors(anchor) == (survivor.id, survivor.id), "Anchor should skip the failed peer"
+        assert ring_neighbors(survivor) == (anchor.id, anchor.id), "Survivor should skip the failed peer"
+
+
+def test_stabilize_while_joining(request, timeout):
+    """A joining peer does not answer stabilizes, so a predecessor that missed its splice gives up on it"""
+
+    executable = request.config.getoption('executable')
+    anchor, predecessor, self = (dht.Peer(id_, '127.0.0.1', 4710 + i) for i, id_ in enumerate([0x1000, 0x5000, 0x9000]))
+
+    with dht.peer_socket(anchor, timeout) as anchor_mock, dht.peer_socket(predecessor, timeout) as pred_mock:
+        with util.KillOnExit([executable, self.ip, f'{self.port}', f'{self.id}', anchor.ip, f'{anchor.port}']):
+            time.sleep(.1)
+            dht.expect_msg(anchor_mock, dht.Message(dht.Flags.join, None, self))
+
+            stabilize = dht.Message(dht.Flags.stabilize, predecessor.id, predecessor)
+            pred_mock.sendto(dht.serialize(stabilize), (self.ip, self.port))
+            time.sleep(.1)
+
+            assert util.bytes_available(pred_mock) == 0, "Joining peer should not answer stabilize"
+
+
+def test_ring_view(static_peer):
+    """The ring view describes our own and our successor's range"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with static_peer(self, predecessor, successor), contextlib.closing(
+        HTTPConnection(self.ip, self.port, 2)
+    ) as conn:
+        conn.request('GET', '/_ring')
+        reply = conn.getresponse()
+        assert reply.status == 200, "Ring view should be served locally"
+
+        entries = dht.deserialize_ring(reply.read())
+        assert dht.RingEntry(dht.RingRole.self, predecessor.id, self) in entries
+        assert dht.RingEntry(dht.RingRole.successor, self.id, successor) in entries
+
+
+def serialize_batch(records):
+    """Serialize (op, key, value) records for `/_batch`"""
+    return b''.join(
+        struct.pack('!BHI', op, len(key), len(value)) + key + value
+        for op, key, value in records
+    )
+
+
+def deserialize_batch(data):
+    """Deserialize `/_batch` results into a dict of index -> (status, value)"""
+    results = {}
+    while data:
+        index, status, length = struct.unpack('!IHI', data[:10])
+        results[index] = (status, data[10:10 + length])
+        data = data[10 + length:]
+    return results
+
+
+def run_batch(conn, records, attempts=5):
+    """Run a batch, retrying records answered with 503 like a client would"""
+    records = list(records)
+    pending = list(range(len(records)))
+    results = {}
+    for _ in range(attempts):
+        conn.request('POST', '/_batch', serialize_batch(records[i] for i in pending))
+        reply = conn.getresponse()
+        assert reply.status == 200
+        for index, result in deserialize_batch(reply.read()).items():
+            results[pending[index]] = result
+        pending = [i for i in pending if results[i][0] == 503]
+        if not pending:
+            break
+        time.sleep(.1)
+    return results
+
+
+def test_batch(static_peer):
+    """A batch is split among the responsible peers, all results are streamed back"""
+
+    peers = [dht.Peer(id_, '127.0.0.1', 4710 + i) for i, id_ in enumerate([0x4000, 0x8000, 0xc000])]
+    keys = [f'/batch/{i}'.encode() for i in range(30)]
+    values = [util.randbytes(i * 37) for i in range(30)]
+
+    with contextlib.ExitStack() as contexts:
+        for i, peer in enumerate(peers):
+            contexts.enter_context(static_peer(peer, peers[i - 1], peers[(i + 1) % len(peers)]))
+        conn = contexts.enter_context(contextlib.closing(HTTPConnection(peers[0].ip, peers[0].port, 2)))
+
+        owners = {dht.hash(key) for key in keys}
+        assert len({next((p for p in peers if p.id >= h), peers[0]) for h in owners}) == 3, "Keys should span all peers"
+
+        results = run_batch(conn, ((BATCH_PUT, key, value) for key, value in zip(keys, values)))
+        assert results == {i: (201, b'') for i in range(len(keys))}, "All keys should be created"
+
+        # Owners are known by now, so nothing needs to be retried
+        conn.request('POST', '/_batch', serialize_batch([(BATCH_GET, key, b'') for key in keys] + [(BATCH_DELETE, keys[0], b'')]))
+        reply = conn.getresponse()
+        assert reply.status == 200
+        results = deserialize_batch(reply.read())
+        assert results == {**{i: (200, value) for i, value in enumerate(values)}, len(keys): (204, b'')}
+
+
+def test_batch_local(static_peer):
+    """Peers only answer records they are responsible for on `/_batch/local`"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x8000, '127.0.0.1', 4711)
+    successor = dht.Peer(0xc000, '127.0.0.1', 4712)
+    keys = [f'/local/{i}'.encode() for i in range(16)]
+
+    with static_peer(self, predecessor, successor), contextlib.closing(
+        HTTPConnection(self.ip, self.port, 2)
+    ) as conn:
+        conn.request('POST', '/_batch/local', serialize_batch((BATCH_GET, key, b'') for key in keys))
+        reply = conn.getresponse()
+        assert reply.status == 200
+
+        results = deserialize_batch(reply.read())
+        for i, key in enumerate(keys):
+            expected = 404 if predecessor.id < dht.hash(key) <= self.id else 421
+            assert results[i] == (expected, b'')
+
+
+def test_bulk_load(static_peer, request):
+    """The bulk loader sends each peer its records, keys of the same batch are served afterwards"""
+
+    executable = request.config.getoption('executable')
+    bulkload = os.path.join(os.path.dirname(executable), 'bulkload')
+    peers = [dht.Peer(id_, '127.0.0.1', 4710 + i) for i, id_ in enumerate([0x4000, 0x8000, 0xc000])]
+    records = [(BATCH_PUT, f'/bulk/{i}'.encode(), util.randbytes(i % 100)) for i in range(2000)]
+
+    with contextlib.ExitStack() as contexts:
+        for i, peer in enumerate(peers):
+            contexts.enter_context(static_peer(peer, peers[i - 1], peers[(i + 1) % len(peers)]))
+
+        loader = subprocess.run([bulkload, peers[0].ip, f'{peers[0].port}'], input=serialize_batch(records),
+                                capture_output=True, timeout=10)
+        assert loader.returncode == 0, loader.stderr
+        assert loader.stdout.startswith(b'2000 records loaded in 3 batches'), "Each peer should receive a single batch"
+
+        conn = contexts.enter_context(contextlib.closing(HTTPConnection(peers[1].ip, peers[1].port, 2)))
+        results = run_batch(conn, [(BATCH_GET, key, b'') for _, key, _ in records])
+        assert results == {i: (200, value) for i, (_, _, value) in enumerate(records)}
+
+        stored = 0
+        for peer in peers:
+            with contextlib.closing(HTTPConnection(peer.ip, peer.port, 2)) as metrics_conn:
+                metrics_conn.request('GET', '/_metrics')
+                samples = dict(line.rsplit(' ', 1) for line in metrics_conn.getresponse().read().decode().splitlines()
+                               if not line.startswith('#'))
+            assert samples['rn_load_records_total{result="refused"}'] == '0'
+            stored += int(samples['rn_load_records_total{result="stored"}'])
+        assert stored == len(records)
+
+
+def test_pipelined_wraparound(request, port):
+    """Pipelined requests are answered in order, also once the input buffer wrapped around"""
+
+    executable = request.config.getoption('executable')
+    payload = b'x' * 700
+    put = b'PUT /wrap HTTP/1.1\r\nContent-Length: %d\r\n\r\n%s' % (len(payload), payload)
+    get = b'GET /wrap HTTP/1.1\r\n\r\n'
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}']), socket.create_connection(('127.0.0.1', port)) as conn:
+        conn.settimeout(2)
+        stream = put + get * 600
+
+        # Split requests across sends at odd offsets
+        for offset in range(0, len(stream), 1000):
+            conn.sendall(stream[offset:offset + 1000])
+            time.sleep(.001)
+
+        expected = b'HTTP/1.1 201' + b'HTTP/1.1 200' * 600
+        replies = b''
+        while replies.count(b'HTTP/1.1') < 601:
+            data = conn.recv(1 << 16)
+            assert data, "Connection closed early"
+            replies += data
+
+        statuses = b''.join(re.findall(rb'HTTP/1\.1 \d+', replies))
+        assert statuses == expected
+        assert replies.count(payload) == 600
+
+
+def test_too_many_headers(request, port):
+    """Requests with more headers than supported are rejected, the peer keeps running"""
+
+    executable = request.config.getoption('executable')
+    headers = b''.join(b'X-Header-%d: %d\r\n' % (i, i) for i in range(100))
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}']) as server:
+        with socket.create_connection(('127.0.0.1', port)) as conn:
+            conn.settimeout(2)
+            conn.sendall(b'GET /static/foo HTTP/1.1\r\n' + headers + b'\r\n')
+            assert conn.recv(1024).startswith(b'HTTP/1.1 400')
+
+        assert server.poll() is None, "Server should not terminate"
+
+
+def test_header_handling(request, port):
+    """Headers are matched by their full name, case-insensitively; keep-alive keeps the connection"""
+
+    executable = request.config.getoption('executable')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}']), socket.create_connection(('127.0.0.1', port)) as conn:
+        conn.settimeout(2)
+
+        # A prefix of Content-Length is not Content-Length
+        conn.sendall(b'PUT /headers HTTP/1.1\r\nContent: 9\r\ncontent-length:  3 \r\nConnection: Keep-Alive\r\n\r\nabc')
+        assert conn.recv(1024).startswith(b'HTTP/1.1 201')
+
+        conn.sendall(b'GET /headers HTTP/1.1\r\nCONNECTION: close\r\n\r\n')
+        reply = b''
+        while data := conn.recv(1024):
+            reply += data
+        assert reply.startswith(b'HTTP/1.1 200') and reply.endswith(b'\r\n\r\nabc'), "Connection should be closed after the reply"
+
+
+def test_stages(request, port):
+    """Every request is timed per stage, the histograms are served at `/_stages`"""
+
+    executable = request.config.getoption('executable')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}']):
+        conn = HTTPConnection('127.0.0.1', port)
+        for _ in range(3):
+            conn.request('GET', '/static/foo')
+            conn.getresponse().read()
+
+        conn.request('GET', '/_stages')
+        report = conn.getresponse().read().decode()
+        counts = {line.split()[0]: int(line.split()[1]) for line in report.splitlines()[1:]}
+        assert counts['parse'] >= 3 and counts['hash'] == 3 and counts['store'] == 3
+
+        conn.request('DELETE', '/_stages')
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 204
+        conn.request('GET', '/_stages')
+        report = conn.getresponse().read().decode()
+        counts = {line.split()[0]: int(line.split()[1]) for line in report.splitlines()[1:]}
+        assert counts['hash'] == 0
+
+
+def test_local_endpoints(static_peer):
+    """Requests for `/_` URIs are answered locally, even if unknown or with the wrong method"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with static_peer(self, predecessor, successor), contextlib.closing(
+        HTTPConnection(self.ip, self.port, 2)
+    ) as conn:
+        for method, uri, status, allow in (
+            ('PUT', '/_ring', 405, 'GET'),
+            ('GET', '/_batch', 405, 'POST'),
+            ('POST', '/_stages', 405, 'GET, DELETE'),
+            ('DELETE', '/_metrics', 405, 'GET'),
+            ('GET', '/_snapshot', 405, 'POST'),
+            ('GET', '/_unknown', 404, None),
+            ('PUT', '/_unknown', 404, None),
+        ):
+            conn.request(method, uri, body=b'x' if method == 'PUT' else None)
+            reply = conn.getresponse()
+            reply.read()
+            assert (reply.status, reply.getheader('Allow')) == (status, allow), f'{method} {uri}'
+
+
+def test_metrics(request, port):
+    """Counters are served locally at `/_metrics` in Prometheus' text format"""
+
+    executable = request.config.getoption('executable')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}']):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri in ('/static/foo', '/static/foo', '/missing'):
+            conn.request('GET', uri)
+            conn.getresponse().read()
+        conn.request('PUT', '/new', body=b'value')
+        conn.getresponse().read()
+
+        conn.request('GET', '/_metrics')
+        reply = conn.getresponse()
+        assert reply.status == 200
+        assert reply.getheader('Content-Type').startswith('text/plain')
+        samples = {}
+        for line in reply.read().decode().splitlines():
+            if not line.startswith('#'):
+                name, value = line.rsplit(' ', 1)
+                samples[name] = float(value)
+
+        assert samples['rn_requests_total{method="GET",status="200"}'] == 2
+        assert samples['rn_requests_total{method="GET",status="404"}'] == 1
+        assert samples['rn_requests_total{method="PUT",status="201"}'] == 1
+        assert samples['rn_connections_active'] == 1
+        assert samples['rn_store_resources'] == 4
+        assert samples['rn_received_bytes_total'] > 0
+        assert samples['rn_sent_bytes_total'] > 0
+        assert 'rn_dht_messages_received_total{type="lookup"}' in samples
+
+
+def test_access_log(request, port):
+    """Requests are logged by a background thread, filtered by level and sampled"""
+
+    executable = request.config.getoption('executable')
+
+    env = dict(os.environ, ACCESS_LOG='errors', ACCESS_LOG_SAMPLE='2')
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.PIPE) as server:
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri in ('/static/foo', '/missing/1', '/static/bar', '/missing/2', '/missing/3'):
+            conn.request('GET', uri)
+            conn.getresponse().read()
+        time.sleep(.1)  # Let the log catch up
+        server.kill()
+        lines = server.stderr.read().decode().splitlines()
+
+    assert [line for line in lines if ' GET ' in line] == ['0: GET /missing/1 404 (0 byte payload)',
+                                                           '0: GET /missing/3 404 (0 byte payload)']
+
+
+def test_trace(static_peer, timeout):
+    """DHT messages and cache insertions are recorded in the trace served at `/_trace`"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+    responsible = dht.Peer(0x4000, '127.0.0.1', 4713)
+
+    with dht.peer_socket(
+        predecessor, timeout
+    ) as pred_mock, static_peer(
+        self, predecessor, successor
+    ), dht.peer_socket(
+        successor, timeout
+    ):
+        lookup = dht.Message(dht.Flags.lookup, 0x2800, predecessor)
+        pred_mock.sendto(dht.serialize(lookup), (self.ip, self.port))
+        reply = dht.Message(dht.Flags.reply, 0x3000, responsible)
+        pred_mock.sendto(dht.serialize(reply), (self.ip, self.port))
+        time.sleep(.1)
+
+        conn = HTTPConnection(self.ip, self.port)
+        conn.request('GET', '/_trace')
+        recorded, records = dht.deserialize_trace(conn.getresponse().read())
+
+    assert recorded == len(records)
+    events = [(r.type, r.opcode, r.hash, r.peer, r.remote) for r in records]
+    sender = dht.Peer(0, predecessor.ip, predecessor.port)
+    assert events == [
+        (dht.TraceType.recv, dht.Flags.lookup.value, 0x2800, predecessor, sender),
+        (dht.TraceType.send, dht.Flags.lookup.value, 0x2800, predecessor, successor),
+        (dht.TraceType.recv, dht.Flags.reply.value, 0x3000, responsible, sender),
+        (dht.TraceType.cache, dht.Flags.reply.value, 0x3000, responsible, dht.Peer(0, '0.0.0.0', 0)),
+    ]
+
+
+def test_write_ahead_log(request, port, tmp_path):
+    """Changes are logged when `WAL_FILE` is set and recovered after a crash, a torn record is dropped"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, WAL_FILE=str(tmp_path / 'wal'), WAL_COMMIT_MS='5')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri, body in (('/a', b'first'), ('/b', b'second'), ('/a', b'third')):
+            conn.request('PUT', uri, body=body)
+            assert conn.getresponse().read() == b''
+        conn.request('DELETE', '/static/foo')
+        assert conn.getresponse().status == 204
+
+    # A record torn by the crash
+    with open(tmp_path / 'wal', 'ab') as log:
+        log.write(b'\x01\x02\x03')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri, status, body in (('/a', 200, b'third'), ('/b', 200, b'second'), ('/static/foo', 404, b'')):
+            conn.request('GET', uri)
+            reply = conn.getresponse()
+            assert (reply.status, reply.read()) == (status, body)
+        conn.request('PUT', '/c', body=b'fourth')
+        conn.getresponse().read()
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL):
+        conn = HTTPConnection('127.0.0.1', port)
+        conn.request('GET', '/c')
+        assert conn.getresponse().read() == b'fourth'
+
+
+def test_uri_too_long(request, port, tmp_path):
+    """URIs longer than a key may be are rejected before they reach the store or the log"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, WAL_FILE=str(tmp_path / 'wal'), WAL_COMMIT_MS='5')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri, status in (('/a', 201), ('/' + 'x' * 70000, 414), ('/b', 201)):
+            conn.request('PUT', uri, body=b'value')
+            reply = conn.getresponse()
+            reply.read()
+            assert reply.status == status
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri in ('/a', '/b'):
+            conn.request('GET', uri)
+            reply = conn.getresponse()
+            assert (reply.status, reply.read()) == (200, b'value')
+
+
+def test_snapshot(request, port, tmp_path):
+    """A snapshot is taken in the background and mapped on start, only the log's tail is replayed on top of it"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, WAL_FILE=str(tmp_path / 'wal'), SNAPSHOT_FILE=str(tmp_path / 'snapshot'))
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri, body in (('/a', b'first'), ('/b', b'second')):
+            conn.request('PUT', uri, body=body)
+            conn.getresponse().read()
+        conn.request('POST', '/_snapshot')
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 202
+
+        # The snapshot is written by a child process, its completion is reported at `/_metrics`
+        for _ in range(100):
+            conn.request('GET', '/_metrics')
+            metrics = conn.getresponse().read().decode()
+            if 'rn_snapshots_total{result="success"} 1' in metrics:
+                break
+            time.sleep(.02)
+        assert 'rn_snapshot_running 0' in metrics
+        assert re.search(r'^rn_snapshot_last_success_timestamp_seconds [1-9]', metrics, re.MULTILINE)
+        assert os.path.getsize(tmp_path / 'wal') == 8, "The snapshot should make the log's records obsolete"
+        assert not os.path.exists(tmp_path / 'wal.old')
+
+        conn.request('PUT', '/b', body=b'third')
+        conn.getresponse().read()
+        conn.request('DELETE', '/static/foo')
+        conn.getresponse().read()
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL):
+        conn = HTTPConnection('127.0.0.1', port)
+        for uri, status, body in (('/a', 200, b'first'), ('/b', 200, b'third'), ('/static/foo', 404, b''),
+                                  ('/static/bar', 200, b'Bar')):
+            conn.request('GET', uri)
+            reply = conn.getresponse()
+            assert (reply.status, reply.read()) == (status, body)
+
+        # Entries in the mapping can be overwritten and deleted like any other
+        conn.request('PUT', '/a', body=b'fourth')
+        assert conn.getresponse().read() == b''
+        conn.request('DELETE', '/static/bar')
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 204
+        conn.request('GET', '/a')
+        assert conn.getresponse().read() == b'fourth'
+
+
+@pytest.mark.parametrize('name, value', [
+    ('SNAPSHOT_INTERVAL_S', '0'),
+    ('SNAPSHOT_INTERVAL_S', '-1'),
+    ('SNAPSHOT_INTERVAL_S', '86400s'),
+    ('SNAPSHOT_INTERVAL_S', '99999999999'),
+    ('WAL_COMMIT_MS', '65538'),
+    ('WAL_COMMIT_MS', '10001'),
+    ('WAL_COMMIT_MS', '5ms'),
+    ('ACCESS_LOG_SAMPLE', '4294967296'),
+    ('ACCESS_LOG_SAMPLE', '-1'),
+])
+def test_invalid_setting(request, port, tmp_path, name, value):
+    """Settings out of range are refused rather than truncated"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, SNAPSHOT_FILE=str(tmp_path / 'snapshot'), WAL_FILE=str(tmp_path / 'wal'), **{name: value})
+
+    server = subprocess.run([executable, '127.0.0.1', f'{port}'], env=env, capture_output=True, timeout=5)
+    assert server.returncode != 0
+    assert f'Failed to parse {name}'.encode() in server.stderr
+
+
+def test_snapshot_unreaped(request, port, tmp_path):
+    """A snapshot child whose exit status cannot be collected counts as failed"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, SNAPSHOT_FILE=str(tmp_path / 'snapshot'))
+
+    # With SIGCHLD ignored, children are reaped automatically and waitpid() fails
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL,
+                         preexec_fn=lambda: signal.signal(signal.SIGCHLD, signal.SIG_IGN)):
+        conn = HTTPConnection('127.0.0.1', port, 2)
+        conn.request('POST', '/_snapshot')
+        reply = conn.getresponse()
+        reply.read()
+        assert reply.status == 202
+
+        for _ in range(100):
+            conn.request('GET', '/_metrics')
+            metrics = conn.getresponse().read().decode()
+            if 'rn_snapshots_total{result="failure"} 1' in metrics:
+                break
+            time.sleep(.02)
+        assert 'rn_snapshots_total{result="failure"} 1' in metrics
+        assert 'rn_snapshot_running 0' in metrics
+
+
+def test_cache(request, port):
+    """With `CACHE_BYTES`, the store stays within its budget, and keys used again survive a scan"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, CACHE_BYTES='65536')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env):
+        conn = HTTPConnection('127.0.0.1', port)
+        conn.request('PUT', '/hot', body=b'hot')
+        conn.getresponse().read()
+        conn.request('GET', '/hot')
+        conn.getresponse().read()
+
+        # Far more keys than fit, each used once
+        for i in range(500):
+            conn.request('PUT', f'/scan/{i}', body=bytes(1000))
+            conn.getresponse().read()
+        conn.request('PUT', '/huge', body=bytes(70000))
+        conn.getresponse().read()
+
+        for uri, status in (('/hot', 200), ('/scan/0', 404), ('/scan/499', 200), ('/huge', 404)):
+            conn.request('GET', uri)
+            reply = conn.getresponse()
+            reply.read()
+            assert reply.status == status, uri
+
+        conn.request('GET', '/_metrics')
+        samples = {}
+        for line in conn.getresponse().read().decode().splitlines():
+            if not line.startswith('#'):
+                name, value = line.rsplit(' ', 1)
+                samples[name] = float(value)
+
+        assert samples['rn_store_budget_bytes'] == 65536
+        assert (samples['rn_store_segment_bytes{segment="probation"}']
+                + samples['rn_store_segment_bytes{segment="protected"}']) <= 65536
+        assert samples['rn_store_bytes'] < 65536
+        assert samples['rn_store_evictions_total{segment="probation"}'] > 400
+        assert samples['rn_store_evictions_total{segment="protected"}'] == 0
+        assert samples['rn_store_promotions_total'] == 2  # /hot and /scan/499
+        assert samples['rn_store_rejections_total'] == 1
+
+
+def test_cache_value_too_large(request, port, tmp_path):
+    """A value exceeding the whole `CACHE_BYTES` budget is refused with 413, neither stored nor logged"""
+
+    executable = request.config.getoption('executable')
+    env = dict(os.environ, CACHE_BYTES='65536', WAL_FILE=str(tmp_path / 'wal'), WAL_COMMIT_MS='5')
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env):
+        conn = HTTPConnection('127.0.0.1', port)
+        for body, status in ((b'small', 201), (bytes(70000), 413)):
+            conn.request('PUT', '/value', body=body)
+            reply = conn.getresponse()
+            reply.read()
+            assert reply.status == status
+
+        conn.request('GET', '/value')
+        reply = conn.getresponse()
+        assert (reply.status, reply.read()) == (200, b'small'), "The previous value should be kept"
+
+    with util.KillOnExit([executable, '127.0.0.1', f'{port}'], env=env, stderr=subprocess.DEVNULL):
+        conn = HTTPConnection('127.0.0.1', port)
+        conn.request('GET', '/value')
+        reply = conn.getresponse()
+        assert (reply.status, reply.read()) == (200, b'small')
+    assert os.path.getsize(tmp_path / 'wal') < 1000, "The refused value should not be logged"
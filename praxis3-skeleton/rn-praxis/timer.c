@@ -0,0 +1,55 @@
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+#define MAX_TIMERS 8
+
+
+static struct {
+    timer_deadline deadline;
+    timer_callback callback;
+} timers[MAX_TIMERS];
+static size_t n_timers = 0;
+
+
+void timer_register(timer_deadline deadline, timer_callback callback) {
+    if (n_timers == MAX_TIMERS) {
+        fprintf(stderr, "Exceeded max timer count.\n");
+        exit(EXIT_FAILURE);
+    }
+    timers[n_timers].deadline = deadline;
+    timers[n_timers].callback = callback;
+    n_timers += 1;
+}
+
+
+int timer_poll_timeout(void) {
+    unsigned long earliest = TIMER_NEVER;
+    for (size_t i = 0; i < n_timers; i += 1) {
+        const unsigned long deadline = timers[i].deadline();
+        if (deadline < earliest) {
+            earliest = deadline;
+        }
+    }
+
+    if (earliest == TIMER_NEVER) {
+        return -1;
+    } else if (earliest <= time_ms()) {
+        return 0;
+    } else if (earliest - time_ms() > INT_MAX) {
+        return INT_MAX;
+    }
+    return earliest - time_ms();
+}
+
+
+void timer_dispatch(void) {
+    for (size_t i = 0; i < n_timers; i += 1) {
+        if (timers[i].deadline() <= time_ms()) {
+            timers[i].callback();
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <limits.h>
+
+
+/**
+ * Deadline of a timer that is not due at all
+ */
+#define TIMER_NEVER ULONG_MAX
+
+/**
+ * Report the absolute time (see `time_ms()`) of a subsystem's next activity,
+ * or `TIMER_NEVER`.
+ */
+typedef unsigned long (*timer_deadline)(void);
+
+/**
+ * Perform a subsystem's due activities
+ */
+typedef void (*timer_callback)(void);
+
+/**
+ * Register a subsystem with the event loop's timers
+ *
+ * Deadlines are polled before every call to `poll()`, so subsystems can move
+ * them freely without notifying the timer subsystem.
+ */
+void timer_register(timer_deadline deadline, timer_callback callback);
+
+/**
+ * Return the number of milliseconds until the earliest deadline
+ *
+ * Suitable as timeout for `poll()`: -1 if no deadline is set, 0 if one has
+ * already passed.
+ */
+int timer_poll_timeout(void);
+
+/**
+ * Invoke the callbacks of all subsystems whose deadline has passed
+ */
+void timer_dispatch(void);
@@ -0,0 +1,141 @@
+/**
+* trace.c dumps the flight recorder of DHT events, see `trace.h`.
+*/
+
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct trace trace;
+
+// Where `dump_on_signal()` writes to
+static char crash_path[256];
+
+
+/**
+ * Encode a peer as in DHT messages
+ */
+static uint8_t* encode_peer(uint8_t* out, const struct peer* peer) {
+    const uint16_t id = htons(peer->id);
+    const uint32_t ip = htonl(peer->ip.s_addr);
+    const uint16_t port = htons(peer->port);
+    memcpy(out, &id, sizeof id);
+    memcpy(out + 2, &ip, sizeof ip);
+    memcpy(out + 6, &port, sizeof port);
+    return out + 8;
+}
+
+
+/**
+ * Encode the dump's header, returning the position following it
+ */
+static uint8_t* encode_header(uint8_t* out) {
+    const uint32_t recorded_high = htonl(trace.recorded >> 32);
+    const uint32_t recorded_low = htonl(trace.recorded);
+    memcpy(out, TRACE_MAGIC, 4);
+    out[4] = TRACE_VERSION;
+    memset(out + 5, 0, 3);
+    memcpy(out + 8, &recorded_high, sizeof recorded_high);
+    memcpy(out + 12, &recorded_low, sizeof recorded_low);
+    return out + TRACE_HEADER_SIZE;
+}
+
+
+/**
+ * Encode a record, returning the position following it
+ */
+static uint8_t* encode_record(uint8_t* out, const struct trace_record* record) {
+    const uint32_t time = htonl(record->time);
+    const uint16_t hash = htons(record->hash);
+    memcpy(out, &time, sizeof time);
+    out[4] = record->type;
+    out[5] = record->opcode;
+    memcpy(out + 6, &hash, sizeof hash);
+    out = encode_peer(out + 8, &record->peer);
+    return encode_peer(out, &record->remote);
+}
+
+
+/**
+ * Return the number of records held and the index of the oldest one
+ */
+static size_t held(uint64_t* first) {
+    const size_t n = trace.recorded < TRACE_ENTRIES ? trace.recorded : TRACE_ENTRIES;
+    *first = trace.recorded - n;
+    return n;
+}
+
+
+size_t trace_dump_size(void) {
+    uint64_t first;
+    return TRACE_HEADER_SIZE + held(&first) * TRACE_RECORD_SIZE;
+}
+
+
+void trace_dump(uint8_t* out) {
+    uint64_t first;
+    const size_t n = held(&first);
+    out = encode_header(out);
+    for (size_t i = 0; i < n; i += 1) {
+        out = encode_record(out, &trace.records[(first + i) % TRACE_ENTRIES]);
+    }
+}
+
+
+/**
+ * Write all of `data` to `fd`, only using async-signal-safe functions
+ */
+static void write_all(int fd, const uint8_t* data, size_t n) {
+    while (n > 0) {
+        const ssize_t written = write(fd, data, n);
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        n -= written;
+    }
+}
+
+
+/**
+ * Signal handler writing the dump in chunks, then re-raising the signal
+ */
+static void dump_on_signal(int signum) {
+    const int fd = open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        uint8_t chunk[256 * TRACE_RECORD_SIZE];
+        uint64_t first;
+        const size_t n = held(&first);
+
+        write_all(fd, chunk, encode_header(chunk) - chunk);
+        for (size_t i = 0; i < n; ) {
+            uint8_t* pos = chunk;
+            for (; i < n && pos < chunk + sizeof chunk; i += 1) {
+                pos = encode_record(pos, &trace.records[(first + i) % TRACE_ENTRIES]);
+            }
+            write_all(fd, chunk, pos - chunk);
+        }
+        close(fd);
+    }
+    raise(signum);  // The handler was reset, so this terminates as usual
+}
+
+
+void trace_dump_on_crash(const char* path) {
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+    strncpy(crash_path, path, sizeof crash_path - 1);
+    struct sigaction action = {
+        .sa_handler = dump_on_signal,
+        .sa_flags = SA_RESETHAND,
+    };
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof signals / sizeof signals[0]; i += 1) {
+        sigaction(signals[i], &action, NULL);
+    }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dht.h"
+#include "util.h"
+
+
+/**
+ * Number of events the trace holds, a power of two
+ */
+#define TRACE_ENTRIES (1 << 16)
+
+/**
+ * Binary dump of the trace, as served at `/_trace`
+ *
+ *   | magic "TRCE" (4) | version (1) | reserved (3) | recorded (8) | records ...
+ *
+ * `recorded` counts all events since the start, so the difference to the
+ * number of records tells how many were overwritten. Records are ordered
+ * from the oldest to the newest, each in network byte order:
+ *
+ *   | time (4) | type (1) | opcode (1) | hash (2) | peer (8) | remote (8) |
+ *
+ * Both peers are encoded as in DHT messages: ID, IPv4 address, and port.
+ */
+#define TRACE_MAGIC "TRCE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_SIZE 24
+
+/**
+ * Types of trace events
+ *
+ * `TRACE_SEND`, `TRACE_RECV`: a DHT message with its `opcode`, `hash` and
+ *                `peer`. `remote` is the destination, or the sender if known.
+ * `TRACE_PREDECESSOR`, `TRACE_SUCCESSOR`: a neighbor changed to `peer`,
+ *                `remote` is the previous one
+ * `TRACE_CACHE`: `peer` was entered into the lookup cache as responsible
+ *                for the IDs after `hash`
+ */
+enum trace_type {
+    TRACE_SEND,
+    TRACE_RECV,
+    TRACE_PREDECESSOR,
+    TRACE_SUCCESSOR,
+    TRACE_CACHE,
+};
+
+/**
+ * A recorded event, in host byte order
+ */
+struct trace_record {
+    uint32_t time;
+    uint8_t type;
+    uint8_t opcode;
+    dht_id hash;
+    struct peer peer;
+    struct peer remote;
+};
+
+/**
+ * The flight recorder: the last `TRACE_ENTRIES` events
+ *
+ * `recorded` only grows, the next event goes to its index modulo
+ * `TRACE_ENTRIES`.
+ */
+struct trace {
+    uint64_t recorded;
+    struct trace_record records[TRACE_ENTRIES];
+};
+
+extern struct trace trace;
+
+
+/**
+ * Record an event, see `enum trace_type` for the meaning of the arguments
+ *
+ * A few stores into memory that is likely cached, always on. `remote` may
+ * be NULL.
+ */
+static inline void trace_event(enum trace_type type, uint8_t opcode, dht_id hash, const struct peer* peer,
+                               const struct peer* remote) {
+    struct trace_record* record = &trace.records[trace.recorded % TRACE_ENTRIES];
+    trace.recorded += 1;
+    record->time = clock_now_ms;
+    record->type = type;
+    record->opcode = opcode;
+    record->hash = hash;
+    record->peer = *peer;
+    record->remote = remote ? *remote : (struct peer) {0};
+}
+
+/**
+ * Return the size of the dump `trace_dump()` currently produces
+ */
+size_t trace_dump_size(void);
+
+/**
+ * Write a dump of the trace into `out`, which has room for `trace_dump_size()` bytes
+ */
+void trace_dump(uint8_t* out);
+
+/**
+ * Write a dump of the trace to `path` when the process crashes
+ *
+ * Covers SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT. The signal is raised
+ * again afterwards, so the process still terminates as before.
+ */
+void trace_dump_on_crash(const char* path);
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Decode a trace of DHT events, see `trace.h`
+
+The trace is read from a dump file, as written when a webserver crashes, or
+fetched from a running webserver's `/_trace`:
+
+    ./trace_decode.py rn-trace-4711.bin
+    ./trace_decode.py http://127.0.0.1:4711
+"""
+
+import argparse
+import os
+import sys
+import urllib.request
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), 'test'))
+import dht  # noqa: E402
+
+
+def format_peer(peer):
+    if peer.port == 0:
+        return '-'
+    return f'{peer.id:#06x}@{peer.ip}:{peer.port}' if peer.id else f'{peer.ip}:{peer.port}'
+
+
+def format_record(record, start):
+    time = f'{(record.time - start) & 0xffffffff:>9}'
+    if record.type in (dht.TraceType.send, dht.TraceType.recv):
+        direction = 'to' if record.type == dht.TraceType.send else 'from'
+        try:
+            opcode = dht.Flags(record.opcode).name
+        except ValueError:
+            opcode = f'opcode {record.opcode}'
+        return (f'{time} {record.type.name:<11} {opcode:<9} hash {record.hash:#06x} '
+                f'peer {format_peer(record.peer)} {direction} {format_peer(record.remote)}')
+    elif record.type == dht.TraceType.cache:
+        return f'{time} {record.type.name:<11} ({record.hash:#06x}, {record.peer.id:#06x}] at {format_peer(record.peer)}'
+    else:
+        return f'{time} {record.type.name:<11} {format_peer(record.remote)} -> {format_peer(record.peer)}'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('source', help='dump file or URL of a webserver')
+    parser.add_argument('--type', '-t', action='append', choices=[t.name for t in dht.TraceType],
+                        help='only show events of this type, may be repeated')
+    args = parser.parse_args()
+
+    if args.source.startswith('http://'):
+        with urllib.request.urlopen(args.source.rstrip('/') + '/_trace') as response:
+            data = response.read()
+    else:
+        with open(args.source, 'rb') as dump:
+            data = dump.read()
+
+    recorded, records = dht.deserialize_trace(data)
+    print(f'{recorded} events recorded, the last {len(records)} follow (time in ms)')
+    start = records[0].time if records else 0
+    for record in records:
+        if not args.type or record.type.name in args.type:
+            print(format_record(record, start))
+
+
+if __name__ == '__main__':
+    main()
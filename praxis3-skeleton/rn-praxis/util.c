@@ -1,25 +1,75 @@
 #include "util.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Coarse clocks are read from the vDSO without touching the hardware timer
+#ifdef CLOCK_MONOTONIC_COARSE
+#define CLOCK_SOURCE CLOCK_MONOTONIC_COARSE
+#else
+#define CLOCK_SOURCE CLOCK_MONOTONIC
+#endif
+
+
+unsigned long clock_now_ms = 0;
 
 
 char* memstr(char* haystack, size_t n, string needle) {
+    const size_t needle_length = strlen(needle);
     char* end = haystack + n;
 
-    // Iterate through the memory (haystack)
+    // Iterate through the memory (haystack), never looking past its end
     while ((haystack = memchr(haystack, needle[0], end - haystack)) != NULL) {
-        if (strncmp(haystack, needle, strlen(needle)) == 0) {
+        if ((size_t) (end - haystack) < needle_length) {
+            return NULL;
+        }
+        if (memcmp(haystack, needle, needle_length) == 0) {
             return haystack;
         }
+        haystack += 1;
     }
 
     return NULL;
 }
 
 
+char* buffer_append(struct buffer* buffer, size_t n) {
+    if (buffer->length + n > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 1024;
+        while (capacity < buffer->length + n) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    char* result = buffer->data + buffer->length;
+    buffer->length += n;
+    return result;
+}
+
+
+bool sync_directory_of(const char* path) {
+    char copy[4096];
+    strncpy(copy, path, sizeof copy - 1);
+    copy[sizeof copy - 1] = '\0';
+
+    const int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+
 uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int base, const string message) {
     errno = 0;
     uint16_t result = strtoul(nptr, endptr, base); // Convert string to unsigned int
@@ -30,3 +80,22 @@ uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int bas
     }
     return result;
 }
+
+
+unsigned long checked_strtoul(const char* str, unsigned long min, unsigned long max, const char* message) {
+    char* end;
+    errno = 0;
+    const unsigned long result = strtoul(str, &end, 10);
+    if (!isdigit((unsigned char) str[0]) || errno != 0 || *end != '\0' || result < min || result > max) {
+        fprintf(stderr, "%s\n", message);
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+
+void clock_tick(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_SOURCE, &spec);
+    clock_now_ms = 1000UL * spec.tv_sec + spec.tv_nsec / 1000000;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -11,6 +12,29 @@ typedef char* string; // differentiate null-terminated C-string from bytes
  */
 char* memstr(char* haystack, size_t n, string needle);
 
+/**
+ * A growable byte buffer
+ */
+struct buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+/**
+ * Make room for `n` more bytes and return a pointer to them
+ *
+ * The bytes are counted as used right away.
+ */
+char* buffer_append(struct buffer* buffer, size_t n);
+
+/**
+ * Make the creation or renaming of the file at `path` durable
+ *
+ * Syncs the directory containing it. Returns false on failure.
+ */
+bool sync_directory_of(const char* path);
+
 /**
  * Safe version of `strtoul()`
  *
@@ -18,3 +42,33 @@ char* memstr(char* haystack, size_t n, string needle);
  * In that case, the given message will be printed before exiting the program.
  */
 uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int base, const string message);
+
+/**
+ * Parse a decimal number between `min` and `max`, inclusive
+ *
+ * Unlike `safe_strtoul()`, the whole range of `unsigned long` is available.
+ * Anything but such a number, e.g., trailing characters or a sign, makes the
+ * given message be printed before exiting the program.
+ */
+unsigned long checked_strtoul(const char* str, unsigned long min, unsigned long max, const char* message);
+
+/**
+ * Time in milliseconds as sampled by the last call to `clock_tick()`
+ *
+ * Based on a monotonic clock, so only differences between values are
+ * meaningful. The event loop samples it once per iteration, making reads as
+ * cheap as a load.
+ */
+extern unsigned long clock_now_ms;
+
+/**
+ * Sample the monotonic clock into `clock_now_ms`
+ */
+void clock_tick(void);
+
+/**
+ * Return the cached current time in milliseconds
+ */
+static inline unsigned long time_ms(void) {
+    return clock_now_ms;
+}
@@ -0,0 +1,302 @@
+/**
+* wal.c keeps the store's write-ahead log, see `wal.h`.
+*/
+
+#include "wal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "timer.h"
+#include "util.h"
+
+
+static struct {
+    char path[4096];
+    char rotated_path[4096 + sizeof ".old"];
+    int fd;
+    unsigned long window_ms;
+    struct buffer pending;
+    uint64_t appended;
+    uint64_t committed;
+    unsigned long deadline;
+} wal = {
+    .fd = -1,
+    .deadline = TIMER_NEVER,
+};
+
+
+/**
+ * FNV-1a, continuing from `hash`
+ */
+static uint32_t checksum(uint32_t hash, const char* data, size_t n) {
+    for (size_t i = 0; i < n; i += 1) {
+        hash = (hash ^ (uint8_t) data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * Replay the records in `data` into the store, returning the length of the intact part
+ */
+static size_t replay(const char* data, size_t length, struct store* store) {
+    static char key[UINT16_MAX + 1];
+    size_t pos = WAL_HEADER_SIZE;
+    size_t n_records = 0;
+
+    while (length - pos >= WAL_RECORD_HEADER_SIZE) {
+        uint32_t stored_checksum;
+        uint16_t key_length;
+        uint32_t value_length;
+        const uint8_t op = data[pos + 4];
+        memcpy(&stored_checksum, data + pos, sizeof stored_checksum);
+        memcpy(&key_length, data + pos + 5, sizeof key_length);
+        memcpy(&value_length, data + pos + 7, sizeof value_length);
+
+        const size_t record_length = WAL_RECORD_HEADER_SIZE + key_length + value_length;
+        if (length - pos < record_length
+            || checksum(2166136261u, data + pos + 4, record_length - 4) != stored_checksum
+            || (op != BATCH_PUT && op != BATCH_DELETE)) {
+            break;
+        }
+
+        memcpy(key, data + pos + WAL_RECORD_HEADER_SIZE, key_length);
+        key[key_length] = '\0';
+        if (op == BATCH_PUT) {
+            store_set(store, key, data + pos + WAL_RECORD_HEADER_SIZE + key_length, value_length);
+        } else {
+            store_delete(store, key);
+        }
+        pos += record_length;
+        n_records += 1;
+    }
+
+    fprintf(stderr, "Replayed %lu records of the write-ahead log\n", n_records);
+    if (pos != length) {
+        fprintf(stderr, "Discarding %lu bytes following the last intact record\n", length - pos);
+    }
+    return pos;
+}
+
+
+/**
+ * Write the header of an empty log to `fd`
+ */
+static bool write_header(int fd) {
+    char header[WAL_HEADER_SIZE] = WAL_MAGIC;
+    header[sizeof WAL_MAGIC - 1] = WAL_VERSION;
+    return ftruncate(fd, 0) == 0 && write(fd, header, sizeof header) == sizeof header && fdatasync(fd) == 0;
+}
+
+
+/**
+ * Open the log at `path` for appending and replay it into `store`
+ *
+ * Returns the file descriptor, or -1 if the file cannot be used.
+ */
+static int open_log(const char* path, struct store* store) {
+    const int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        perror("open");
+        return -1;
+    }
+
+    size_t intact = 0;
+    if (info.st_size >= WAL_HEADER_SIZE) {
+        char* data = malloc(info.st_size);
+        if (pread(fd, data, info.st_size, 0) != info.st_size || memcmp(data, WAL_MAGIC, sizeof WAL_MAGIC - 1) != 0
+            || data[sizeof WAL_MAGIC - 1] != WAL_VERSION) {
+            fprintf(stderr, "%s is no write-ahead log\n", path);
+            free(data);
+            close(fd);
+            return -1;
+        }
+        intact = replay(data, info.st_size, store);
+        free(data);
+    }
+
+    if (intact < WAL_HEADER_SIZE && !write_header(fd)) {
+        perror("write");
+        close(fd);
+        return -1;
+    } else if (intact >= WAL_HEADER_SIZE && (off_t) intact != info.st_size && ftruncate(fd, intact) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Append the records of the current log to the rotated one, which becomes current again
+ */
+static bool merge_into_rotated(int rotated_fd) {
+    wal_commit();
+
+    struct stat info;
+    if (fstat(wal.fd, &info) == -1) {
+        return false;
+    }
+    const size_t length = info.st_size - WAL_HEADER_SIZE;
+    char* records = malloc(length);
+    const bool merged = pread(wal.fd, records, length, WAL_HEADER_SIZE) == (ssize_t) length
+                        && write(rotated_fd, records, length) == (ssize_t) length && fdatasync(rotated_fd) == 0
+                        && rename(wal.rotated_path, wal.path) == 0 && sync_directory_of(wal.path);
+    free(records);
+    if (!merged) {
+        return false;
+    }
+
+    close(wal.fd);
+    wal.fd = rotated_fd;
+    return true;
+}
+
+
+bool wal_open(const char* path, unsigned long window_ms, struct store* store) {
+    if (snprintf(wal.path, sizeof wal.path, "%s", path) >= (int) sizeof wal.path) {
+        fprintf(stderr, "Write-ahead log path too long\n");
+        return false;
+    }
+    snprintf(wal.rotated_path, sizeof wal.rotated_path, "%s.old", path);
+
+    // A log rotated for a snapshot that did not complete holds the older records
+    int rotated_fd = -1;
+    if (access(wal.rotated_path, F_OK) == 0 && (rotated_fd = open_log(wal.rotated_path, store)) == -1) {
+        return false;
+    }
+    wal.fd = open_log(path, store);
+    if (wal.fd == -1) {
+        return false;
+    }
+    if (rotated_fd != -1 && !merge_into_rotated(rotated_fd)) {
+        perror("merge");
+        return false;
+    }
+
+    wal.window_ms = window_ms;
+    return true;
+}
+
+
+bool wal_rotate(void) {
+    if (wal.fd == -1) {
+        return true;
+    }
+    wal_commit();
+
+    if (rename(wal.path, wal.rotated_path) == -1) {
+        perror("rename");
+        return false;
+    }
+    const int fd = open(wal.path, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    if (fd == -1 || !write_header(fd) || !sync_directory_of(wal.path)) {
+        perror("rotate");
+        if (fd != -1) {
+            close(fd);
+        }
+        if (rename(wal.rotated_path, wal.path) == -1) {
+            exit(EXIT_FAILURE);  // Neither log is where it belongs
+        }
+        return false;
+    }
+
+    close(wal.fd);
+    wal.fd = fd;
+    return true;
+}
+
+
+void wal_rotation_done(bool success) {
+    if (wal.fd == -1) {
+        return;
+    }
+
+    if (success) {
+        unlink(wal.rotated_path);  // Replaying it again would be harmless, so no need to sync
+        return;
+    }
+    const int rotated_fd = open(wal.rotated_path, O_RDWR | O_APPEND);
+    if (rotated_fd == -1 || !merge_into_rotated(rotated_fd)) {
+        perror("merge");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+bool wal_enabled(void) {
+    return wal.fd != -1;
+}
+
+
+void wal_append(uint8_t op, const char* key, size_t key_length, const char* value, size_t value_length) {
+    if (wal.fd == -1) {
+        return;
+    }
+
+    const uint16_t key_length_field = key_length;
+    const uint32_t value_length_field = value_length;
+    char* record = buffer_append(&wal.pending, WAL_RECORD_HEADER_SIZE + key_length + value_length);
+    record[4] = op;
+    memcpy(record + 5, &key_length_field, sizeof key_length_field);
+    memcpy(record + 7, &value_length_field, sizeof value_length_field);
+    memcpy(record + WAL_RECORD_HEADER_SIZE, key, key_length);
+    memcpy(record + WAL_RECORD_HEADER_SIZE + key_length, value, value_length);
+
+    uint32_t sum = checksum(2166136261u, record + 4, WAL_RECORD_HEADER_SIZE - 4);
+    sum = checksum(sum, key, key_length);
+    sum = checksum(sum, value, value_length);
+    memcpy(record, &sum, sizeof sum);
+
+    wal.appended += 1;
+    if (wal.deadline == TIMER_NEVER) {
+        wal.deadline = time_ms() + wal.window_ms;
+    }
+}
+
+
+uint64_t wal_appended(void) {
+    return wal.appended;
+}
+
+
+uint64_t wal_committed(void) {
+    return wal.committed;
+}
+
+
+void wal_commit(void) {
+    wal.deadline = TIMER_NEVER;
+    if (wal.committed == wal.appended) {
+        return;
+    }
+
+    size_t written = 0;
+    while (written < wal.pending.length) {
+        const ssize_t n = write(wal.fd, wal.pending.data + written, wal.pending.length - written);
+        if (n == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);  // Acknowledging further changes would be a lie
+        }
+        written += n;
+    }
+    if (fdatasync(wal.fd) == -1) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+
+    wal.pending.length = 0;
+    wal.committed = wal.appended;
+}
+
+
+unsigned long wal_deadline(void) {
+    return wal.deadline;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "data.h"
+
+
+/**
+ * Append-only log of all changes to the store
+ *
+ * The file starts with `WAL_MAGIC` and `WAL_VERSION`, followed by records:
+ *
+ *   | checksum (4) | op (1) | key_length (2) | value_length (4) | key | value |
+ *
+ * `op` is `BATCH_PUT` or `BATCH_DELETE`, the latter without value. Fields are
+ * in host byte order, as a log is only read by the node that wrote it. The
+ * checksum covers everything following it, so a record torn by a crash ends
+ * the log.
+ *
+ * While a snapshot is being taken, the log continues in a new file and the
+ * previous one is kept as `<path>.old`. It is replayed before the current one
+ * if the snapshot did not complete.
+ *
+ * Records are collected in memory and committed in groups: a single write
+ * and `fdatasync()` covers all records appended within `window_ms` of the
+ * first one pending. Replies to changes must be held back until
+ * `wal_committed()` covers them.
+ */
+#define WAL_MAGIC "RNWAL"
+#define WAL_VERSION 1
+#define WAL_HEADER_SIZE 8
+#define WAL_RECORD_HEADER_SIZE 11
+
+/**
+ * Longest group commit window, replies to changes are held back for up to it
+ */
+#define WAL_WINDOW_MAX_MS 10000
+
+/**
+ * Open the log at `path`, replaying its records into `store`
+ *
+ * The log is created if it does not exist. Anything following the last
+ * intact record is cut off. Returns false if the file cannot be used.
+ */
+bool wal_open(const char* path, unsigned long window_ms, struct store* store);
+
+/**
+ * Whether a log is open, i.e., changes need to be appended
+ */
+bool wal_enabled(void);
+
+/**
+ * Append a change to the log, it is committed within the window
+ */
+void wal_append(uint8_t op, const char* key, size_t key_length, const char* value, size_t value_length);
+
+/**
+ * Return the sequence number of the last record appended, starting at 1
+ */
+uint64_t wal_appended(void);
+
+/**
+ * Return the sequence number of the last record that is durable
+ */
+uint64_t wal_committed(void);
+
+/**
+ * Write and sync all records appended so far right away
+ */
+void wal_commit(void);
+
+/**
+ * Continue the log in a new file, when a snapshot of the store is taken
+ *
+ * Pending records are committed first, the records so far are kept in
+ * `<path>.old` until `wal_rotation_done()`. Returns false if the log could
+ * not be rotated, it is continued as before then.
+ */
+bool wal_rotate(void);
+
+/**
+ * Conclude a rotation: with a successful snapshot, the records before it
+ * are dropped, otherwise they are merged with the current ones
+ */
+void wal_rotation_done(bool success);
+
+/**
+ * Return the time the pending records are due to be committed, see `timer.h`
+ */
+unsigned long wal_deadline(void);
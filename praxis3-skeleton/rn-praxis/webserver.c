@@ -1,4 +1,3 @@
-#include <pthread.h>
 #include <assert.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -6,140 +5,736 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <openssl/sha.h>
 
+#include "access_log.h"
+#include "batch.h"
 #include "data.h"
 #include "http.h"
 #include "util.h"
 #include "dht.h"
+#include "metrics.h"
+#include "probes.h"
+#include "snapshot.h"
+#include "stages.h"
+#include "timer.h"
+#include "trace.h"
+#include "wal.h"
 
-#define MAX_RESOURCES 100
+#define MAX_CONNECTIONS 64
+#define PEER_URL_CACHE_SIZE 64
+#define SNAPSHOT_POLL_MS 10
+#define SNAPSHOT_INTERVAL_MAX_S (365UL * 24 * 3600)  // One year
 
-struct tuple resources[MAX_RESOURCES] = {
-    {"/static/foo", "Foo", sizeof "Foo" - 1},
-    {"/static/bar", "Bar", sizeof "Bar" - 1},
-    {"/static/baz", "Baz", sizeof "Baz" - 1}
-};
+struct store resources;
+
+// Set by SIGUSR1, the stage latencies are dumped by the event loop
+static volatile sig_atomic_t stages_dump_requested = 0;
 
+// Where and how often the store is snapshotted, see `snapshot.h`. While a
+// snapshot is running, `snapshot_next` is when to check on it next.
+static const char* snapshot_path = NULL;
+static unsigned long snapshot_interval_ms;
+static unsigned long snapshot_due = TIMER_NEVER;
+static unsigned long snapshot_next = TIMER_NEVER;
 
 
 /**
- * Sends an HTTP reply to the client based on the received request.
+ * Queues bytes of a reply to the client.
  *
- * @param conn      The file descriptor of the client connection socket.
- * @param request   A pointer to the struct containing the parsed request information.
+ * Replies are only sent by `connection_flush()`, so the replies to all
+ * requests received at once leave with a single system call.
+ *
+ * @param state     The state of the client connection.
+ * @param data      The bytes to send.
+ * @param n         The number of bytes.
  */
-void send_reply(int conn, struct request* request) {
+static void reply_append(struct connection_state* state, const void* data, size_t n) {
+    memcpy(buffer_append(&state->output, n), data, n);
+}
 
-    // Create a buffer to hold the HTTP reply
-    char buffer[HTTP_MAX_SIZE];
-    char *reply = buffer;
-    size_t offset = 0;
 
-    dht_id uri_hash = hash(request->uri);
-    fprintf(stderr, "%hu: Handling %s request for %s (hash %hu, %lu byte payload)\n", self.id, request->method, request->uri, uri_hash, request->payload_length);
+/**
+ * Sends all queued replies to the client.
+ *
+ * @param state     The state of the client connection.
+ * @return Returns false if the client is gone.
+ */
+static bool connection_flush(struct connection_state* state) {
+    if (state->output.length == 0 || state->wal_wait > wal_committed()) {
+        return true;  // Nothing to send, or held back until the changes are durable
+    }
 
-    // Check if the responsible peer for the requested resource is available.
-    const struct peer* responsible_peer = dht_responsible(uri_hash); 
-    if (responsible_peer == NULL) {
-        dht_lookup(uri_hash);
-        reply = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
-        offset = strlen(reply);
-    } else if (responsible_peer != &self) {
-        // If the responsible peer for the resource is not the current server (self), redirect the client to the responsible peer.
+    const uint64_t start = stage_now();
+    size_t sent = 0;
+    while (sent < state->output.length) {
+        ssize_t n = send(state->sock, state->output.data + sent, state->output.length - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            perror("send");
+            state->output.length = 0;
+            return false;
+        }
+        sent += n;
+    }
+    state->output.length = 0;
+    metrics.bytes_sent += sent;
+    stage_end(STAGE_SEND, start);
+    return true;
+}
+
+
+// `Content-Type` headers of replies with a body
+static const struct fragment binary_content = FRAGMENT("Content-Type: application/octet-stream\r\n");
+static const struct fragment metrics_content = FRAGMENT("Content-Type: text/plain; version=0.0.4\r\n");
 
-        // Calculate the IP address and port of the responsible peer.
-        offset += sprintf(reply + offset, "HTTP/1.1 303 See Other\r\nLocation: http://");
+// `Allow` headers of node-local endpoints answering 405
+static const struct fragment allow_get = FRAGMENT("Allow: GET\r\n");
+static const struct fragment allow_post = FRAGMENT("Allow: POST\r\n");
+static const struct fragment allow_get_delete = FRAGMENT("Allow: GET, DELETE\r\n");
 
-        in_addr_t ip = htonl(responsible_peer->ip.s_addr);
-        inet_ntop(AF_INET, &ip, reply + offset, 15);
-        offset += strlen(reply + offset);
 
-        offset += sprintf(reply + offset, ":%hu%s\r\nContent-Length: 0\r\n\r\n", responsible_peer->port, request->uri);
-    } else if (strcmp(request->method, "GET") == 0) {
+/**
+ * Queues the head of a reply with a body.
+ *
+ * @param state         The state of the client connection.
+ * @param status        The status code of the reply.
+ * @param header        An additional header line, e.g., the body's `Content-Type`, or NULL for none.
+ * @param body_length   The length of the body following the head.
+ */
+static void reply_head(struct connection_state* state, int status, const struct fragment* header, size_t body_length) {
+    const struct fragment* status_line = http_status_line(status);
+    const size_t header_length = header ? header->length : 0;
+
+    char* head = buffer_append(&state->output, status_line->length + header_length + HTTP_CONTENT_LENGTH_SIZE);
+    char* pos = head;
+    memcpy(pos, status_line->data, status_line->length);
+    pos += status_line->length;
+    if (header) {
+        memcpy(pos, header->data, header->length);
+        pos += header->length;
+    }
+    pos += http_content_length(pos, body_length);
+
+    // Return what was reserved but not used
+    state->output.length -= (head + status_line->length + header_length + HTTP_CONTENT_LENGTH_SIZE) - pos;
+}
+
+
+/**
+ * Queues a reply without body.
+ *
+ * @param state     The state of the client connection.
+ * @param status    The status code of the reply.
+ */
+static void reply_empty(struct connection_state* state, int status) {
+    const struct fragment* reply = http_empty_reply(status);
+    reply_append(state, reply->data, reply->length);
+}
 
-        // Find the resource with the given URI in the 'resources' array.
-        size_t resource_length;
-        const char* resource = get(request->uri, resources, MAX_RESOURCES, &resource_length);
 
-        if (resource) {
-            size_t payload_offset = sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n", resource_length);
-            memcpy(reply + payload_offset, resource, resource_length);
-            offset = payload_offset + resource_length;
+/**
+ * Serves `/_ring`, our binary view of the ring (see `RING_MAGIC`).
+ *
+ * @param state     The state of the client connection.
+ * @return The status code of the reply.
+ */
+static int send_ring(struct connection_state* state) {
+    uint8_t view[HTTP_MAX_SIZE / 2];
+    const size_t view_length = dht_ring_view(view, sizeof view);
+
+    reply_head(state, 200, &binary_content, view_length);
+    reply_append(state, view, view_length);
+    return 200;
+}
+
+
+/**
+ * Executes a request on the local store.
+ *
+ * @param op             The operation, one of `BATCH_GET`, `BATCH_PUT`, and `BATCH_DELETE`.
+ * @param uri            The URI of the resource, at most `STORE_MAX_KEY_LENGTH` bytes.
+ * @param payload        The value to store on PUT requests.
+ * @param payload_length The length of `payload`.
+ * @param value          Set to the resource's value on successful GET requests.
+ * @param value_length   Set to the length of `value`.
+ *
+ * @return The HTTP status code describing the result.
+ */
+static int serve_resource(uint8_t op, const string uri, const char* payload, size_t payload_length,
+                          const char** value, size_t* value_length) {
+    switch (op) {
+        case BATCH_GET:
+            *value = store_get(&resources, uri, value_length);
+            return *value ? 200 : 404;
+        case BATCH_PUT: {
+            const enum store_result result = store_set(&resources, uri, payload, payload_length);
+            if (result == STORE_REJECTED) {
+                return 413;  // Exceeds the cache's whole budget
+            }
+            wal_append(BATCH_PUT, uri, strlen(uri), payload, payload_length);
+            return (result == STORE_REPLACED) ? 204 : 201;
+        }
+        case BATCH_DELETE:
+            if (!store_delete(&resources, uri)) {
+                return 404;
+            }
+            wal_append(BATCH_DELETE, uri, strlen(uri), NULL, 0);
+            return 204;
+        default:
+            return 501;
+    }
+}
+
+
+/**
+ * Invoked once the response to a client's batch has been sent completely.
+ */
+static void batch_done(struct batch* batch) {
+    struct connection_state* state = batch->context;
+    state->batch = NULL;
+}
+
+
+/**
+ * A part of a batch forwarded to a single peer
+ */
+struct batch_group {
+    const struct peer* peer;
+    struct buffer records;
+    struct buffer indices;
+};
+
+
+/**
+ * Answers `POST /_batch` and `POST /_batch/local` (see `batch.h`).
+ *
+ * Records we are responsible for are served right away. On `/_batch`, all
+ * others are grouped by their responsible peer and forwarded, their results
+ * are streamed to the client as they arrive. `/_batch/local` is sent by
+ * peers forwarding a batch and never forwarded any further.
+ *
+ * @param state     The state of the client connection.
+ * @param request   A pointer to the parsed batch request.
+ * @param forward   Whether records may be forwarded to other peers.
+ * @return The status code of the reply.
+ */
+static int send_batch(struct connection_state* state, struct request* request, bool forward) {
+    static char key[UINT16_MAX + 1];
+    static struct batch_group groups[BATCH_MAX_LINKS];
+    size_t n_groups = 0;
+
+    struct buffer results = {0};
+    bool lookups = false;
+
+    const char* pos = request->payload;
+    const char* end = request->payload + request->payload_length;
+    uint32_t index = 0;
+    struct batch_record record;
+    size_t record_length;
+    while ((record_length = batch_parse_record(pos, end - pos, &record)) > 0) {
+        pos += record_length;
+        memcpy(key, record.key, record.key_length);
+        key[record.key_length] = '\0';
+
+        const dht_id key_hash = hash(key);
+        const struct peer* responsible_peer = dht_responsible(key_hash);
+        if (responsible_peer == &self) {
+            const char* value = NULL;
+            size_t value_length = 0;
+            const int status = serve_resource(record.op, key, record.value, record.value_length, &value, &value_length);
+            batch_encode_result(&results, index, status, value, value_length);
+        } else if (!forward) {
+            batch_encode_result(&results, index, 421, NULL, 0);
+        } else if (responsible_peer == NULL) {
+            dht_lookup(key_hash);
+            lookups = true;
+            batch_encode_result(&results, index, 503, NULL, 0);
         } else {
-            reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-            offset = strlen(reply);
+            size_t g = 0;
+            while (g < n_groups && (groups[g].peer->ip.s_addr != responsible_peer->ip.s_addr
+                                    || groups[g].peer->port != responsible_peer->port)) {
+                g += 1;
+            }
+            if (g == BATCH_MAX_LINKS) {
+                batch_encode_result(&results, index, 503, NULL, 0);  // Too many peers involved
+            } else {
+                if (g == n_groups) {
+                    groups[g].peer = responsible_peer;
+                    groups[g].records.length = 0;
+                    groups[g].indices.length = 0;
+                    n_groups += 1;
+                }
+                batch_encode_record(&groups[g].records, &record);
+                memcpy(buffer_append(&groups[g].indices, sizeof index), &index, sizeof index);
+            }
+        }
+        index += 1;
+    }
+
+    const int status = pos != end ? 400 : 200;
+    if (pos != end) {
+        reply_empty(state, 400);
+    } else if (!forward) {
+        reply_head(state, 200, &binary_content, results.length);
+        reply_append(state, results.data, results.length);
+    } else {
+        if (lookups) {
+            dht_flush();  // The lookups should be underway before the client retries
+        }
+
+        // The batch's chunks are sent directly, so they must follow earlier
+        // replies, and the changes they acknowledge must be durable
+        wal_commit();
+        connection_flush(state);
+        state->batch = batch_start(state->sock, batch_done, state);
+        batch_send_results(state->batch, &results);
+        for (size_t g = 0; g < n_groups; g += 1) {
+            batch_forward(state->batch, groups[g].peer, &groups[g].records, (uint32_t*) groups[g].indices.data,
+                          groups[g].indices.length / sizeof(uint32_t));
         }
-    } else if (strcmp(request->method, "PUT") == 0) {
-        // Try to set the requested resource with the given payload in the 'resources' array.
-        if (set(request->uri, request->payload, request->payload_length, resources, MAX_RESOURCES
-        )) {
-            reply = "HTTP/1.1 204 No Content\r\n\r\n";
+        batch_finish_local(state->batch);  // May complete the batch right away
+    }
+
+    free(results.data);
+    return status;
+}
+
+
+/**
+ * Answers `POST /_load`, inserting a partition of a bulk load.
+ *
+ * The body consists of PUT records in the format of `/_batch`. It is copied
+ * once and all records we are responsible for are inserted into the store
+ * pointing into that copy. The response only lists records that were not
+ * stored: 421 for those another peer is responsible for, 501 for other
+ * operations than PUT. If the copy cannot be allocated, nothing is stored
+ * and 503 asks the client to retry.
+ *
+ * @param state     The state of the client connection.
+ * @param request   A pointer to the parsed load request.
+ * @return The status code of the reply.
+ */
+static int send_load(struct connection_state* state, struct request* request) {
+    struct store_block* block = malloc(sizeof(struct store_block) + request->payload_length);
+    if (!block) {
+        reply_empty(state, 503);  // The client may retry once memory is available
+        return 503;
+    }
+    block->mapping = NULL;
+    memcpy(block->data, request->payload, request->payload_length);
+
+    // Count the records first, so a single array holds all of them
+    const char* end = block->data + request->payload_length;
+    const char* pos = block->data;
+    size_t n_records = 0;
+    struct batch_record record;
+    size_t record_length;
+    while ((record_length = batch_parse_record(pos, end - pos, &record)) > 0) {
+        pos += record_length;
+        n_records += 1;
+    }
+    if (pos != end) {
+        free(block);
+        reply_empty(state, 400);
+        return 400;
+    }
+
+    struct store_record* records = malloc(n_records * sizeof(struct store_record));
+    if (!records && n_records > 0) {
+        free(block);
+        reply_empty(state, 503);
+        return 503;
+    }
+    size_t n_accepted = 0;
+    struct buffer rejected = {0};
+    pos = block->data;
+    for (uint32_t index = 0; index < n_records; index += 1) {
+        pos += batch_parse_record(pos, end - pos, &record);
+
+        uint16_t status = 0;
+        if (record.op != BATCH_PUT) {
+            status = 501;
         } else {
-            reply = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+            // Keys are not null-terminated within the block, hash a copy
+            char key[UINT16_MAX + 1];
+            memcpy(key, record.key, record.key_length);
+            key[record.key_length] = '\0';
+            if (dht_responsible(hash(key)) != &self) {
+                status = 421;
+            }
         }
-        offset = strlen(reply);
-    } else if (strcmp(request->method, "DELETE") == 0) {
-        // Try to delete the requested resource from the 'resources' array
-        if (delete(request->uri, resources, MAX_RESOURCES)) {
-            reply = "HTTP/1.1 204 No Content\r\n\r\n";
+
+        if (status) {
+            batch_encode_result(&rejected, index, status, NULL, 0);
         } else {
-            reply = "HTTP/1.1 404 Not Found\r\n\r\n";
+            records[n_accepted] = (struct store_record) {
+                .key = record.key,
+                .key_length = record.key_length,
+                .value = record.value,
+                .value_length = record.value_length,
+            };
+            n_accepted += 1;
         }
-        offset = strlen(reply);
+    }
+    store_load(&resources, block, records, n_accepted);
+    for (size_t i = 0; i < n_accepted; i += 1) {
+        wal_append(BATCH_PUT, records[i].key, records[i].key_length, records[i].value, records[i].value_length);
+    }
+    free(records);
+    metrics.load_stored += n_accepted;
+    metrics.load_refused += n_records - n_accepted;
+
+    reply_head(state, 200, &binary_content, rejected.length);
+    reply_append(state, rejected.data, rejected.length);
+    free(rejected.data);
+    return 200;
+}
+
+
+/**
+ * Serves `/_stages`: GET reports the latencies of the request path's stages
+ * (see `stages.h`), DELETE resets them.
+ *
+ * @param state     The state of the client connection.
+ * @param request   The request to answer.
+ * @return The status code of the reply.
+ */
+static int send_stages(struct connection_state* state, const struct request* request) {
+    if (request->method_id == HTTP_DELETE) {
+        stages_init();
+        reply_empty(state, 204);
+        return 204;
     } else {
-        reply = "HTTP/1.1 501 Method Not Supported\r\n\r\n";
-        offset = strlen(reply);
+        struct buffer report = {0};
+        stages_report(&report);
+        reply_head(state, 200, NULL, report.length);
+        reply_append(state, report.data, report.length);
+        free(report.data);
+        return 200;
     }
+}
+
 
-    // Send the reply back to the client
-    if (send(conn, reply, offset, 0) == -1) {
-        perror("send");
-        close(conn);
+/**
+ * Serves `GET /_metrics`, our counters in Prometheus' text format (see `metrics.h`).
+ *
+ * @param state     The state of the client connection.
+ * @return The status code of the reply.
+ */
+static int send_metrics(struct connection_state* state) {
+    struct buffer report = {0};
+    metrics_report(&report, &resources);
+    reply_head(state, 200, &metrics_content, report.length);
+    reply_append(state, report.data, report.length);
+    free(report.data);
+    return 200;
+}
+
+
+/**
+ * Starts a snapshot of the store in the background.
+ *
+ * The write-ahead log is rotated at the same time, so that once the snapshot
+ * completed, only the records following it are kept.
+ *
+ * @return Whether the snapshot was started.
+ */
+static bool take_snapshot(void) {
+    if (snapshot_stats.running || !wal_rotate()) {
+        return false;
+    }
+    if (!snapshot_start(snapshot_path, &resources)) {
+        wal_rotation_done(false);
+        return false;
+    }
+    snapshot_next = time_ms() + SNAPSHOT_POLL_MS;
+    return true;
+}
+
+
+/**
+ * Returns the time of the next periodic snapshot, or of checking on the running one, see `timer.h`.
+ */
+static unsigned long snapshot_deadline(void) {
+    return snapshot_next;
+}
+
+
+/**
+ * Concludes a completed snapshot, or takes a periodic one and schedules the next.
+ */
+static void snapshot_tick(void) {
+    if (!snapshot_stats.running) {
+        snapshot_due = time_ms() + snapshot_interval_ms;
+        if (!take_snapshot()) {
+            snapshot_next = snapshot_due;
+        }
+        return;
+    }
+
+    const enum snapshot_state state = snapshot_poll();
+    if (state == SNAPSHOT_RUNNING) {
+        snapshot_next = time_ms() + SNAPSHOT_POLL_MS;
+    } else {
+        wal_rotation_done(state == SNAPSHOT_SUCCEEDED);
+        snapshot_next = snapshot_due;
+    }
+}
+
+
+/**
+ * Serves `POST /_snapshot`, starting a snapshot right away.
+ *
+ * Completion is reported at `/_metrics`.
+ *
+ * @param state     The state of the client connection.
+ * @return The status code of the reply.
+ */
+static int send_snapshot(struct connection_state* state) {
+    const int status = !snapshot_path ? 501 : take_snapshot() ? 202 : 503;
+    reply_empty(state, status);
+    return status;
+}
+
+
+/**
+ * Serves `GET /_trace`, a dump of the DHT flight recorder (see `trace.h`).
+ *
+ * @param state     The state of the client connection.
+ * @return The status code of the reply.
+ */
+static int send_trace(struct connection_state* state) {
+    const size_t size = trace_dump_size();
+    reply_head(state, 200, &binary_content, size);
+    trace_dump((uint8_t*) buffer_append(&state->output, size));
+    return 200;
+}
+
+
+/**
+ * Signal handler of SIGUSR1, requesting a dump of the stage latencies.
+ *
+ * @param signum    The signal received.
+ */
+static void request_stages_dump(int signum) {
+    (void) signum;
+    stages_dump_requested = 1;
+}
+
+
+/**
+ * Returns the URL prefix `http://ip:port` of the given peer.
+ *
+ * Rendered URLs are cached by address, so redirecting to a known peer only
+ * costs a copy.
+ *
+ * @param peer      The peer to redirect to.
+ */
+static struct fragment peer_url(const struct peer* peer) {
+    static struct {
+        uint32_t ip;
+        uint16_t port;
+        uint8_t length;
+        char url[sizeof "http://255.255.255.255:65535"];
+    } cache[PEER_URL_CACHE_SIZE];
+
+    const size_t slot = (peer->ip.s_addr * 31 + peer->port) % PEER_URL_CACHE_SIZE;
+    if (cache[slot].length == 0 || cache[slot].ip != peer->ip.s_addr || cache[slot].port != peer->port) {
+        const in_addr_t ip = htonl(peer->ip.s_addr);
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &ip, address, sizeof address);
+
+        cache[slot].ip = peer->ip.s_addr;
+        cache[slot].port = peer->port;
+        cache[slot].length = sprintf(cache[slot].url, "http://%s:%hu", address, peer->port);
+    }
+    return (struct fragment) { cache[slot].url, cache[slot].length };
+}
+
+
+/**
+ * Dispatches a request for a node-local endpoint, i.e., one whose URI starts with `/_`.
+ *
+ * Unknown endpoints are answered with 404, known ones with 405 and the methods
+ * they allow if requested with another method.
+ *
+ * @param state     The state of the client connection.
+ * @param request   The request to answer.
+ * @return The status code of the reply.
+ */
+static int send_local(struct connection_state* state, struct request* request) {
+    const enum http_method method = request->method_id;
+    const struct fragment* allow;
+    if (strcmp(request->uri, "/_ring") == 0) {
+        if (method == HTTP_GET) {
+            return send_ring(state);
+        }
+        allow = &allow_get;
+    } else if (strcmp(request->uri, "/_batch") == 0) {
+        if (method == HTTP_POST) {
+            return send_batch(state, request, true);
+        }
+        allow = &allow_post;
+    } else if (strcmp(request->uri, "/_batch/local") == 0) {
+        if (method == HTTP_POST) {
+            return send_batch(state, request, false);
+        }
+        allow = &allow_post;
+    } else if (strcmp(request->uri, "/_load") == 0) {
+        if (method == HTTP_POST) {
+            return send_load(state, request);
+        }
+        allow = &allow_post;
+    } else if (strcmp(request->uri, "/_stages") == 0) {
+        if (method == HTTP_GET || method == HTTP_DELETE) {
+            return send_stages(state, request);
+        }
+        allow = &allow_get_delete;
+    } else if (strcmp(request->uri, "/_metrics") == 0) {
+        if (method == HTTP_GET) {
+            return send_metrics(state);
+        }
+        allow = &allow_get;
+    } else if (strcmp(request->uri, "/_trace") == 0) {
+        if (method == HTTP_GET) {
+            return send_trace(state);
+        }
+        allow = &allow_get;
+    } else if (strcmp(request->uri, "/_snapshot") == 0) {
+        if (method == HTTP_POST) {
+            return send_snapshot(state);
+        }
+        allow = &allow_post;
+    } else {
+        reply_empty(state, 404);
+        return 404;
+    }
+
+    reply_head(state, 405, allow, 0);
+    return 405;
+}
+
+
+/**
+ * Queues an HTTP reply to the client based on the received request.
+ *
+ * @param state     The state of the client connection.
+ * @param request   A pointer to the struct containing the parsed request information.
+ * @return The status code of the reply.
+ */
+int send_reply(struct connection_state* state, struct request* request) {
+    // Node-local endpoints are never routed through the DHT
+    if (request->uri[0] == '/' && request->uri[1] == '_') {
+        return send_local(state, request);
+    }
+
+    if (request->uri_length > STORE_MAX_KEY_LENGTH) {
+        reply_empty(state, 414);  // Could neither be stored nor logged
+        return 414;
+    }
+
+    uint64_t stage_start = stage_now();
+    dht_id uri_hash = hash(request->uri);
+    stage_start = stage_end(STAGE_HASH, stage_start);
+
+    // Check if the responsible peer for the requested resource is available.
+    const struct peer* responsible_peer = dht_responsible(uri_hash); 
+    stage_start = stage_end(STAGE_ROUTE, stage_start);
+    PROBE3(request__route, request->uri, uri_hash, responsible_peer ? responsible_peer->id : -1);
+    if (responsible_peer == NULL) {
+        dht_lookup(uri_hash);
+        dht_flush();  // The lookup should be underway before the client retries
+        reply_empty(state, 503);
+        return 503;
+    } else if (responsible_peer != &self) {
+        // If the responsible peer for the resource is not the current server (self), redirect the client to the responsible peer.
+        static const struct fragment location = FRAGMENT("HTTP/1.1 303 See Other\r\nLocation: ");
+        static const struct fragment end = FRAGMENT("\r\nContent-Length: 0\r\n\r\n");
+        const struct fragment url = peer_url(responsible_peer);
+
+        reply_append(state, location.data, location.length);
+        reply_append(state, url.data, url.length);
+        reply_append(state, request->uri, request->uri_length);
+        reply_append(state, end.data, end.length);
+        return 303;
+    } else {
+        // Serve the request from our 'resources' array.
+        static const uint8_t ops[] = {
+            [HTTP_GET] = BATCH_GET,
+            [HTTP_PUT] = BATCH_PUT,
+            [HTTP_DELETE] = BATCH_DELETE,
+            [HTTP_POST] = N_BATCH_OPS,
+            [HTTP_OTHER] = N_BATCH_OPS,
+        };
+        const char* payload = NULL;
+        size_t payload_length = 0;
+
+        const int status = serve_resource(ops[request->method_id], request->uri, request->payload, request->payload_length, &payload, &payload_length);
+        stage_end(STAGE_STORE, stage_start);
+        if (status == 200) {
+            // The resource is copied, as later requests in the same pipeline may change it before it is sent.
+            reply_head(state, status, NULL, payload_length);
+            reply_append(state, payload, payload_length);
+        } else {
+            reply_empty(state, status);
+        }
+        return status;
     }
 }
 
 /**
  * Processes an incoming packet from the client.
  *
- * @param conn The socket descriptor representing the connection to the client.
+ * @param state The state of the client connection.
  * @param buffer A pointer to the incoming packet's buffer.
  * @param n The size of the incoming packet.
  *
  * @return Returns the number of bytes processed from the packet.
- *         If the packet is successfully processed and a reply is sent, the return value indicates the number of bytes processed.
+ *         If the packet is successfully processed and a reply is queued, the return value indicates the number of bytes processed.
  *         If the packet is malformed or an error occurs during processing, the return value is -1.
  *
  */
-size_t process_packet(int conn, char* buffer, size_t n) {
+size_t process_packet(struct connection_state* state, char* buffer, size_t n) {
     struct request request = {
         .method = NULL,
         .uri = NULL,
         .payload = NULL,
         .payload_length = -1
     };
+    const uint64_t start = stage_now();
+    PROBE2(request__start, state->sock, n);
     ssize_t bytes_processed = parse_request(buffer, n, &request);
 
     if (bytes_processed > 0) {
-        send_reply(conn, &request);
+        stage_end(STAGE_PARSE, start);
+        const uint64_t wal_before = wal_appended();
+        const int status = send_reply(state, &request);
+        if (wal_appended() != wal_before) {
+            state->wal_wait = wal_appended();  // Replies are sent in order, so all later ones wait, too
+        }
+        metrics_request(request.method_id, status);
+        access_log_request(&request, status);
+        PROBE3(request__end, request.method_id, request.uri, status);
+        stage_end(STAGE_REQUEST, start);
 
         // Check the "Connection" header in the request to determine if the connection should be kept alive or closed.
-        const string connection_header = get_header(&request, "Connection");
-        if (connection_header && strcmp(connection_header, "close")) {
+        const string connection_header = request_header(&request, HEADER_CONNECTION);
+        if (connection_header && strcasecmp(connection_header, "close") == 0) {
             return -1;
         }
     } else if (bytes_processed == -1) {
         // If the request is malformed or an error occurs during processing, send a 400 Bad Request response to the client.
-        const string bad_request = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        send(conn, bad_request, strlen(bad_request), 0);
-        printf("Received malformed request, terminating connection.\n");
-        close(conn);
+        reply_empty(state, 400);
+        metrics_request(HTTP_OTHER, 400);
+        PROBE2(request__malformed, state->sock, n);
         return -1;
     }
 
@@ -156,30 +751,48 @@ size_t process_packet(int conn, char* buffer, size_t n) {
 static void connection_setup(struct connection_state* state, int sock) {
     // Set the socket descriptor for the new connection in the connection_state structure.
     state->sock = sock;
+    state->batch = NULL;
+    state->wal_wait = 0;
 
-    // Set the 'end' pointer of the state to the beginning of the buffer.
-    state->end = state->buffer;
+    // Reuse the slot's buffer unless a previous connection required growing it.
+    if (state->input.capacity > HTTP_MAX_SIZE) {
+        ring_buffer_free(&state->input);
+    }
+    if (!state->input.data && !ring_buffer_init(&state->input, HTTP_MAX_SIZE)) {
+        exit(EXIT_FAILURE);
+    }
+    ring_buffer_clear(&state->input);
 
-    // Clear the buffer by filling it with zeros to avoid any stale data.
-    memset(state->buffer, 0, HTTP_MAX_SIZE);
+    // Likewise, do not hold on to memory a large reply required
+    if (state->output.capacity > HTTP_MAX_SIZE) {
+        free(state->output.data);
+        state->output = (struct buffer) {0};
+    }
+    state->output.length = 0;
 }
 
 
 /**
- * Discards the front of a buffer
+ * Answers the complete requests in the connection's buffer with a single send.
  *
- * @param buffer A pointer to the buffer to be modified.
- * @param discard The number of bytes to drop from the front of the buffer.
- * @param keep The number of bytes that should be kept after the discarded bytes.
+ * Processing pauses while a batch is being answered, and continues with the
+ * remaining requests once it is complete.
  *
- * @return Returns a pointer to the first unused byte in the buffer after the discard.
- * @example buffer_discard(ABCDEF0000, 4, 2):
- *          ABCDEF0000 ->  EFCDEF0000 -> EF00000000, returns pointer to first 0.
+ * @param state A pointer to the connection_state structure containing the connection state.
+ * @return Returns false if the connection should be closed.
  */
-char* buffer_discard(char* buffer, size_t discard, size_t keep) {
-    memmove(buffer, buffer + discard, keep);
-    memset(buffer + keep, 0, discard);  // invalidate buffer
-    return buffer + keep;
+static bool process_buffered(struct connection_state* state) {
+    ssize_t bytes_processed = 0;
+    while (!state->batch && (bytes_processed = process_packet(state, ring_buffer_read_ptr(&state->input), ring_buffer_used(&state->input))) > 0) {
+        // Replies do not reference the request, so its memory can be reused
+        ring_buffer_consume(&state->input, bytes_processed);
+    }
+
+    // Send the replies to all requests answered, even if the connection is closed afterwards
+    if (bytes_processed == -1 && state->wal_wait > wal_committed()) {
+        wal_commit();
+    }
+    return connection_flush(state) && bytes_processed != -1;
 }
 
 /**
@@ -187,35 +800,30 @@ char* buffer_discard(char* buffer, size_t discard, size_t keep) {
  *
  * @param state A pointer to the connection_state structure containing the connection state.
  * @return Returns true if the connection and data processing were successful, false otherwise.
- *         If an error occurs while receiving data from the socket, the function exits the program.
+ *         In the latter case, the connection should be closed.
  */
 bool handle_connection(struct connection_state* state) {
-    // Calculate the pointer to the end of the buffer to avoid buffer overflow
-    const char* buffer_end = state->buffer + HTTP_MAX_SIZE;
+    // Grow the buffer for requests that do not fit
+    if (ring_buffer_free_space(&state->input) == 0) {
+        if (state->input.capacity >= HTTP_MAX_REQUEST_SIZE || !ring_buffer_grow(&state->input)) {
+            return false;
+        }
+    }
 
     // Check if an error occurred while receiving data from the socket
-    ssize_t bytes_read = recv(state->sock, state->end, buffer_end - state->end, 0);
+    const uint64_t start = stage_now();
+    ssize_t bytes_read = recv(state->sock, ring_buffer_write_ptr(&state->input), ring_buffer_free_space(&state->input), 0);
+    stage_end(STAGE_RECV, start);
     if (bytes_read == -1) {
         perror("recv");
-        close(state->sock);
-        exit(EXIT_FAILURE);
-    } else if (bytes_read == 0) {
         return false;
-    }
-
-    char* window_start = state->buffer;
-    char* window_end = state->end + bytes_read;
-
-    ssize_t bytes_processed = 0;
-    while((bytes_processed = process_packet(state->sock, window_start, window_end - window_start)) > 0) {
-        window_start += bytes_processed;
-    }
-    if (bytes_processed == -1) {
+    } else if (bytes_read == 0) {
         return false;
     }
+    ring_buffer_produce(&state->input, bytes_read);
+    metrics.bytes_received += bytes_read;
 
-    state->end = buffer_discard(state->buffer, window_start - state->buffer, window_end - window_start);
-    return true;
+    return state->batch || process_buffered(state);
 }
 
 /**
@@ -256,7 +864,7 @@ static struct sockaddr_in derive_sockaddr(const char* host, const char* port) {
  */
 static int setup_server_socket(struct sockaddr_in addr) {
     const int enable = 1;
-    const int backlog = 1;
+    const int backlog = SOMAXCONN;
 
     // Create a socket
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -284,7 +892,7 @@ static int setup_server_socket(struct sockaddr_in addr) {
         exit(EXIT_FAILURE);
     }
 
-    // Start listening on the socket with maximum backlog of 1 pending connection
+    // Start listening on the socket
     if (listen(sock, backlog)) {
         perror("listen");
         exit(EXIT_FAILURE);
@@ -343,31 +951,23 @@ static struct peer peer_from_args(const string id, const string ip, const string
     // Return the created peer struct
     return result;
 }
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-void *pollOut(){
-    pthread_mutex_lock(&mutex);
 
-    if(self.id == 4096 && self.port == 4711){
-        stabilize();
-    }
-
-    pthread_mutex_unlock(&mutex);
-    pthread_exit(NULL);
-}
 
 /**
-*  The program expects 3, 4, or 6 arguments; otherwise, it returns EXIT_FAILURE.
+*  The program expects 3, 4, or 6 and more arguments; otherwise, it returns EXIT_FAILURE.
 *
 *  Call as:
 *
 *  ./build/webserver self.ip self.port
 *  ./build/webserver self.ip self.port self.id
-*  ./build/webserver self.ip self.port self.id anchor.ip anchor.port
+*  ./build/webserver self.ip self.port self.id anchor.ip anchor.port [anchor.ip anchor.port ...]
 */
 int main(int argc, char** argv) {
-    if (argc != 3 && argc != 4 && argc != 6) {
+    if (argc != 3 && argc != 4 && (argc < 6 || argc % 2 != 0)) {
         return EXIT_FAILURE;
     }
+    clock_tick();
+
     const string id_arg = (argc > 3) ? argv[3] : "0";
     self = peer_from_args(id_arg, argv[1], argv[2]);
 
@@ -378,6 +978,11 @@ int main(int argc, char** argv) {
     int server_socket = setup_server_socket(addr);
     dht_socket = setup_peer_socket(addr);
 
+    // Keep the DHT's recent history if we crash, see `trace.h`
+    char trace_path[sizeof "rn-trace-65535.bin"];
+    snprintf(trace_path, sizeof trace_path, "rn-trace-%hu.bin", self.port);
+    trace_dump_on_crash(getenv("TRACE_FILE") ? getenv("TRACE_FILE") : trace_path);
+
     // Check if the program is running in static mode or join mode.
     const bool static_mode = getenv("PRED_ID") && getenv("PRED_IP") && getenv("PRED_PORT") && getenv("SUCC_ID") && getenv("SUCC_IP") && getenv("SUCC_PORT");
 
@@ -390,23 +995,14 @@ int main(int argc, char** argv) {
 
 
     }
-     else if(argc == 6){
-         anchor = peer_from_args("0", argv[4], argv[5]);
-         int ids[5] =  { 7044, 15792, 59957, 4386, 18648 };
-         if(self.id == 4096){
-             anchor.id = 8192;
-         }
-         for(int i = 0; i < 5; i++){
-             if(self.id == ids[0]){
-
-             }
-             else if(self.id == ids[i]){
-                 anchor.id = ids[i - 1];
-             }
-         }
-         send_join(anchor);
-
-
+    else if (argc >= 6) {
+        // Join mode: try all given anchors at once, their IDs are irrelevant
+        struct peer anchors[(argc - 4) / 2];
+        for (int i = 4; i + 1 < argc; i += 2) {
+            anchors[(i - 4) / 2] = peer_from_args("0", argv[i], argv[i + 1]);
+        }
+        dht_join(anchors, sizeof(anchors) / sizeof(anchors[0]));
+        dht_flush();
     }
     else {
         // If neither static mode nor join mode, set predecessor and successor to self.
@@ -414,39 +1010,100 @@ int main(int argc, char** argv) {
         successor = self;
     }
 
+    // Optionally, run as a cache bounded to a number of bytes, evicting what is used least
+    if (getenv("CACHE_BYTES")) {
+        // Budgets exceed the 16 bits `safe_strtoul()` returns
+        char* end;
+        errno = 0;
+        const unsigned long long budget = strtoull(getenv("CACHE_BYTES"), &end, 10);
+        if (errno != 0 || *end != '\0') {
+            fprintf(stderr, "Failed to parse CACHE_BYTES\n");
+            exit(EXIT_FAILURE);
+        }
+        store_set_budget(&resources, budget);
+    }
+
+    // Optionally, start from the last snapshot, which includes these resources unless deleted
+    snapshot_path = getenv("SNAPSHOT_FILE");
+    if (!snapshot_path || !snapshot_load(snapshot_path, &resources)) {
+        // Resources every peer serves initially
+        store_set(&resources, "/static/foo", "Foo", strlen("Foo"));
+        store_set(&resources, "/static/bar", "Bar", strlen("Bar"));
+        store_set(&resources, "/static/baz", "Baz", strlen("Baz"));
+    }
+
+    // Optionally, persist all changes and recover those of previous runs
+    if (getenv("WAL_FILE")) {
+        const unsigned long window = getenv("WAL_COMMIT_MS") ? checked_strtoul(getenv("WAL_COMMIT_MS"), 0, WAL_WINDOW_MAX_MS, "Failed to parse WAL_COMMIT_MS") : 2;
+        if (!wal_open(getenv("WAL_FILE"), window, &resources)) {
+            exit(EXIT_FAILURE);
+        }
+        timer_register(wal_deadline, wal_commit);
+    }
+    if (snapshot_path) {
+        snapshot_interval_ms = 1000UL * (getenv("SNAPSHOT_INTERVAL_S") ? checked_strtoul(getenv("SNAPSHOT_INTERVAL_S"), 1, SNAPSHOT_INTERVAL_MAX_S, "Failed to parse SNAPSHOT_INTERVAL_S") : 300);
+        snapshot_due = time_ms() + snapshot_interval_ms;
+        snapshot_next = snapshot_due;
+        timer_register(snapshot_deadline, snapshot_tick);
+    }
+
+    srand(self.id ^ getpid());
+    stages_init();
+    access_log_start();
+    signal(SIGUSR1, request_stages_dump);
+    dht_init(!getenv("NO_STABILIZE"), getenv("ONE_HOP") != NULL);
+    timer_register(dht_deadline, dht_tick);
+
 
 
-    // Create an array of pollfd structures to monitor sockets.
-    struct pollfd sockets[3] = {
+    // Create an array of pollfd structures to monitor sockets: the server
+    // socket, the DHT socket, one entry per connection slot, and the links to
+    // other peers used for batches.
+    struct pollfd sockets[2 + MAX_CONNECTIONS + BATCH_MAX_LINKS] = {
         { .fd = server_socket, .events = POLLIN },
         { .fd = dht_socket, .events = POLLIN },
-
     };
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        sockets[2 + i].fd = -1;
+    }
+    struct pollfd* client_sockets = &sockets[2];
+    struct pollfd* link_sockets = &sockets[2 + MAX_CONNECTIONS];
 
-
-    struct connection_state state = {0};
+    static struct connection_state connections[MAX_CONNECTIONS];
+    size_t n_connections = 0;
 
 
     while (true) {
-        pthread_t thread;
-        if(pthread_create(&thread, NULL, pollOut, NULL) != 0){
-            perror("pthread");
+        batch_pollfds(link_sockets);
+        int ready = poll(sockets, sizeof(sockets) / sizeof(sockets[0]), timer_poll_timeout());
+
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
             exit(EXIT_FAILURE);
         }
 
-        int ready = poll(sockets, sizeof(sockets) / sizeof(sockets[0]), -1);
-
+        if (stages_dump_requested) {
+            stages_dump_requested = 0;
+            struct buffer report = {0};
+            stages_report(&report);
+            fwrite(report.data, 1, report.length, stderr);
+            free(report.data);
+        }
         if (ready == -1) {
-            perror("poll");
-            exit(EXIT_FAILURE);
+            continue;  // Interrupted by a signal, the events are stale
         }
 
+        // Sample the clock once for everything handled in this iteration
+        clock_tick();
+
+        // Handle the links first, as processing client requests may open new ones
+        batch_handle_events(link_sockets, BATCH_MAX_LINKS);
 
         // Process events on the monitored sockets.
-        for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i += 1) {
+        for (size_t i = 0; i < 2 + MAX_CONNECTIONS; i += 1) {
 
-            if (sockets[i].revents != POLLIN) {
-                // If there are no POLLIN events on the socket, continue to the next iteration.
+            if (!(sockets[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                // If there are no events on the socket, continue to the next iteration.
                 continue;
             }
 
@@ -454,19 +1111,31 @@ int main(int argc, char** argv) {
 
             if (s == server_socket) {
 
-                // If the event is on the server_socket, accept a new connection from a client.
-                int connection = accept(server_socket, NULL, NULL);
-                if (connection == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                    close(server_socket);
-                    perror("accept");
-                    exit(EXIT_FAILURE);
-                } else {
-                    connection_setup(&state, connection);
+                // If the event is on the server_socket, accept new connections from clients.
+                size_t slot = 0;
+                while (n_connections < MAX_CONNECTIONS) {
+                    int connection = accept(server_socket, NULL, NULL);
+                    if (connection == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        close(server_socket);
+                        perror("accept");
+                        exit(EXIT_FAILURE);
+                    } else if (connection == -1) {
+                        break;
+                    }
+
+                    while (client_sockets[slot].fd != -1) {
+                        slot += 1;
+                    }
+                    connection_setup(&connections[slot], connection);
+                    client_sockets[slot].fd = connection;
+                    client_sockets[slot].events = POLLIN;
+                    n_connections += 1;
+                    metrics.connections_accepted += 1;
+                }
 
-                    // limit to one connection at a time
+                // Stop accepting while all slots are taken
+                if (n_connections == MAX_CONNECTIONS) {
                     sockets[0].events = 0;
-                    sockets[2].fd = connection;
-                    sockets[2].events = POLLIN;
                 }
             } else if (s == dht_socket) {
 
@@ -475,23 +1144,65 @@ int main(int argc, char** argv) {
 
             } else {
 
-                assert(s == state.sock);
+                struct connection_state* state = &connections[i - 2];
+                assert(s == state->sock);
 
                 // Call the 'handle_connection' function to process the incoming data on the socket.
-                bool cont = handle_connection(&state);
-                if (!cont) {  // get ready for a new connection
+                bool cont = handle_connection(state);
+                if (!cont) {  // free the slot for a new connection
+                    if (state->batch) {
+                        batch_abandon(state->batch);
+                        state->batch = NULL;
+                    }
+                    close(state->sock);
+                    sockets[i].fd = -1;
+                    sockets[i].events = 0;
+                    n_connections -= 1;
                     sockets[0].events = POLLIN;
-                    sockets[2].fd = -1;
-                    sockets[2].events = 0;
+                } else if (state->batch) {
+                    // Do not read further requests until the batch is answered
+                    sockets[i].events = 0;
                 }
             }
 
         }
-        if(pthread_join(thread, NULL) != 0){
-            perror("Thread join");
-            exit(EXIT_FAILURE);
+
+        // Continue with the requests that arrived during a batch
+        for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+            struct connection_state* state = &connections[i];
+            if (client_sockets[i].fd == -1 || client_sockets[i].events != 0 || state->batch) {
+                continue;
+            }
+
+            if (process_buffered(state)) {
+                client_sockets[i].events = state->batch ? 0 : POLLIN;
+            } else {
+                close(state->sock);
+                client_sockets[i].fd = -1;
+                n_connections -= 1;
+                sockets[0].events = POLLIN;
+            }
+        }
+        metrics.connections_active = n_connections;
+
+        timer_dispatch();
+
+        // Send the replies held back until the changes they acknowledge were committed
+        for (size_t i = 0; wal_enabled() && i < MAX_CONNECTIONS; i += 1) {
+            struct connection_state* state = &connections[i];
+            if (client_sockets[i].fd == -1 || state->batch || state->output.length == 0) {
+                continue;
+            }
+            if (!connection_flush(state)) {
+                close(state->sock);
+                client_sockets[i].fd = -1;
+                n_connections -= 1;
+                sockets[0].events = POLLIN;
+            }
         }
 
+        // Transmit DHT messages queued while processing events and timers
+        dht_flush();
     }
 
 